@@ -0,0 +1,140 @@
+// Throughput of the DATA dot-stuffing kernel against the per-line loop it
+// replaced, over a body with dots at line starts and within lines.
+#include <dot_stuffing.h>
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+enum { BODY_SIZE = 16 * 1024 * 1024 };
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// What `write_data_payload` did before, which only stuffed lone dots.
+static void stuff_per_line(char const *body, size_t body_len, FILE *stream) {
+    static char const pattern[] = "\r\n";
+    static size_t const pattern_len = sizeof(pattern) - 1;
+
+    size_t start = 0;
+    size_t end = 0;
+    while (start < body_len) {
+        while (end + pattern_len <= body_len &&
+               strncmp(body + end, pattern, pattern_len)) { ++end; }
+        if (end + pattern_len > body_len) { end = body_len; }
+
+        if (end - start == 1 && body[start] == '.') {
+            fprintf(stream, ".");
+        }
+
+        if (end < body_len) { end += pattern_len; }
+
+        fprintf(stream, "%.*s", (int)(end - start), body + start);
+
+        start = end;
+    }
+}
+
+static void stuff_kernel(char const *body, size_t body_len, FILE *stream) {
+    size_t start = 0;
+    size_t dot = dot_stuffing_find(body, body_len, 0);
+    while (true) {
+        fwrite(body + start, 1, dot - start, stream);
+        if (dot == body_len) { break; }
+        fputc('.', stream);
+        start = dot;
+        dot = dot_stuffing_find(body, body_len, dot + 1);
+    }
+}
+
+// Finding the dots alone, as is done for every body when it is loaded.
+static void scan(char const *body, size_t body_len, FILE *stream) {
+    size_t dots = 0;
+    for (size_t dot = dot_stuffing_find(body, body_len, 0); dot != body_len;
+         dot = dot_stuffing_find(body, body_len, dot + 1)) { ++dots; }
+    fprintf(stream, "%zu", dots);
+}
+
+static void run(char const *name,
+    void (*stuff)(char const *body, size_t body_len, FILE *stream),
+    char const *body, size_t body_len, char **output, size_t *output_size)
+{
+    size_t rounds = 0;
+    double start = now();
+    double elapsed;
+    do {
+        free(*output);
+        FILE *stream = open_memstream(output, output_size);
+        if (!stream) {
+            perror("open_memstream");
+            exit(EXIT_FAILURE);
+        }
+        stuff(body, body_len, stream);
+        fclose(stream);
+        ++rounds;
+        elapsed = now() - start;
+    } while (elapsed < 1);
+
+    printf("%-10s %8.1f MiB/s\n",
+        name, rounds * (body_len / 1048576.0) / elapsed);
+}
+
+int main(void) {
+    static char const *const lines[] = {
+        "Lorem ipsum dolor sit amet, consectetur adipiscing elit.\r\n",
+        "sed do eiusmod tempor incididunt ut labore et dolore magna\r\n",
+        ".leading dot\r\n",
+        "a.b.c dots inside the line\r\n",
+        ".\r\n",
+    };
+    static size_t const weights[] = { 8, 8, 1, 4, 1 };
+
+    char *body = malloc(BODY_SIZE);
+    if (!body) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    size_t body_len = 0;
+    srand(1);
+    while (true) {
+        size_t pick = rand() % 22;
+        size_t i = 0;
+        while (pick >= weights[i]) { pick -= weights[i++]; }
+        size_t len = strlen(lines[i]);
+        if (body_len + len > BODY_SIZE) { break; }
+        memcpy(body + body_len, lines[i], len);
+        body_len += len;
+    }
+
+    char *output = NULL;
+    size_t output_size = 0;
+    run("per-line", stuff_per_line, body, body_len, &output, &output_size);
+    run("scan", scan, body, body_len, &output, &output_size);
+    run("kernel", stuff_kernel, body, body_len, &output, &output_size);
+
+    // Removing a dot from the start of every line gives the body back.
+    size_t j = 0;
+    for (size_t i = 0; i < output_size; ++i) {
+        if (output[i] == '.' &&
+            (i == 0 || (i >= 2 && output[i - 2] == '\r' &&
+                        output[i - 1] == '\n')))
+        { ++i; }
+        if (j == body_len || output[i] != body[j++]) {
+            fprintf(stderr, "kernel output does not unstuff to the body\n");
+            return EXIT_FAILURE;
+        }
+    }
+    if (j != body_len) {
+        fprintf(stderr, "kernel output is short\n");
+        return EXIT_FAILURE;
+    }
+
+    free(output);
+    free(body);
+    return EXIT_SUCCESS;
+}
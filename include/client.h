@@ -4,22 +4,77 @@
 #include <sys/queue.h>
 
 #include <maildir.h>
-#include <fd_set.h>
+#include <event_loop.h>
+#include <worker_pool.h>
+#include <tls.h>
+#include <dns_cache.h>
+#include <host_table.h>
+#include <resolver.h>
+#include <transport_map.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+enum { CLIENT_DESTINATION_BUCKETS = 1024 };
 
 struct client_message;
 struct client_session;
+struct client_destination;
+struct client_retry;
 
 struct client {
+    struct event_loop *loop;
+
     struct maildir maildir;
+    struct event_handler maildir_handler;
+
     char *host;
     TAILQ_HEAD(, client_message) messages;
-    LIST_HEAD(, client_session) sessions;
+
+    struct worker_pool workers;
+
+    bool starttls;
+    struct tls tls;
+
+    struct dns_cache dns_cache;
+    // Shared by the sessions of the main loop, also warms the cache up for
+    // destinations held back by the session caps.
+    struct resolver resolver;
+    // One for each worker thread, c-ares channels are not thread-safe.
+    struct resolver *worker_resolvers;
+
+    struct host_table hosts;
+
+    struct transport_map const *transport_map;
+
+    LIST_HEAD(, client_destination) destinations;
+    // The same destinations, keyed by host.
+    LIST_HEAD(client_destination_bucket, client_destination)
+        destination_buckets[CLIENT_DESTINATION_BUCKETS];
+    // Destinations with deliveries held back by `max_sessions`.
+    TAILQ_HEAD(, client_destination) waiting;
+
+    size_t sessions_size;
+    size_t evicting_size;
+    size_t max_sessions;
+    size_t max_destination_sessions;
+
+    // Spool files deferred by some destination wait in `retries` for their
+    // timers, then in `due_retries` for the rate to let them out.
+    TAILQ_HEAD(, client_retry) retries;
+    TAILQ_HEAD(, client_retry) due_retries;
+    struct event_timer retry_timer;
+    double retry_tokens;
+    uint64_t retry_refilled_at;
+    unsigned retry_seed;
+    // Messages released from here on are not retried.
+    bool finalizing;
 };
 
-void client_initialize(struct client *client,
-    char const* maildir_path, char const* host);
-void client_subscribe(struct client *client, struct fd_set *fd_set);
-void client_notify(struct client *client, struct fd_set const *fd_set);
+void client_initialize(struct client *client, struct event_loop *loop,
+    char const* maildir_path, char const* host, size_t workers,
+    size_t max_sessions, size_t max_destination_sessions, bool starttls,
+    struct transport_map const *transport_map);
 void client_finalize(struct client *client);
 
 #endif
@@ -0,0 +1,39 @@
+#ifndef DNS_CACHE_H
+#define DNS_CACHE_H
+
+#include <sys/queue.h>
+#include <pthread.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+enum { DNS_CACHE_BUCKETS = 1024 };
+
+struct dns_cache_entry;
+
+// DNS replies shared by every resolver of the client, keyed by name and
+// type and kept for as long as their TTLs allow. Names that do not exist
+// and ones without records of a type are cached too (RFC 2308).
+struct dns_cache {
+    pthread_mutex_t mutex;
+    size_t entries_size;
+    // Most recently used first.
+    TAILQ_HEAD(dns_cache_entry_list, dns_cache_entry) entries;
+    LIST_HEAD(dns_cache_bucket, dns_cache_entry) buckets[DNS_CACHE_BUCKETS];
+};
+
+void dns_cache_initialize(struct dns_cache *cache);
+// On a hit `*reply` is set to a copy of the cached reply, to be freed by
+// the caller, and `*status` to the c-ares status it came with.
+bool dns_cache_find(struct dns_cache *cache, char const *name, int type,
+    int *status, unsigned char **reply, int *reply_size);
+// Only definite answers are kept. Addresses of MX hosts found among the
+// additional records of an MX reply are cached as replies of their own.
+void dns_cache_store(struct dns_cache *cache, char const *name, int type,
+    int status, unsigned char const *reply, int reply_size);
+void dns_cache_finalize(struct dns_cache *cache);
+
+#endif
+
+
+/*! \file */
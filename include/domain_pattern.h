@@ -0,0 +1,15 @@
+#ifndef DOMAIN_PATTERN_H
+#define DOMAIN_PATTERN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// "example.org" matches the domain itself, "*.example.org" its subdomains
+// and "*" every domain, regardless of case.
+bool domain_pattern_matches(char const *pattern, char const *domain,
+    size_t domain_len);
+
+#endif
+
+
+/*! \file */
@@ -0,0 +1,14 @@
+#ifndef DOT_STUFFING_H
+#define DOT_STUFFING_H
+
+#include <stddef.h>
+
+// Offset of the first dot at or past `offset` that starts a line of `data`
+// and so takes another one in front of it in DATA (RFC 5321, section
+// 4.5.2), or `size` if there is none. `data` is taken to start a line.
+size_t dot_stuffing_find(char const *data, size_t size, size_t offset);
+
+#endif
+
+
+/*! \file */
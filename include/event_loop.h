@@ -0,0 +1,108 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <sys/epoll.h>
+#include <sys/queue.h>
+#include <pthread.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define container_of(pointer, type, member) \
+    ((type*)((char*)(pointer) - offsetof(type, member)))
+
+enum { EVENT_LOOP_BATCH_SIZE = 256 };
+
+// Timers live in a hierarchical timing wheel of millisecond ticks: every
+// level has `EVENT_LOOP_WHEEL_SLOTS` slots, each spanning as many ticks as
+// the whole level below it.
+enum {
+    EVENT_LOOP_WHEEL_BITS = 6,
+    EVENT_LOOP_WHEEL_SLOTS = 1 << EVENT_LOOP_WHEEL_BITS,
+    EVENT_LOOP_WHEEL_LEVELS = 4,
+};
+
+struct io_ring;
+
+struct event_handler {
+    int fd;
+    uint32_t events;
+
+    // `events` is zero when the handler is woken by `event_loop_schedule`.
+    void (*notify)(struct event_handler *handler, uint32_t events);
+
+    bool scheduled;
+    TAILQ_ENTRY(event_handler) scheduled_link;
+
+    // Guarded by the mutex of the loop the handler was posted to.
+    bool posted;
+    TAILQ_ENTRY(event_handler) posted_link;
+};
+
+struct event_timer {
+    LIST_ENTRY(event_timer) link;
+
+    bool armed;
+    uint64_t deadline;
+
+    void (*expire)(struct event_timer *timer);
+};
+
+struct event_loop {
+    int epoll_fd;
+
+    pthread_t thread;
+
+    uint64_t now;
+
+    size_t ready_size;
+    struct epoll_event ready[EVENT_LOOP_BATCH_SIZE];
+
+    size_t scheduled_size;
+    TAILQ_HEAD(, event_handler) scheduled;
+
+    // The next tick to expire; slots only ever hold timers due after it.
+    uint64_t wheel_time;
+    size_t timers_size;
+    // Bit `i` is set when slot `i` of the level may be non-empty.
+    uint64_t wheel_occupied[EVENT_LOOP_WHEEL_LEVELS];
+    LIST_HEAD(, event_timer)
+        wheel[EVENT_LOOP_WHEEL_LEVELS][EVENT_LOOP_WHEEL_SLOTS];
+    LIST_HEAD(, event_timer) expired;
+
+    struct event_handler wakeup_handler;
+    pthread_mutex_t mutex;
+    TAILQ_HEAD(, event_handler) posted;
+
+    // Set when spool and socket I/O should go through io_uring.
+    struct io_ring *ring;
+};
+
+void event_handler_initialize(struct event_handler *handler,
+    void (*notify)(struct event_handler *handler, uint32_t events));
+
+void event_timer_initialize(struct event_timer *timer,
+    void (*expire)(struct event_timer *timer));
+
+void event_loop_initialize(struct event_loop *loop);
+void event_loop_add(struct event_loop *loop, struct event_handler *handler,
+    int fd, uint32_t events);
+void event_loop_modify(struct event_loop *loop, struct event_handler *handler,
+    uint32_t events);
+void event_loop_remove(struct event_loop *loop, struct event_handler *handler);
+void event_loop_schedule(struct event_loop *loop,
+    struct event_handler *handler);
+void event_loop_post(struct event_loop *loop, struct event_handler *handler);
+void event_loop_cancel(struct event_loop *loop, struct event_handler *handler);
+void event_loop_arm(struct event_loop *loop, struct event_timer *timer,
+    uint64_t timeout);
+void event_loop_disarm(struct event_loop *loop, struct event_timer *timer);
+void event_loop_run(struct event_loop *loop);
+void event_loop_flush(struct event_loop *loop);
+void event_loop_finalize(struct event_loop *loop);
+
+#endif
+
+
+/*! \file */
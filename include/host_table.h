@@ -0,0 +1,48 @@
+#ifndef HOST_TABLE_H
+#define HOST_TABLE_H
+
+#include <sys/queue.h>
+#include <pthread.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum { HOST_TABLE_BUCKETS = 1024 };
+
+struct host_table_entry;
+
+// What sessions have learnt about connecting to MX hosts, shared by every
+// session and worker thread of the client. Hosts failing time after time
+// have their circuits opened: they are skipped for a while, after which a
+// single session is let through to see whether they have recovered.
+struct host_table {
+    pthread_mutex_t mutex;
+    size_t entries_size;
+    // Most recently used first.
+    TAILQ_HEAD(host_table_entry_list, host_table_entry) entries;
+    LIST_HEAD(host_table_bucket, host_table_entry) buckets[HOST_TABLE_BUCKETS];
+};
+
+void host_table_initialize(struct host_table *table);
+// The address family the last connection to `host` was made over, or
+// `AF_UNSPEC` if there was none lately.
+int host_table_family(struct host_table *table, char const *host);
+// Lower for hosts that are better to try first; hosts whose connections
+// take about as long rank the same. Open circuits rank last.
+unsigned host_table_rank(struct host_table *table, char const *host);
+// False while the circuit of `host` is open.
+bool host_table_usable(struct host_table *table, char const *host);
+// `latency` is the milliseconds connecting took.
+void host_table_connected(struct host_table *table, char const *host,
+    int family, uint64_t latency);
+// A host succeeds once it greets us and fails when it cannot be connected
+// to or refuses to talk.
+void host_table_succeeded(struct host_table *table, char const *host);
+void host_table_failed(struct host_table *table, char const *host);
+void host_table_finalize(struct host_table *table);
+
+#endif
+
+
+/*! \file */
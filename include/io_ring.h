@@ -0,0 +1,70 @@
+#ifndef IO_RING_H
+#define IO_RING_H
+
+#include <event_loop.h>
+
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct io_ring_request {
+    // `result` is the syscall result or a negated `errno` value.
+    void (*complete)(struct io_ring_request *request, int result);
+    bool in_flight;
+    bool cancelled;
+};
+
+struct io_ring {
+    struct event_loop *loop;
+
+    struct event_handler handler;
+    struct event_handler submit_handler;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    unsigned queued;
+    size_t in_flight;
+};
+
+void io_ring_request_initialize(struct io_ring_request *request,
+    void (*complete)(struct io_ring_request *request, int result));
+
+int io_ring_initialize(struct io_ring *ring, struct event_loop *loop,
+    unsigned entries);
+void io_ring_read(struct io_ring *ring, struct io_ring_request *request,
+    int fd, void *buffer, size_t size, uint64_t offset);
+void io_ring_recv(struct io_ring *ring, struct io_ring_request *request,
+    int fd, void *buffer, size_t size);
+void io_ring_sendmsg(struct io_ring *ring, struct io_ring_request *request,
+    int fd, struct msghdr const *msghdr);
+void io_ring_sendmsg_zc(struct io_ring *ring, struct io_ring_request *request,
+    int fd, struct msghdr const *msghdr);
+void io_ring_unlink(struct io_ring *ring, struct io_ring_request *request,
+    int dir_fd, char const *path);
+void io_ring_cancel(struct io_ring *ring, struct io_ring_request *request);
+// Submits whatever is queued and waits for every request to complete.
+void io_ring_wait(struct io_ring *ring);
+void io_ring_finalize(struct io_ring *ring);
+
+#endif
+
+
+/*! \file */
@@ -1,26 +1,82 @@
 #ifndef MAILDIR_H
 #define MAILDIR_H
 
-#include <dirent.h>
 #include <sys/queue.h>
 
-#include <fd_set.h>
+#include <event_loop.h>
+#include <queue_index.h>
+
+#include <stdbool.h>
+#include <stddef.h>
 
 struct maildir_message;
 
+// Spool files in "out", found by an initial scan and inotify. Their names
+// are kept in a hash set, the ones not yet discovered queued in order, and
+// stay there until the files go, so that a rescan after inotify events were
+// lost hands out nothing twice.
+//
+// Files whose headers were parsed once are recorded in "queue.index", so
+// that on startup their age and domains are known without opening them, as
+// is what deferred attempts left of them.
+// On startup the indexed files are handed out at once, oldest first, a
+// record being checked against its file only as that is opened. The initial
+// scan only looks up the age of the files it finds unindexed, and hands
+// those out oldest first within each of its rounds.
 struct maildir {
     char* path;
+    // The "out" directory, which messages are named relative to.
+    int out_fd;
+    // Where messages with nothing left to try are moved to.
+    int failed_fd;
+
+    struct event_loop *loop;
+    struct event_handler *observer;
+
+    struct event_handler inotify_handler;
+
+    // Scans read `out_fd` in batches into `scan_buffer`, each of them
+    // marking the names it comes across with its `generation`.
+    struct event_handler scan_handler;
+    bool scanning;
+    char *scan_buffer;
+    unsigned generation;
+    // Until the initial scan is done and all it found is handed out.
+    bool ordering;
+    TAILQ_HEAD(, maildir_message) unaged;
+    struct maildir_message **batch;
+    size_t batch_size;
+    size_t batch_capacity;
 
-    int inotify_fd;
-    DIR *dir;
+    struct queue_index index;
+    size_t indexed_size;
 
-    STAILQ_HEAD(, maildir_message) messages;
+    size_t messages_size;
+    size_t buckets_size;
+    LIST_HEAD(maildir_bucket, maildir_message) *buckets;
+    TAILQ_HEAD(, maildir_message) pending;
+    struct queue_index_entry discovered;
 };
 
-void maildir_initialize(struct maildir *maildir, char const *path);
-void maildir_subscribe(struct maildir *maildir, struct fd_set *fd_set);
-void maildir_notify(struct maildir *maildir, struct fd_set const *fd_set);
-char *maildir_discover_message(struct maildir *maildir);
+void maildir_initialize(struct maildir *maildir, struct event_loop *loop,
+    char const *path, struct event_handler *observer);
+// The next message in `out_fd`, valid until the loop next runs the
+// maildir, or NULL if there is none yet. Of an indexed one every field is
+// set, of another only `name`.
+struct queue_index_entry const *maildir_discover_message(
+    struct maildir *maildir);
+// Records a discovered message once its headers are parsed, `domains` being
+// as above, unless its record is that of the same file.
+void maildir_index_message(struct maildir *maildir, char const *name,
+    char const *sender, size_t sender_len,
+    char const *domains, size_t domains_len);
+// Records the attempts, `retry_at` and recipients of `progress` for the
+// indexed message it names, for a restart to pick up.
+void maildir_defer_message(struct maildir *maildir,
+    struct queue_index_entry const *progress);
+// Moves a message with nothing left to try out of the spool, so that a
+// restart does not send it again.
+void maildir_set_aside(struct maildir *maildir, char const *name);
 void maildir_finalize(struct maildir *maildir);
 
 #endif
@@ -1,10 +1,13 @@
 #ifndef MESSAGE_H
 #define MESSAGE_H
 
-#include <fd_set.h>
+#include <event_loop.h>
+#include <io_ring.h>
 
 #include <sys/queue.h>
+#include <pthread.h>
 
+#include <stdbool.h>
 #include <stddef.h>
 
 enum message_state {
@@ -30,6 +33,10 @@ struct message_recepient {
 
     char *user;
     size_t user_len;
+
+    // Sent or refused for good; the others are left to a retry.
+    bool settled;
+    bool rejected;
 };
 
 struct message_destination {
@@ -39,12 +46,40 @@ struct message_destination {
     size_t host_len;
 
     TAILQ_HEAD(, message_recepient) recepients;
+
+    // Sent, refused for good or skipped; the others are left to a retry.
+    bool settled;
+    bool rejected;
+};
+
+struct message;
+
+struct message_observer {
+    LIST_ENTRY(message_observer) link;
+    struct message *message;
+    struct event_loop *loop;
+    struct event_handler *handler;
 };
 
+// A message is loaded on the loop that created it but may be shared with
+// sessions running on other loops: `state` is published atomically and
+// `mutex` guards the observers and the body request.
 struct message {
     enum message_state state;
 
-    char *path;
+    struct event_loop *loop;
+    struct event_handler handler;
+    struct io_ring_request read_request;
+
+    pthread_mutex_t mutex;
+    LIST_HEAD(, message_observer) observers;
+    bool body_requested;
+
+    bool released;
+
+    // The spool file, named relative to the directory `dir_fd`.
+    int dir_fd;
+    char *name;
     int fd;
 
     size_t offset;
@@ -62,20 +97,56 @@ struct message {
     size_t sender_len;
 
     TAILQ_HEAD(, message_destination) destinations;
+    size_t pending_destinations;
 
-    char *body;
+    // Called on the creating loop once the message is released for good,
+    // right before it is destroyed.
+    void (*finished)(void *arg, struct message *message);
+    void *finished_arg;
+
+    // The body is not kept in memory but scanned once, a window at a time.
+    // The spool file stays open afterwards for sessions to read or send the
+    // body from, it starts at `body_offset` there.
+    size_t body_offset;
     size_t body_len;
+    bool body_binary;
+    bool body_dot_lines;
+    // The body is empty or its last line is terminated.
+    bool body_ends_line;
 
     size_t ref_count;
 };
 
-struct message *message_create(char const *path);
+void message_observer_initialize(struct message_observer *observer,
+    struct event_loop *loop, struct event_handler *handler);
+
+struct message *message_create(struct event_loop *loop, int dir_fd,
+    char const *name);
 struct message *message_retain(struct message *message);
-void message_subscribe(struct message *message, struct fd_set *fd_set);
-void message_notify(struct message *message, struct fd_set const *fd_set);
+enum message_state message_get_state(struct message *message);
+void message_add_observer(struct message *message,
+    struct message_observer *observer);
+void message_remove_observer(struct message_observer *observer);
 void message_start_loading_body(struct message *message);
+void message_set_finished_callback(struct message *message,
+    void (*finished)(void *arg, struct message *message), void *arg);
+// Settles a destination an earlier attempt already sent the message to,
+// before the message is handed to sessions.
+void message_skip_destination(struct message *message,
+    struct message_destination *destination);
 void message_mark_as_sent(struct message *message,
-    char const* destination_host);
+    struct message_destination *destination);
+// The destination refused the message for good, its spool file stays.
+void message_mark_as_rejected(struct message *message,
+    struct message_destination *destination);
+// Only the session holding the destination settles its recipients, one by
+// one as the server replies.
+void message_mark_recepient_as_sent(struct message_recepient *recepient);
+void message_mark_recepient_as_rejected(struct message_recepient *recepient);
+// Whether none of the recipients of the destination is left to a retry, and
+// if so, whether any of them was sent.
+bool message_recepients_settled(
+    struct message_destination const *destination, bool *sent);
 void message_release(struct message *message);
 
 #endif
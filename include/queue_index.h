@@ -0,0 +1,64 @@
+#ifndef QUEUE_INDEX_H
+#define QUEUE_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A spool file as it was when its headers were first parsed.
+struct queue_index_entry {
+    char const *name;
+    uint64_t inode;
+    // Nanoseconds since the epoch.
+    int64_t mtime;
+    uint64_t size;
+    char const *sender;
+    size_t sender_len;
+    // Destination domains, each followed by '\0'.
+    char const *domains;
+    size_t domains_len;
+
+    // Once deferred: the attempts so far, when the next one is due in
+    // milliseconds since the epoch, and the recipients left to it and those
+    // that refused the message, each as user@host followed by '\0'.
+    uint32_t attempts;
+    int64_t retry_at;
+    char const *deferred;
+    size_t deferred_len;
+    char const *rejected;
+    size_t rejected_len;
+};
+
+// Spool files kept in an append-only file next to the spool, so that a
+// restart knows its backlog without opening any of them. The file is read
+// through a mapping on startup; entries are appended as files are added,
+// deferred and removed, a later entry for a name taking the place of the
+// earlier one, and the file is rewritten once stale records make up most
+// of it.
+struct queue_index {
+    char *path;
+    int fd;
+    // Records in the file, removals among them.
+    size_t records;
+    size_t removals;
+};
+
+// Calls `load` for every record of the index at `path`, which is created
+// if need be, in the order they were appended; removals only have `name`
+// set. A record torn by a crash and whatever follows it are cut off.
+void queue_index_initialize(struct queue_index *index, char const *path,
+    void (*load)(void *arg, struct queue_index_entry const *entry,
+        bool removed),
+    void *arg);
+void queue_index_add(struct queue_index *index,
+    struct queue_index_entry const *entry);
+void queue_index_remove(struct queue_index *index, char const *name);
+// Starts the file over with the entries `add_all` adds to it.
+void queue_index_rewrite(struct queue_index *index,
+    void (*add_all)(void *arg, struct queue_index *index), void *arg);
+void queue_index_finalize(struct queue_index *index);
+
+#endif
+
+
+/*! \file */
@@ -0,0 +1,45 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <dns_cache.h>
+#include <event_loop.h>
+
+#include <sys/queue.h>
+
+#include <ares.h>
+
+#include <stdbool.h>
+
+struct resolver_socket;
+struct resolver_query;
+
+// A c-ares channel driven by an event loop and shared by everything that
+// runs on it. Queries are answered from `cache` where it can and their
+// replies are added to it.
+struct resolver {
+    struct event_loop *loop;
+    struct dns_cache *cache;
+
+    bool initialized;
+    ares_channel channel;
+    struct event_timer timer;
+    LIST_HEAD(, resolver_socket) sockets;
+    LIST_HEAD(, resolver_query) queries;
+};
+
+// Returns `false` if the channel could not be set up; the resolver is to
+// be finalized nonetheless.
+bool resolver_initialize(struct resolver *resolver, struct event_loop *loop,
+    struct dns_cache *cache);
+// Cached replies are passed to `callback` before this returns.
+void resolver_query(struct resolver *resolver, char const *name, int type,
+    ares_callback callback, void *arg);
+// Forgets the pending queries made with `arg`, their callbacks are not
+// called. Replies still make it into the cache.
+void resolver_cancel(struct resolver *resolver, void *arg);
+void resolver_finalize(struct resolver *resolver);
+
+#endif
+
+
+/*! \file */
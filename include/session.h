@@ -1,12 +1,19 @@
 #ifndef SESSION_H
 #define SESSION_H
 
-#include <fd_set.h>
+#include <event_loop.h>
+#include <host_table.h>
+#include <io_ring.h>
 #include <message.h>
+#include <resolver.h>
+#include <tcp_options.h>
+#include <tls.h>
+#include <transport_map.h>
 
 #include <netdb.h>
 #include <sys/socket.h>
 #include <sys/queue.h>
+#include <sys/uio.h>
 
 #include <ares.h>
 
@@ -17,55 +24,245 @@ enum session_state {
     SESSION_RESOLVING_DNS,
     SESSION_CONNECTING,
     SESSION_RECEIVING_GREETING,
+    SESSION_SENDING_EHLO,
+    SESSION_SENDING_STARTTLS,
+    SESSION_HANDSHAKING,
     SESSION_SENDING_HELO,
     SESSION_SENDING_MAIL_OR_RCPT,
     SESSION_SENDING_DATA,
     SESSION_LOADING_MESSAGE_BODY,
     SESSION_SENDING_DATA_PAYLOAD,
+    SESSION_SENDING_BDAT,
+    SESSION_ABANDONING_DATA,
     SESSION_SENDING_RSET,
+    SESSION_IDLE,
+    SESSION_RESUMING,
     SESSION_SENDING_QUIT,
     SESSION_CLOSED,
 };
 
+// Service extensions advertised in the EHLO reply.
+enum session_extension {
+    SESSION_EXTENSION_PIPELINING = 1 << 0,
+    SESSION_EXTENSION_CHUNKING = 1 << 1,
+    SESSION_EXTENSION_BINARYMIME = 1 << 2,
+    SESSION_EXTENSION_STARTTLS = 1 << 3,
+};
+
+// RFC 3463 enhanced status code, `class` is zero when a reply has none.
+struct session_status {
+    int class;
+    int subject;
+    int detail;
+};
+
+// Offset into `response_buffer` of a reply line's text, past the code and
+// the separator after it.
+struct session_response_line {
+    size_t offset;
+    size_t len;
+};
+
+enum session_request_part_type {
+    SESSION_REQUEST_TEXT,
+    SESSION_REQUEST_BODY,
+};
+
+// A slice of a request's own buffer or of the body of its message, the
+// latter sent straight from the spool file.
+struct session_request_part {
+    enum session_request_part_type type;
+    size_t offset;
+    size_t len;
+};
+
+// Commands and body windows are rendered into `buffer`, which is kept for
+// reuse, while body slices are only referred to. `len` counts the bytes of
+// all parts and `offset` how many of them have been sent, `part_offset`
+// being the part of that in `part`.
+struct session_request {
+    size_t capacity;
+    size_t size;
+    char *buffer;
+    size_t parts_capacity;
+    size_t parts_size;
+    struct session_request_part *parts;
+    struct message *message;
+    size_t len;
+    // Cleared once a window is rendered, the buffer is then reused before
+    // the server has replied to it.
+    bool zerocopy;
+
+    size_t offset;
+    size_t part;
+    size_t part_offset;
+};
+
+enum { SESSION_REQUEST_IOVS = 64 };
+
+// Connections made at once to the addresses of an MX host.
+enum { SESSION_ATTEMPTS = 4 };
+
+struct session;
+
+// A connection raced against the others to the same MX host; `fd` is -1
+// while the slot is free.
+struct session_attempt {
+    struct session *session;
+    struct event_handler handler;
+    int fd;
+    struct sockaddr_storage sockaddr;
+    uint64_t started_at;
+};
+
 struct session_message;
 
 struct session {
     enum session_state state;
 
+    struct event_loop *loop;
+    struct event_handler *observer;
+
+    struct event_handler handler;
+    struct io_ring_request recv_request;
+    struct io_ring_request send_request;
+    struct message_observer message_observer;
+
+    // Rearmed on every state change and every chunk of a request sent.
+    struct event_timer timer;
+    enum session_state timer_state;
+    size_t timer_sent;
+    size_t sent;
+
     char *host;
     char *destination_host;
+    // Set when mail goes to a next hop of the transport map rather than to
+    // the mail exchangers of `destination_host`.
+    struct transport_route const *route;
+    uint16_t port;
 
-    bool channel_initialized;
-    ares_channel channel;
+    // Shared with the other sessions on the loop.
+    struct resolver *resolver;
 
     struct ares_mx_reply *first_mx_reply;
     struct ares_mx_reply *mx_reply;
+    // The domain itself when it has no MX records (RFC 5321, section 5.1).
+    struct ares_mx_reply implicit_mx_reply;
 
-    struct hostent *hostent;
-    size_t addr_index;
+    // Addresses of `mx_reply`, the IPv6 ones first, looked up in parallel
+    // and connected to by racing the two families (RFC 8305). `resolving`
+    // has a bit set for each of the two lookups not yet answered.
+    struct host_table *hosts;
+    struct hostent *hostents[2];
+    // Stands in for the lookups when the route names an address; its
+    // `h_addr_list` is NULL otherwise.
+    struct hostent literal;
+    char *literal_addrs[2];
+    char literal_address[16];
+    size_t addr_indexes[2];
+    unsigned resolving;
+    int preferred_family;
+    int last_family;
+    bool attempted;
+    bool resolution_delayed;
+    size_t attempts_size;
+    struct session_attempt attempts[SESSION_ATTEMPTS];
+    // Staggers the attempts, or waits for the preferred family to resolve.
+    struct event_timer attempt_timer;
 
     int fd;
     struct sockaddr_storage sockaddr;
+    // Large sends skip the copy into the kernel unless it has turned out to
+    // copy them anyway; their completions then have to be read off `fd`.
+    bool zerocopy;
+    bool zerocopy_sent;
+    struct tcp_options const *tcp_options;
+    bool corked;
+
+    // STARTTLS is offered to servers when `tls` is set. Once `ssl` is, all
+    // I/O goes through OpenSSL on readiness, which may want `tls_events`
+    // in addition to the ones the exchange itself needs.
+    struct tls *tls;
+    SSL *ssl;
+    uint32_t tls_events;
 
     size_t response_capacity;
     size_t response_size;
     char *response_buffer;
-    size_t response_line_len;
+    // The parser resumes at `response_scanned` on the line starting at
+    // `response_line_start`, the reply itself always starts the buffer.
+    size_t response_line_start;
+    size_t response_scanned;
+    size_t response_lines_capacity;
+    size_t response_lines_size;
+    struct session_response_line *response_lines;
+    // Set along with `response_code` once the final line is in.
+    size_t response_len;
     int response_code;
+    struct session_status response_status;
+
+    unsigned extensions;
 
-    size_t request_size;
-    char *request_buffer;
-    size_t request_offset;
+    // Set while a parked connection is checked with RSET before reuse.
+    bool resuming;
+    // Set once a server has been ready to take mail; a session closing
+    // before that has failed.
+    bool established;
+
+    // The request being sent; `dispatch` renders the next one into the
+    // other of the two, so that neither is reallocated while it is sent.
+    struct session_request requests[2];
+    struct session_request *request;
+    // A run of parts gathered for a single send.
+    struct iovec request_iovs[SESSION_REQUEST_IOVS];
+    struct msghdr request_msghdr;
+
+    // Payloads read into windows are rendered a window at a time, the next
+    // one once the previous one is sent, while `streaming` is set.
+    // `payload_offset` is the part of the body rendered so far in DATA.
+    bool streaming;
+    size_t payload_offset;
+    // Lines of the body are scanned for dots to stuff in here.
+    char *body_window;
 
     TAILQ_HEAD(, session_message) messages;
+    // May be read from other threads to balance load between sessions.
+    size_t messages_size;
+    // The recipient to send next and the one whose reply comes next; with
+    // PIPELINING every command of a transaction goes out at once. Those an
+    // earlier attempt settled are passed over.
     struct message_recepient *message_recepient;
+    struct message_recepient *reply_recepient;
+    bool sender_replied;
+    bool sender_accepted;
+    // A reply to MAIL or to the content asked to try again later. A
+    // transaction failing without one is refused for good and not retried;
+    // recipients are deferred or refused by their own replies.
+    bool deferred;
+    // Recipients accepted so far, settled once the content is taken. LMTP
+    // answers the end of the data once for each of them, in order;
+    // `data_replies` of those are in so far.
+    struct message_recepient **accepted;
+    size_t accepted_capacity;
+    size_t accepted_recepients;
+    size_t data_replies;
+
+    // BDAT progress: chunks framed, body bytes framed and replies awaited.
+    size_t chunks_written;
+    size_t chunk_offset;
+    size_t chunk_replies;
+    bool chunk_rejected;
 };
 
-void session_initialize(struct session *session,
-    char const *host, char const *destination_host);
-void session_subscribe(struct session *session, struct fd_set *fd_set);
-void session_notify(struct session *session, struct fd_set const *fd_set);
-void session_enqueue_message(struct session *session, struct message* message);
+void session_initialize(struct session *session, struct event_loop *loop,
+    char const *host, char const *destination_host,
+    struct transport_route const *route, struct tls *tls,
+    struct resolver *resolver, struct host_table *hosts,
+    struct event_handler *observer);
+void session_enqueue_message(struct session *session,
+    struct message* message, struct message_destination *destination);
+// Ends the session early if it has nothing left to send.
+void session_quit_idle(struct session *session);
 void session_finalize(struct session *session);
 
 #endif
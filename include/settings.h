@@ -1,10 +1,37 @@
 #ifndef SETTINGS_H
 #define SETTINGS_H
 
+#include <tcp_options.h>
+#include <transport_map.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
 struct settings {
     char *log_path;
     char *maildir_path;
     char *host;
+    char *io_engine;
+    size_t workers;
+    // Seconds a drained session stays connected, zero to QUIT at once.
+    size_t idle_timeout;
+    // Caps on concurrent sessions, in total and to a single destination.
+    size_t max_sessions;
+    size_t max_destination_sessions;
+    // Messages deferred by a destination are retried after `retry_interval`
+    // seconds, twice as long after every further attempt up to
+    // `max_retry_interval`, and given up on once `max_message_age` seconds
+    // old. Retries due are let out at up to `retry_rate` a second.
+    size_t retry_interval;
+    size_t max_retry_interval;
+    size_t max_message_age;
+    size_t retry_rate;
+    // Whether STARTTLS is used with servers that offer it.
+    bool starttls;
+    // Socket tuning, by destination.
+    struct tcp_options_table tcp_options;
+    // Next hops of domains not to be sent to their mail exchangers.
+    struct transport_map transport_map;
 };
 
 extern struct settings settings;
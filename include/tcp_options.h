@@ -0,0 +1,41 @@
+#ifndef TCP_OPTIONS_H
+#define TCP_OPTIONS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// How sockets to a destination are tuned.
+struct tcp_options {
+    // Commands go out as soon as they are written.
+    bool nodelay;
+    // Message bodies go out in full segments, the socket being corked until
+    // the last of the body is written.
+    bool cork;
+    // Unsent bytes below which the socket counts as writable, so that few
+    // pile up in the kernel; zero leaves the system default.
+    size_t notsent_lowat;
+};
+
+struct tcp_options_rule;
+
+// Options of destinations matching a domain pattern, the first match
+// applying.
+struct tcp_options_table {
+    struct tcp_options defaults;
+    size_t rules_size;
+    struct tcp_options_rule *rules;
+};
+
+// `spec` lists rules as "pattern:option,option..." separated by spaces,
+// options being "nodelay", "cork", "notsent_lowat=bytes" and the first two
+// prefixed with "no". Dies if it is malformed.
+void tcp_options_table_initialize(struct tcp_options_table *table,
+    char const *spec);
+struct tcp_options const *tcp_options_find(
+    struct tcp_options_table const *table, char const *domain);
+void tcp_options_table_finalize(struct tcp_options_table *table);
+
+#endif
+
+
+/*! \file */
@@ -0,0 +1,36 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <sys/queue.h>
+#include <pthread.h>
+
+#include <openssl/ssl.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct tls_cache_entry;
+
+// Client side of STARTTLS shared by every session and worker thread. The
+// last resumable TLS session of each MX host is kept, so that reconnects
+// skip the full handshake.
+struct tls {
+    SSL_CTX *ctx;
+
+    pthread_mutex_t mutex;
+    size_t entries_size;
+    // Most recently used first.
+    TAILQ_HEAD(tls_cache_entry_list, tls_cache_entry) entries;
+};
+
+void tls_initialize(struct tls *tls);
+// False for a while after a handshake with `host` has failed.
+bool tls_usable(struct tls *tls, char const *host);
+SSL *tls_connect(struct tls *tls, int fd, char const *host);
+void tls_mark_failed(struct tls *tls, char const *host);
+void tls_finalize(struct tls *tls);
+
+#endif
+
+
+/*! \file */
@@ -0,0 +1,54 @@
+#ifndef TRANSPORT_MAP_H
+#define TRANSPORT_MAP_H
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A next hop mail is relayed through instead of the mail exchangers of its
+// domain. Domains routed to the same one share its sessions.
+struct transport_route {
+    // "host:port", telling next hops apart.
+    char *next_hop;
+    // Mail is handed over by LMTP (RFC 2033) rather than relayed by SMTP.
+    bool lmtp;
+    char *host;
+    uint16_t port;
+    // `AF_UNSPEC` unless `host` is an address literal, which then is in
+    // `address`, or the path of a UNIX-domain socket for `AF_UNIX`.
+    int family;
+    union {
+        struct in_addr in;
+        struct in6_addr in6;
+    } address;
+};
+
+struct transport_map_entry;
+
+// Next hops by domain pattern, read from a file of "pattern next-hop" lines
+// where the next hop is "host", "host:port", "[address]:port" or "direct"
+// for the mail exchangers of the domain. Prefixed with "lmtp:", the next
+// hop is an LMTP server, which may also be the path of a UNIX-domain
+// socket. The first matching line applies and '#' starts a comment.
+struct transport_map {
+    size_t entries_size;
+    struct transport_map_entry *entries;
+    size_t routes_size;
+    struct transport_route **routes;
+};
+
+// An empty `path` makes for an empty map. Dies if the file is unreadable
+// or malformed.
+void transport_map_initialize(struct transport_map *map, char const *path);
+// NULL for domains that go to their mail exchangers.
+struct transport_route const *transport_map_find(
+    struct transport_map const *map, char const *domain, size_t domain_len);
+void transport_map_finalize(struct transport_map *map);
+
+#endif
+
+
+/*! \file */
@@ -0,0 +1,65 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <event_loop.h>
+#include <io_ring.h>
+
+#include <sys/queue.h>
+#include <pthread.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct worker;
+
+struct worker_task {
+    STAILQ_ENTRY(worker_task) link;
+
+    // Called on the thread of the worker that picked the task up.
+    void (*start)(struct worker_task *task, struct worker *worker);
+};
+
+struct worker {
+    struct worker_pool *pool;
+
+    pthread_t thread;
+    struct event_loop own_loop;
+    struct io_ring ring;
+
+    // Either `own_loop` or, without worker threads, the main loop.
+    struct event_loop *loop;
+
+    struct event_handler intake_handler;
+    bool stopping;
+
+    // Tasks queued to or running on the worker, updated atomically.
+    size_t load;
+
+    // Guarded by the pool mutex.
+    size_t pending_size;
+    STAILQ_HEAD(, worker_task) pending;
+};
+
+struct worker_pool {
+    pthread_mutex_t mutex;
+
+    bool threaded;
+    size_t size;
+    struct worker *workers;
+};
+
+void worker_task_initialize(struct worker_task *task,
+    void (*start)(struct worker_task *task, struct worker *worker));
+
+// With `size` zero, tasks run on `loop` and no threads are started.
+void worker_pool_initialize(struct worker_pool *pool, struct event_loop *loop,
+    size_t size, bool io_ring);
+void worker_pool_submit(struct worker_pool *pool, struct worker_task *task);
+void worker_pool_finish(struct worker *worker);
+void worker_pool_stop(struct worker_pool *pool);
+void worker_pool_finalize(struct worker_pool *pool);
+
+#endif
+
+
+/*! \file */
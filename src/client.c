@@ -4,152 +4,1141 @@
 #include <message.h>
 #include <masprintf.h>
 #include <die.h>
+#include <logger.h>
+#include <settings.h>
 
+#include <ares.h>
+#include <arpa/nameser.h>
+#include <fcntl.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <errno.h>
 #include <assert.h>
 
+// A spool file deferred by some of its recipients, carried from one
+// attempt to the next until none is left to retry.
+struct client_retry {
+    TAILQ_ENTRY(client_retry) link;
+    struct client *client;
+    struct event_timer timer;
+    char *name;
+    // The recipients left as user@host, each followed by '\0'.
+    char *deferred;
+    size_t deferred_len;
+    // Those that refused the message for good, likewise.
+    char *rejected;
+    size_t rejected_len;
+    unsigned attempts;
+    // That of the spool file the above is of, 0 if unknown.
+    uint64_t inode;
+};
+
+// Lives until the message is finished with, to tell what is left to retry.
 struct client_message {
     TAILQ_ENTRY(client_message) link;
+    struct client *client;
+    struct event_handler handler;
+    struct message_observer observer;
     struct message *self;
+    // NULL on the first attempt.
+    struct client_retry *retry;
+};
+
+STAILQ_HEAD(client_deliveries, client_delivery);
+
+struct client_delivery {
+    STAILQ_ENTRY(client_delivery) link;
+    struct message *message;
+    struct message_destination *destination;
+};
+
+// Sessions to one destination host, opened on demand up to the caps. With
+// a `route` the host is its next hop, shared by all the domains routed
+// there.
+struct client_destination {
+    LIST_ENTRY(client_destination) link;
+    LIST_ENTRY(client_destination) bucket_link;
+    struct client *client;
+    char *host;
+    size_t host_len;
+    struct transport_route const *route;
+
+    size_t sessions_size;
+    LIST_HEAD(, client_session) sessions;
+
+    // Held back while the global cap leaves no session to deliver to.
+    bool waiting;
+    TAILQ_ENTRY(client_destination) waiting_link;
+    struct client_deliveries backlog;
 };
 
+// Sessions are created on the main loop and run on whichever worker picks
+// their task up; `mutex` guards the hand-over of messages in between.
 struct client_session {
     LIST_ENTRY(client_session) link;
+    struct client_destination *destination;
+
+    struct worker_task task;
+    struct worker *worker;
+
+    pthread_mutex_t mutex;
+    bool started;
+    bool closed;
+    // Asked to give its socket up to a waiting destination.
+    bool evicting;
+    size_t inbox_size;
+    struct client_deliveries inbox;
+
+    // Runs on the worker loop, drains `inbox` and notices closure.
+    struct event_handler handler;
+    // Runs on the main loop once the worker is done with the session.
+    struct event_handler closed_handler;
+
     struct session self;
 };
 
-// 
-void client_initialize(struct client *client,
-    char const* maildir_path, char const* host)
+static void lock(struct client_session *session) {
+    int error = pthread_mutex_lock(&session->mutex);
+    if (error) {
+        die("`pthread_mutex_lock(/* ... */)` failed: %s\n", strerror(error));
+    }
+}
+
+static void unlock(struct client_session *session) {
+    int error = pthread_mutex_unlock(&session->mutex);
+    if (error) {
+        die("`pthread_mutex_unlock(/* ... */)` failed: %s\n",
+            strerror(error));
+    }
+}
+
+static void release_deliveries(struct client_deliveries *deliveries) {
+    while (true) {
+        struct client_delivery *delivery = STAILQ_FIRST(deliveries);
+        if (!delivery) { break; }
+        STAILQ_REMOVE_HEAD(deliveries, link);
+        message_release(delivery->message);
+        free(delivery);
+    }
+}
+
+static void free_session(struct client_session *session) {
+    release_deliveries(&session->inbox);
+    {
+        int error = pthread_mutex_destroy(&session->mutex);
+        if (error) {
+            die("`pthread_mutex_destroy(/* ... */)` failed: %s\n",
+                strerror(error));
+        }
+    }
+    free(session);
+}
+
+static void free_destination(struct client_destination *destination) {
+    LIST_REMOVE(destination, bucket_link);
+    release_deliveries(&destination->backlog);
+    free(destination->host);
+    free(destination);
+}
+
+static void deliver(struct client_destination *destination,
+    struct client_delivery *delivery);
+static void evict_sessions(struct client *client);
+
+static void resume_waiting(struct client *client) {
+    struct client_destination *destination = TAILQ_FIRST(&client->waiting);
+    while (destination && client->sessions_size < client->max_sessions) {
+        struct client_destination *next =
+            TAILQ_NEXT(destination, waiting_link);
+        if (destination->sessions_size <
+            client->max_destination_sessions)
+        {
+            TAILQ_REMOVE(&client->waiting, destination, waiting_link);
+            destination->waiting = false;
+            while (!destination->waiting) {
+                struct client_delivery *delivery =
+                    STAILQ_FIRST(&destination->backlog);
+                if (!delivery) { break; }
+                STAILQ_REMOVE_HEAD(&destination->backlog, link);
+                deliver(destination, delivery);
+            }
+        }
+        destination = next;
+    }
+}
+
+static void session_closed_notify(struct event_handler *handler,
+    uint32_t events)
 {
-    maildir_initialize(&client->maildir, maildir_path);
+    struct client_session *session =
+        container_of(handler, struct client_session, closed_handler);
+    struct client_destination *destination = session->destination;
+    struct client *client = destination->client;
+    (void)events;
 
-    client->host = strdup(host);
-    if (!client->host) {
-        die("`strdup(\"%s\")` failed: %s\n",
-            host, strerror(errno));
+    LIST_REMOVE(session, link);
+    --destination->sessions_size;
+    --client->sessions_size;
+    if (session->evicting) { --client->evicting_size; }
+
+    // Deliveries that raced with the closure go to another session, unless
+    // this one failed to get anywhere: another would fail as well, so they
+    // are released to be retried later. `self` is finalized but kept.
+    while (session->self.established) {
+        struct client_delivery *delivery = STAILQ_FIRST(&session->inbox);
+        if (!delivery) { break; }
+        STAILQ_REMOVE_HEAD(&session->inbox, link);
+        deliver(destination, delivery);
     }
 
-    TAILQ_INIT(&client->messages);
+    free_session(session);
+    resume_waiting(client);
+    evict_sessions(client);
+
+    if (!destination->sessions_size && !destination->waiting) {
+        LIST_REMOVE(destination, link);
+        free_destination(destination);
+    }
+}
+
+static void session_notify(struct event_handler *handler, uint32_t events) {
+    struct client_session *session =
+        container_of(handler, struct client_session, handler);
+    (void)events;
+
+    if (session->self.state == SESSION_CLOSED) {
+        lock(session);
+        __atomic_store_n(&session->closed, true, __ATOMIC_RELEASE);
+        unlock(session);
+
+        event_loop_cancel(session->worker->loop, &session->handler);
+        session_finalize(&session->self);
+        worker_pool_finish(session->worker);
+        event_loop_post(session->destination->client->loop,
+            &session->closed_handler);
+        return;
+    }
+
+    lock(session);
+    while (true) {
+        struct client_delivery *delivery = STAILQ_FIRST(&session->inbox);
+        if (!delivery) { break; }
+        STAILQ_REMOVE_HEAD(&session->inbox, link);
+        --session->inbox_size;
+        session_enqueue_message(&session->self, delivery->message,
+            delivery->destination);
+        message_release(delivery->message);
+        free(delivery);
+    }
+    if (session->evicting) { session_quit_idle(&session->self); }
+    unlock(session);
+}
 
-    LIST_INIT(&client->sessions);
+static struct resolver *worker_resolver(struct client *client,
+    struct worker *worker)
+{
+    if (worker->loop == client->loop) { return &client->resolver; }
+    return &client->worker_resolvers[worker - client->workers.workers];
 }
 
-void client_subscribe(struct client *client, struct fd_set *fd_set) {
-    maildir_subscribe(&client->maildir, fd_set);
+static void session_start(struct worker_task *task, struct worker *worker) {
+    struct client_session *session =
+        container_of(task, struct client_session, task);
+    struct client *client = session->destination->client;
+
+    session_initialize(&session->self, worker->loop, client->host,
+        session->destination->host, session->destination->route,
+        client->starttls ? &client->tls : NULL,
+        worker_resolver(client, worker), &client->hosts, &session->handler);
+
+    // From here on `self.messages_size` may be read by the main loop.
+    lock(session);
+    session->worker = worker;
+    session->started = true;
+    unlock(session);
+
+    event_loop_schedule(worker->loop, &session->handler);
+}
+
+static struct client_session *create_session(
+    struct client_destination *destination)
+{
+    struct client *client = destination->client;
+
+    struct client_session *session = malloc(sizeof(*session));
+    if (!session) {
+        die("`malloc(%zu)` failed: %s\n", sizeof(*session), strerror(errno));
+    }
+    session->destination = destination;
+    worker_task_initialize(&session->task, session_start);
+    session->worker = NULL;
+    {
+        int error = pthread_mutex_init(&session->mutex, NULL);
+        if (error) {
+            die("`pthread_mutex_init(/* ... */)` failed: %s\n",
+                strerror(error));
+        }
+    }
+    session->started = false;
+    session->closed = false;
+    session->evicting = false;
+    session->inbox_size = 0;
+    STAILQ_INIT(&session->inbox);
+    event_handler_initialize(&session->handler, session_notify);
+    event_handler_initialize(&session->closed_handler, session_closed_notify);
 
-    for (struct client_message *message = TAILQ_FIRST(&client->messages);
-         message; message = TAILQ_NEXT(message, link))
-    { message_subscribe(message->self, fd_set); }
+    LIST_INSERT_HEAD(&destination->sessions, session, link);
+    ++destination->sessions_size;
+    ++client->sessions_size;
+    worker_pool_submit(&client->workers, &session->task);
+    return session;
+}
+
+// Messages handed over but not yet delivered.
+static size_t get_depth(struct client_session *session) {
+    lock(session);
+    size_t depth = session->inbox_size;
+    if (session->started) {
+        depth +=
+            __atomic_load_n(&session->self.messages_size, __ATOMIC_RELAXED);
+    }
+    unlock(session);
+    return depth;
+}
 
-    for (struct client_session *session = LIST_FIRST(&client->sessions);
+// The least loaded session, a new one if none is free and the caps allow.
+static struct client_session *pick_session(
+    struct client_destination *destination)
+{
+    struct client *client = destination->client;
+
+    struct client_session *best = NULL;
+    size_t best_depth = 0;
+    for (struct client_session *session = LIST_FIRST(&destination->sessions);
          session; session = LIST_NEXT(session, link))
-    { session_subscribe(&session->self, fd_set); }
+    {
+        if (__atomic_load_n(&session->closed, __ATOMIC_ACQUIRE) ||
+            session->evicting)
+        { continue; }
+        size_t depth = get_depth(session);
+        if (!best || depth < best_depth) {
+            best = session;
+            best_depth = depth;
+        }
+    }
+    if (best && !best_depth) { return best; }
+
+    if (destination->sessions_size < client->max_destination_sessions &&
+        client->sessions_size < client->max_sessions)
+    { return create_session(destination); }
+    return best;
 }
 
-void client_notify(struct client *client, struct fd_set const *fd_set) {
-    maildir_notify(&client->maildir, fd_set);
-    while (true) {
-        char *path = maildir_discover_message(&client->maildir);
-        if (!path) { break; }
+// Picks a victim for every waiting destination, preferring idle sessions.
+// A busy one takes no new deliveries and quits once its queue is done.
+static void evict_sessions(struct client *client) {
+    size_t waiting_size = 0;
+    for (struct client_destination *destination =
+            TAILQ_FIRST(&client->waiting);
+         destination; destination = TAILQ_NEXT(destination, waiting_link))
+    { ++waiting_size; }
+
+    while (client->evicting_size < waiting_size) {
+        struct client_session *victim = NULL;
+        size_t victim_depth = 0;
+        for (struct client_destination *destination =
+                LIST_FIRST(&client->destinations);
+             destination; destination = LIST_NEXT(destination, link))
+        {
+            for (struct client_session *session =
+                    LIST_FIRST(&destination->sessions);
+                 session; session = LIST_NEXT(session, link))
+            {
+                if (__atomic_load_n(&session->closed, __ATOMIC_ACQUIRE) ||
+                    session->evicting)
+                { continue; }
+                size_t depth = get_depth(session);
+                if (!victim || depth < victim_depth) {
+                    victim = session;
+                    victim_depth = depth;
+                }
+            }
+        }
+        if (!victim) { return; }
+
+        lock(victim);
+        victim->evicting = true;
+        if (victim->started) {
+            event_loop_post(victim->worker->loop, &victim->handler);
+        }
+        unlock(victim);
+        ++client->evicting_size;
+    }
+}
+
+static void deliver(struct client_destination *destination,
+    struct client_delivery *delivery)
+{
+    struct client *client = destination->client;
+
+    while (!destination->waiting) {
+        struct client_session *session = pick_session(destination);
+        if (!session) { break; }
+
+        lock(session);
+        // An idle session may close between the lookup and here.
+        if (!session->closed) {
+            STAILQ_INSERT_TAIL(&session->inbox, delivery, link);
+            ++session->inbox_size;
+            if (session->started) {
+                event_loop_post(session->worker->loop, &session->handler);
+            }
+            unlock(session);
+            return;
+        }
+        unlock(session);
+    }
+
+    STAILQ_INSERT_TAIL(&destination->backlog, delivery, link);
+    if (!destination->waiting) {
+        destination->waiting = true;
+        TAILQ_INSERT_TAIL(&client->waiting, destination, waiting_link);
+        evict_sessions(client);
+    }
+}
+
+static struct client_destination_bucket *destination_bucket(
+    struct client *client, char const *host, size_t host_len)
+{
+    size_t hash = 0;
+    for (size_t i = 0; i < host_len; ++i) {
+        hash = hash * 31 + (unsigned char)host[i];
+    }
+    return &client->destination_buckets[hash % CLIENT_DESTINATION_BUCKETS];
+}
+
+static struct client_destination *lookup_destination(struct client *client,
+    char const *host, size_t host_len)
+{
+    struct client_destination *destination =
+        LIST_FIRST(destination_bucket(client, host, host_len));
+    while (destination &&
+           (host_len != destination->host_len ||
+            memcmp(destination->host, host, host_len)))
+    { destination = LIST_NEXT(destination, bucket_link); }
+    return destination;
+}
+
+static struct client_destination *find_destination(struct client *client,
+    char const *host, size_t host_len, struct transport_route const *route)
+{
+    struct client_destination *destination =
+        lookup_destination(client, host, host_len);
+    if (destination) { return destination; }
 
-        struct client_message *message = malloc(sizeof(*message));
-        if (!message) {
+    destination = malloc(sizeof(*destination));
+    if (!destination) {
+        die("`malloc(%zu)` failed: %s\n",
+            sizeof(*destination), strerror(errno));
+    }
+    destination->client = client;
+    destination->host = masprintf("%.*s", (int)host_len, host);
+    destination->host_len = host_len;
+    destination->route = route;
+    destination->sessions_size = 0;
+    LIST_INIT(&destination->sessions);
+    destination->waiting = false;
+    STAILQ_INIT(&destination->backlog);
+    LIST_INSERT_HEAD(&client->destinations, destination, link);
+    LIST_INSERT_HEAD(destination_bucket(client, host, host_len), destination,
+        bucket_link);
+    return destination;
+}
+
+struct client_prefetch {
+    struct resolver *resolver;
+    char *host;
+};
+
+static void prefetched(void *arg, int status, int timeouts,
+    unsigned char *reply_data, int reply_size)
+{
+    // The reply is only wanted in the cache.
+    (void)arg;
+    (void)status;
+    (void)timeouts;
+    (void)reply_data;
+    (void)reply_size;
+}
+
+static void prefetch_addresses(struct resolver *resolver, char const *host) {
+    resolver_query(resolver, host, ns_t_aaaa, prefetched, NULL);
+    resolver_query(resolver, host, ns_t_a, prefetched, NULL);
+}
+
+static void prefetch_mx_callback(void *arg, int status, int timeouts,
+    unsigned char *reply_data, int reply_size)
+{
+    struct client_prefetch *prefetch = arg;
+    (void)timeouts;
+
+    struct ares_mx_reply *mx_replies;
+    if (status == ARES_ENODATA) {
+        prefetch_addresses(prefetch->resolver, prefetch->host);
+    } else if (status == ARES_SUCCESS &&
+               ares_parse_mx_reply(reply_data, reply_size, &mx_replies) ==
+                   ARES_SUCCESS)
+    {
+        for (struct ares_mx_reply *mx_reply = mx_replies; mx_reply;
+             mx_reply = mx_reply->next)
+        { prefetch_addresses(prefetch->resolver, mx_reply->host); }
+        ares_free_data(mx_replies);
+    }
+
+    free(prefetch->host);
+    free(prefetch);
+}
+
+// Resolves the mail exchangers of a destination the way its sessions will,
+// so that they find the answers cached.
+static void prefetch(struct client *client, char const *host) {
+    if (!client->resolver.initialized) { return; }
+
+    struct client_prefetch *prefetch = malloc(sizeof(*prefetch));
+    if (!prefetch) {
+        die("`malloc(%zu)` failed: %s\n", sizeof(*prefetch), strerror(errno));
+    }
+    prefetch->resolver = &client->resolver;
+    prefetch->host = strdup(host);
+    if (!prefetch->host) {
+        die("`strdup(\"%s\")` failed: %s\n", host, strerror(errno));
+    }
+    resolver_query(&client->resolver, host, ns_t_mx, prefetch_mx_callback,
+        prefetch);
+}
+
+static void distribute(struct client *client, struct message *message) {
+    for (struct message_destination *destination =
+            TAILQ_FIRST(&message->destinations);
+         destination; destination = TAILQ_NEXT(destination, link))
+    {
+        if (destination->settled) { continue; }
+        struct client_delivery *delivery = malloc(sizeof(*delivery));
+        if (!delivery) {
             die("`malloc(%zu)` failed: %s\n",
-                sizeof(*message), strerror(errno));
+                sizeof(*delivery), strerror(errno));
         }
+        delivery->message = message_retain(message);
+        delivery->destination = destination;
 
-        message->self = message_create(path);
-        TAILQ_INSERT_TAIL(&client->messages, message, link);
+        struct transport_route const *route = transport_map_find(
+            client->transport_map, destination->host, destination->host_len);
+        struct client_destination *client_destination = route
+            ? find_destination(client, route->next_hop,
+                  strlen(route->next_hop), route)
+            : find_destination(client, destination->host,
+                  destination->host_len, NULL);
+        deliver(client_destination, delivery);
+        // Sessions opened right away resolve the destination themselves.
+        if (client_destination->waiting && !route) {
+            prefetch(client, client_destination->host);
+        }
+    }
+}
 
-        free(path);
+// Spool files known from the queue index name their domains up front, so
+// that mail exchangers are looked up while their headers are still read.
+static void prepare_destinations(struct client *client, char const *domains,
+    size_t domains_len)
+{
+    for (char const *domain = domains; domain < domains + domains_len;
+         domain += strlen(domain) + 1)
+    {
+        size_t domain_len = strlen(domain);
+        if (transport_map_find(client->transport_map, domain, domain_len) ||
+            lookup_destination(client, domain, domain_len))
+        { continue; }
+        find_destination(client, domain, domain_len, NULL);
+        prefetch(client, domain);
     }
+}
 
-    for (struct client_message *message = TAILQ_FIRST(&client->messages);
-         message; )
+static void index_message(struct client *client, struct message *message) {
+    size_t domains_len = 0;
+    for (struct message_destination *destination =
+            TAILQ_FIRST(&message->destinations);
+         destination; destination = TAILQ_NEXT(destination, link))
+    { domains_len += destination->host_len + 1; }
+
+    char *domains = malloc(domains_len + 1);
+    if (!domains) {
+        die("`malloc(%zu)` failed: %s\n", domains_len + 1, strerror(errno));
+    }
+    char *domain = domains;
+    for (struct message_destination *destination =
+            TAILQ_FIRST(&message->destinations);
+         destination; destination = TAILQ_NEXT(destination, link))
     {
-        struct client_message* next = TAILQ_NEXT(message, link);
-        message_notify(message->self, fd_set);
-        switch (message->self->state) {
-        case MESSAGE_LOADING_HEADERS:
-            break;
-        case MESSAGE_HEADERS_LOADED:
-            for (struct message_destination *destination =
-                    TAILQ_FIRST(&message->self->destinations);
-                 destination; destination = TAILQ_NEXT(destination, link))
+        memcpy(domain, destination->host, destination->host_len);
+        domain[destination->host_len] = '\0';
+        domain += destination->host_len + 1;
+    }
+
+    maildir_index_message(&client->maildir, message->name, message->sender,
+        message->sender_len, domains, domains_len);
+    free(domains);
+}
+
+static bool has_address(char const *addresses, size_t addresses_len,
+    struct message_destination const *destination,
+    struct message_recepient const *recepient)
+{
+    size_t address_len = recepient->user_len + 1 + destination->host_len;
+    for (char const *address = addresses;
+         address < addresses + addresses_len; address += strlen(address) + 1)
+    {
+        if (strlen(address) == address_len &&
+            !strncmp(address, recepient->user, recepient->user_len) &&
+            address[recepient->user_len] == '@' &&
+            !strncmp(address + recepient->user_len + 1, destination->host,
+                destination->host_len))
+        { return true; }
+    }
+    return false;
+}
+
+// 0 if the spool file is gone. It is looked up by name, as below.
+static uint64_t spool_inode(struct message *message) {
+    struct stat st;
+    if (fstatat(message->dir_fd, message->name, &st, AT_SYMLINK_NOFOLLOW)) {
+        return 0;
+    }
+    return st.st_ino;
+}
+
+// A retry only goes to the recipients that deferred the message, the others
+// keep what came of them. Those that refused it stay refused, so that its
+// spool file is kept.
+static void skip_settled(struct client_message *message) {
+    struct client_retry *retry = message->retry;
+    if (!retry) { return; }
+    if (retry->inode && spool_inode(message->self) != retry->inode) {
+        logger_printf("%s was replaced, sending it afresh\n",
+            message->self->name);
+        retry->attempts = 0;
+        return;
+    }
+    for (struct message_destination *destination =
+            TAILQ_FIRST(&message->self->destinations);
+         destination; destination = TAILQ_NEXT(destination, link))
+    {
+        for (struct message_recepient *recepient =
+                TAILQ_FIRST(&destination->recepients);
+             recepient; recepient = TAILQ_NEXT(recepient, link))
+        {
+            if (has_address(retry->deferred, retry->deferred_len,
+                    destination, recepient))
+            { continue; }
+            if (has_address(retry->rejected, retry->rejected_len,
+                    destination, recepient))
             {
-                struct client_session *session = 
-                    LIST_FIRST(&client->sessions);
-                while (session &&
-                       (destination->host_len != 
-                            strlen(session->self.destination_host) ||
-                        strncmp(session->self.destination_host,
-                                destination->host, destination->host_len)))
-                { session = LIST_NEXT(session, link); }
-                if (!session) {
-                    session = malloc(sizeof(*session));
-                    if (!session) {
-                        die("`malloc(%zu)` failed: %s\n",
-                            sizeof(*session), strerror(errno));
-                    }
-                    char *destination_host = masprintf("%.*s",
-                        (int)destination->host_len, destination->host);
-                    session_initialize(&session->self,
-                        client->host, destination_host);
-                    free(destination_host);
-                    LIST_INSERT_HEAD(&client->sessions, session, link);
-                }
-                session_enqueue_message(&session->self, message->self);
+                message_mark_recepient_as_rejected(recepient);
+            } else {
+                message_mark_recepient_as_sent(recepient);
             }
-            // fallthrough
-        case MESSAGE_LOADING_FAILED:
-            TAILQ_REMOVE(&client->messages, message, link);
-            message_release(message->self);
-            free(message);
-            break;
-        default:
-            assert(false);
         }
-        message = next;
+
+        bool sent;
+        if (!message_recepients_settled(destination, &sent)) { continue; }
+        if (sent) {
+            message_skip_destination(message->self, destination);
+        } else {
+            message_mark_as_rejected(message->self, destination);
+        }
+    }
+}
+
+static uint64_t realtime_now(void) {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_REALTIME, &ts)) {
+        die("`clock_gettime(CLOCK_REALTIME, /*...*/)` failed: %s\n",
+            strerror(errno));
+    }
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Milliseconds since the spool file was written, zero if unknown. The file
+// is looked up by name, its descriptor being closed once the headers load.
+static uint64_t message_age(struct message *message) {
+    struct stat st;
+    if (fstatat(message->dir_fd, message->name, &st, AT_SYMLINK_NOFOLLOW)) {
+        return 0;
+    }
+    uint64_t written = (uint64_t)st.st_mtim.tv_sec * 1000 +
+        st.st_mtim.tv_nsec / 1000000;
+    uint64_t now = realtime_now();
+    return now > written ? now - written : 0;
+}
+
+static bool message_expired(struct message *message, uint64_t *age) {
+    *age = message_age(message);
+    return *age > (uint64_t)settings.max_message_age * 1000;
+}
+
+static void message_notify(struct event_handler *handler, uint32_t events) {
+    struct client_message *message =
+        container_of(handler, struct client_message, handler);
+    struct client *client = message->client;
+    (void)events;
+
+    switch (message->self->state) {
+    case MESSAGE_LOADING_HEADERS:
+        return;
+    case MESSAGE_HEADERS_LOADED:
+        index_message(client, message->self);
+        // One too old goes no further, see `message_finished`.
+        uint64_t age;
+        if (!message_expired(message->self, &age)) {
+            skip_settled(message);
+            distribute(client, message->self);
+        }
+        // fallthrough
+    case MESSAGE_LOADING_FAILED:
+        TAILQ_REMOVE(&client->messages, message, link);
+        message_remove_observer(&message->observer);
+        event_loop_cancel(client->loop, &message->handler);
+        // `message_finished` frees it once the sessions are done too.
+        message_release(message->self);
+        break;
+    default:
+        assert(false);
     }
+}
+
+static void free_retry(struct client_retry *retry) {
+    if (!retry) { return; }
+    free(retry->name);
+    free(retry->deferred);
+    free(retry->rejected);
+    free(retry);
+}
+
+// Doubles with every attempt, and is spread over its upper half so that
+// messages deferred together do not all come back at once.
+static uint64_t retry_delay(struct client *client, unsigned attempts) {
+    uint64_t delay = (uint64_t)settings.retry_interval * 1000;
+    uint64_t max_delay = (uint64_t)settings.max_retry_interval * 1000;
+    for (unsigned i = 1; i < attempts && delay < max_delay; ++i) {
+        delay *= 2;
+    }
+    if (delay > max_delay) { delay = max_delay; }
+    return delay - (uint64_t)rand_r(&client->retry_seed) % (delay / 2 + 1);
+}
+
+static void load_message(struct client *client, char const *name,
+    struct client_retry *retry);
+
+// Lets out as many retries as `settings.retry_rate` allows by now, and
+// comes back for the rest.
+static void release_retries(struct client *client) {
+    double rate = settings.retry_rate;
+    uint64_t now = client->loop->now;
+    client->retry_tokens += (now - client->retry_refilled_at) * rate / 1000;
+    if (client->retry_tokens > rate) { client->retry_tokens = rate; }
+    client->retry_refilled_at = now;
 
-    for (struct client_session *session = LIST_FIRST(&client->sessions);
-         session; )
+    while (client->retry_tokens >= 1) {
+        struct client_retry *retry = TAILQ_FIRST(&client->due_retries);
+        if (!retry) { break; }
+        TAILQ_REMOVE(&client->due_retries, retry, link);
+        client->retry_tokens -= 1;
+        load_message(client, retry->name, retry);
+    }
+
+    if (!TAILQ_EMPTY(&client->due_retries)) {
+        event_loop_arm(client->loop, &client->retry_timer,
+            (1 - client->retry_tokens) * 1000 / rate + 1);
+    }
+}
+
+static void retry_timer_expire(struct event_timer *timer) {
+    struct client *client = container_of(timer, struct client, retry_timer);
+    release_retries(client);
+}
+
+static void retry_expire(struct event_timer *timer) {
+    struct client_retry *retry =
+        container_of(timer, struct client_retry, timer);
+    struct client *client = retry->client;
+
+    TAILQ_REMOVE(&client->retries, retry, link);
+    TAILQ_INSERT_TAIL(&client->due_retries, retry, link);
+    if (!client->retry_timer.armed) { release_retries(client); }
+}
+
+// Whether the recipient is left to a retry or, if `rejected`, whether it
+// refused the message for good.
+static bool recepient_matches(struct message_destination const *destination,
+    struct message_recepient const *recepient, bool rejected)
+{
+    if (rejected) { return destination->rejected || recepient->rejected; }
+    return !destination->settled && !recepient->settled;
+}
+
+// The recipients as matched above, as user@host each followed by '\0', or
+// NULL if there are none.
+static char *collect_addresses(struct message *message, bool rejected,
+    size_t *addresses_len)
+{
+    *addresses_len = 0;
+    for (struct message_destination *destination =
+            TAILQ_FIRST(&message->destinations);
+         destination; destination = TAILQ_NEXT(destination, link))
     {
-        struct client_session* next = LIST_NEXT(session, link);
-        session_notify(&session->self, fd_set);
-        if (session->self.state == SESSION_CLOSED) {
-            LIST_REMOVE(session, link);
-            session_finalize(&session->self);
-            free(session);
+        for (struct message_recepient *recepient =
+                TAILQ_FIRST(&destination->recepients);
+             recepient; recepient = TAILQ_NEXT(recepient, link))
+        {
+            if (!recepient_matches(destination, recepient, rejected)) {
+                continue;
+            }
+            *addresses_len +=
+                recepient->user_len + 1 + destination->host_len + 1;
+        }
+    }
+    if (!*addresses_len) { return NULL; }
+
+    char *addresses = malloc(*addresses_len);
+    if (!addresses) {
+        die("`malloc(%zu)` failed: %s\n", *addresses_len, strerror(errno));
+    }
+    char *address = addresses;
+    for (struct message_destination *destination =
+            TAILQ_FIRST(&message->destinations);
+         destination; destination = TAILQ_NEXT(destination, link))
+    {
+        for (struct message_recepient *recepient =
+                TAILQ_FIRST(&destination->recepients);
+             recepient; recepient = TAILQ_NEXT(recepient, link))
+        {
+            if (!recepient_matches(destination, recepient, rejected)) {
+                continue;
+            }
+            address += sprintf(address, "%.*s@%.*s",
+                (int)recepient->user_len, recepient->user,
+                (int)destination->host_len, destination->host) + 1;
+        }
+    }
+    return addresses;
+}
+
+static char *copy_addresses(char const *addresses, size_t addresses_len) {
+    if (!addresses_len) { return NULL; }
+    char *copy = malloc(addresses_len);
+    if (!copy) {
+        die("`malloc(%zu)` failed: %s\n", addresses_len, strerror(errno));
+    }
+    memcpy(copy, addresses, addresses_len);
+    return copy;
+}
+
+static struct client_retry *create_retry(struct client *client,
+    char const *name)
+{
+    struct client_retry *retry = malloc(sizeof(*retry));
+    if (!retry) {
+        die("`malloc(%zu)` failed: %s\n", sizeof(*retry), strerror(errno));
+    }
+    retry->client = client;
+    event_timer_initialize(&retry->timer, retry_expire);
+    retry->name = strdup(name);
+    if (!retry->name) {
+        die("`strdup(\"%s\")` failed: %s\n", name, strerror(errno));
+    }
+    retry->deferred = NULL;
+    retry->deferred_len = 0;
+    retry->rejected = NULL;
+    retry->rejected_len = 0;
+    retry->attempts = 0;
+    retry->inode = 0;
+    return retry;
+}
+
+// Picks up where the attempts before a restart left off, at the time they
+// set, so that a restart does not retry the whole backlog at once.
+static void resume_retry(struct client *client,
+    struct queue_index_entry const *entry)
+{
+    struct client_retry *retry = create_retry(client, entry->name);
+    retry->attempts = entry->attempts;
+    retry->inode = entry->inode;
+    retry->deferred = copy_addresses(entry->deferred, entry->deferred_len);
+    retry->deferred_len = entry->deferred_len;
+    retry->rejected = copy_addresses(entry->rejected, entry->rejected_len);
+    retry->rejected_len = entry->rejected_len;
+
+    int64_t delay = entry->retry_at - (int64_t)realtime_now();
+    TAILQ_INSERT_TAIL(&client->retries, retry, link);
+    event_loop_arm(client->loop, &retry->timer, delay > 0 ? delay : 0);
+}
+
+// Recipients the message is neither sent to nor refused by get another
+// attempt later, recorded in the index, unless the message is too old by
+// then. One with nothing left to try but refused somewhere is set aside,
+// as is one too old.
+static void message_finished(void *arg, struct message *self) {
+    struct client_message *message = arg;
+    struct client *client = message->client;
+    struct client_retry *retry = message->retry;
+    free(message);
+
+    if (client->finalizing || self->state == MESSAGE_LOADING_FAILED) {
+        free_retry(retry);
+        return;
+    }
+
+    size_t deferred_len;
+    char *deferred = collect_addresses(self, false, &deferred_len);
+    if (!deferred) {
+        // Destinations left pending by now refused it.
+        if (self->pending_destinations) {
+            maildir_set_aside(&client->maildir, self->name);
+        }
+        free_retry(retry);
+        return;
+    }
+
+    if (!retry) { retry = create_retry(client, self->name); }
+
+    uint64_t age;
+    if (message_expired(self, &age)) {
+        logger_printf("giving up on %s after %u attempts, it is %llu s old\n",
+            self->name, retry->attempts, (unsigned long long)(age / 1000));
+        maildir_set_aside(&client->maildir, self->name);
+        free(deferred);
+        free_retry(retry);
+        return;
+    }
+    ++retry->attempts;
+    retry->inode = spool_inode(self);
+
+    free(retry->deferred);
+    retry->deferred = deferred;
+    retry->deferred_len = deferred_len;
+    free(retry->rejected);
+    retry->rejected = collect_addresses(self, true, &retry->rejected_len);
+
+    uint64_t delay = retry_delay(client, retry->attempts);
+    maildir_defer_message(&client->maildir, &(struct queue_index_entry){
+        .name = self->name,
+        .attempts = retry->attempts,
+        .retry_at = realtime_now() + delay,
+        .deferred = retry->deferred,
+        .deferred_len = retry->deferred_len,
+        .rejected = retry->rejected,
+        .rejected_len = retry->rejected_len,
+    });
+
+    logger_printf("deferred %s, attempt %u, retrying in %llu ms\n",
+        self->name, retry->attempts, (unsigned long long)delay);
+    TAILQ_INSERT_TAIL(&client->retries, retry, link);
+    event_loop_arm(client->loop, &retry->timer, delay);
+}
+
+static void load_message(struct client *client, char const *name,
+    struct client_retry *retry)
+{
+    struct client_message *message = malloc(sizeof(*message));
+    if (!message) {
+        die("`malloc(%zu)` failed: %s\n", sizeof(*message), strerror(errno));
+    }
+
+    message->client = client;
+    message->retry = retry;
+    event_handler_initialize(&message->handler, message_notify);
+    message_observer_initialize(&message->observer, client->loop,
+        &message->handler);
+
+    message->self = message_create(client->loop, client->maildir.out_fd,
+        name);
+    message_set_finished_callback(message->self, message_finished, message);
+    message_add_observer(message->self, &message->observer);
+    TAILQ_INSERT_TAIL(&client->messages, message, link);
+}
+
+static void maildir_notify(struct event_handler *handler, uint32_t events) {
+    struct client *client =
+        container_of(handler, struct client, maildir_handler);
+    (void)events;
+
+    while (true) {
+        struct queue_index_entry const *entry =
+            maildir_discover_message(&client->maildir);
+        if (!entry) { break; }
+        if (entry->domains) {
+            prepare_destinations(client, entry->domains, entry->domains_len);
+        }
+        if (entry->attempts) {
+            resume_retry(client, entry);
+        } else {
+            load_message(client, entry->name, NULL);
         }
-        session = next;
     }
 }
 
+// 
+void client_initialize(struct client *client, struct event_loop *loop,
+    char const* maildir_path, char const* host, size_t workers,
+    size_t max_sessions, size_t max_destination_sessions, bool starttls,
+    struct transport_map const *transport_map)
+{
+    client->loop = loop;
+    client->transport_map = transport_map;
+
+    // Not thread-safe, so it is done once for every worker loop.
+    {
+        int status = ares_library_init(ARES_LIB_INIT_ALL);
+        if (status != ARES_SUCCESS) {
+            die("`ares_library_init(ARES_LIB_INIT_ALL)` failed: %s\n",
+                ares_strerror(status));
+        }
+    }
+
+    client->starttls = starttls;
+    if (starttls) { tls_initialize(&client->tls); }
+
+    dns_cache_initialize(&client->dns_cache);
+    resolver_initialize(&client->resolver, loop, &client->dns_cache);
+    host_table_initialize(&client->hosts);
+
+    worker_pool_initialize(&client->workers, loop, workers,
+        loop->ring != NULL);
+
+    client->worker_resolvers = NULL;
+    if (client->workers.threaded) {
+        client->worker_resolvers = calloc(client->workers.size,
+            sizeof(*client->worker_resolvers));
+        if (!client->worker_resolvers) {
+            die("`calloc(%zu, %zu)` failed: %s\n", client->workers.size,
+                sizeof(*client->worker_resolvers), strerror(errno));
+        }
+        // Queries are only made once sessions run, on the worker threads.
+        for (size_t i = 0; i < client->workers.size; ++i) {
+            resolver_initialize(&client->worker_resolvers[i],
+                client->workers.workers[i].loop, &client->dns_cache);
+        }
+    }
+
+    event_handler_initialize(&client->maildir_handler, maildir_notify);
+    maildir_initialize(&client->maildir, loop, maildir_path,
+        &client->maildir_handler);
+
+    client->host = strdup(host);
+    if (!client->host) {
+        die("`strdup(\"%s\")` failed: %s\n",
+            host, strerror(errno));
+    }
+
+    TAILQ_INIT(&client->messages);
+
+    LIST_INIT(&client->destinations);
+    for (size_t i = 0; i < CLIENT_DESTINATION_BUCKETS; ++i) {
+        LIST_INIT(&client->destination_buckets[i]);
+    }
+    TAILQ_INIT(&client->waiting);
+    client->sessions_size = 0;
+    client->evicting_size = 0;
+    client->max_sessions = max_sessions;
+    client->max_destination_sessions = max_destination_sessions;
+
+    TAILQ_INIT(&client->retries);
+    TAILQ_INIT(&client->due_retries);
+    event_timer_initialize(&client->retry_timer, retry_timer_expire);
+    client->retry_tokens = settings.retry_rate;
+    client->retry_refilled_at = loop->now;
+    if (getrandom(&client->retry_seed, sizeof(client->retry_seed),
+            GRND_NONBLOCK) != sizeof(client->retry_seed))
+    { client->retry_seed = time(NULL) ^ (uintptr_t)client; }
+    client->finalizing = false;
+}
+
 void client_finalize(struct client *client) {
+    client->finalizing = true;
+    worker_pool_stop(&client->workers);
+
     while (true) {
-        struct client_session *session = LIST_FIRST(&client->sessions);
-        if (!session) { break; }
-        LIST_REMOVE(session, link);
-        session_finalize(&session->self);
-        free(session);
+        struct client_destination *destination =
+            LIST_FIRST(&client->destinations);
+        if (!destination) { break; }
+        LIST_REMOVE(destination, link);
+
+        while (true) {
+            struct client_session *session =
+                LIST_FIRST(&destination->sessions);
+            if (!session) { break; }
+            LIST_REMOVE(session, link);
+            event_loop_cancel(client->loop, &session->closed_handler);
+            if (session->started && !session->closed) {
+                event_loop_cancel(session->worker->loop, &session->handler);
+                session_finalize(&session->self);
+            }
+            free_session(session);
+        }
+        free_destination(destination);
     }
 
+    if (client->worker_resolvers) {
+        for (size_t i = 0; i < client->workers.size; ++i) {
+            resolver_finalize(&client->worker_resolvers[i]);
+        }
+        free(client->worker_resolvers);
+    }
+
+    worker_pool_finalize(&client->workers);
+
+    if (client->starttls) { tls_finalize(&client->tls); }
+
+    resolver_finalize(&client->resolver);
+    dns_cache_finalize(&client->dns_cache);
+    host_table_finalize(&client->hosts);
+
     while (true) {
         struct client_message *message = TAILQ_FIRST(&client->messages);
         if (!message) { break; }
         TAILQ_REMOVE(&client->messages, message, link);
+        message_remove_observer(&message->observer);
+        event_loop_cancel(client->loop, &message->handler);
         message_release(message->self);
-        free(message);
+    }
+
+    event_loop_disarm(client->loop, &client->retry_timer);
+    while (true) {
+        struct client_retry *retry = TAILQ_FIRST(&client->retries);
+        if (!retry) { break; }
+        TAILQ_REMOVE(&client->retries, retry, link);
+        event_loop_disarm(client->loop, &retry->timer);
+        free_retry(retry);
+    }
+    while (true) {
+        struct client_retry *retry = TAILQ_FIRST(&client->due_retries);
+        if (!retry) { break; }
+        TAILQ_REMOVE(&client->due_retries, retry, link);
+        free_retry(retry);
     }
 
     free(client->host);
 
+    event_loop_cancel(client->loop, &client->maildir_handler);
     maildir_finalize(&client->maildir);
+
+    ares_library_cleanup();
 }
 
 /*! \file */
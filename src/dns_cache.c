@@ -0,0 +1,403 @@
+#include <dns_cache.h>
+
+#include <die.h>
+
+#include <ares.h>
+#include <arpa/nameser.h>
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+enum {
+    DNS_CACHE_SIZE = 4096,
+    DNS_CACHE_MAX_TTL = 24 * 60 * 60,
+    // RFC 2308, section 5: failures are not to be kept for more than a few
+    // hours; replies carrying no SOA record to tell for how long are kept
+    // for a few minutes.
+    DNS_CACHE_MAX_NEGATIVE_TTL = 3 * 60 * 60,
+    DNS_CACHE_DEFAULT_NEGATIVE_TTL = 5 * 60,
+};
+
+enum dns_section {
+    DNS_QUESTION,
+    DNS_ANSWER,
+    DNS_AUTHORITY,
+    DNS_ADDITIONAL,
+};
+
+struct dns_cache_entry {
+    TAILQ_ENTRY(dns_cache_entry) link;
+    LIST_ENTRY(dns_cache_entry) bucket_link;
+    char *name;
+    int type;
+    int status;
+    time_t expires_at;
+    int reply_size;
+    unsigned char *reply;
+};
+
+// A resource record of a reply, `data` points into the reply.
+struct dns_record {
+    enum dns_section section;
+    char *name;
+    int type;
+    uint32_t ttl;
+    unsigned char const *data;
+    size_t len;
+};
+
+static void lock(struct dns_cache *cache) {
+    int error = pthread_mutex_lock(&cache->mutex);
+    if (error) {
+        die("`pthread_mutex_lock(/* ... */)` failed: %s\n", strerror(error));
+    }
+}
+
+static void unlock(struct dns_cache *cache) {
+    int error = pthread_mutex_unlock(&cache->mutex);
+    if (error) {
+        die("`pthread_mutex_unlock(/* ... */)` failed: %s\n",
+            strerror(error));
+    }
+}
+
+static uint16_t get16(unsigned char const *data) {
+    return data[0] << 8 | data[1];
+}
+
+static uint32_t get32(unsigned char const *data) {
+    return (uint32_t)get16(data) << 16 | get16(data + 2);
+}
+
+static void put16(unsigned char *data, uint16_t value) {
+    data[0] = value >> 8;
+    data[1] = value;
+}
+
+static void put32(unsigned char *data, uint32_t value) {
+    put16(data, value >> 16);
+    put16(data + 2, value);
+}
+
+// Calls `visit` with every record of the reply, names are freed afterwards.
+// Returns `false` for malformed replies.
+static bool walk_reply(unsigned char const *reply, int reply_size,
+    void (*visit)(struct dns_record const *record, void *data), void *data)
+{
+    static size_t const header_size = 12;
+    if (reply_size < (int)header_size) { return false; }
+
+    int offset = header_size;
+    for (int section = DNS_QUESTION; section <= DNS_ADDITIONAL; ++section) {
+        unsigned count = get16(reply + 4 + section * 2);
+        for (unsigned i = 0; i < count; ++i) {
+            struct dns_record record = { .section = section };
+            long name_len;
+            if (ares_expand_name(reply + offset, reply, reply_size,
+                                 &record.name, &name_len) != ARES_SUCCESS)
+            { return false; }
+            offset += name_len;
+
+            int fixed_len = section == DNS_QUESTION ? 4 : 10;
+            if (reply_size - offset < fixed_len) {
+                ares_free_string(record.name);
+                return false;
+            }
+            record.type = get16(reply + offset);
+            if (section != DNS_QUESTION) {
+                record.ttl = get32(reply + offset + 4);
+                record.len = get16(reply + offset + 8);
+                record.data = reply + offset + fixed_len;
+                if ((size_t)(reply_size - offset - fixed_len) < record.len) {
+                    ares_free_string(record.name);
+                    return false;
+                }
+            }
+            offset += fixed_len + record.len;
+
+            visit(&record, data);
+            ares_free_string(record.name);
+        }
+    }
+    return true;
+}
+
+struct ttl_scan {
+    unsigned char const *reply;
+    int reply_size;
+    bool negative;
+    bool found;
+    uint32_t ttl;
+};
+
+static void lower_ttl(struct ttl_scan *scan, uint32_t ttl) {
+    if (!scan->found || ttl < scan->ttl) { scan->ttl = ttl; }
+    scan->found = true;
+}
+
+// Positive replies last as long as their shortest lived answer, negative
+// ones as the SOA record of the zone says (RFC 2308, section 5).
+static void scan_ttl(struct dns_record const *record, void *data) {
+    struct ttl_scan *scan = data;
+    if (!scan->negative) {
+        if (record->section == DNS_ANSWER) { lower_ttl(scan, record->ttl); }
+        return;
+    }
+    if (record->section != DNS_AUTHORITY || record->type != ns_t_soa) {
+        return;
+    }
+
+    // The minimum field follows the two names and four other fields.
+    unsigned char const *end = record->data + record->len;
+    unsigned char const *field = record->data;
+    for (int i = 0; i < 2; ++i) {
+        char *name;
+        long name_len;
+        if (ares_expand_name(field, scan->reply, scan->reply_size,
+                             &name, &name_len) != ARES_SUCCESS) { return; }
+        ares_free_string(name);
+        field += name_len;
+    }
+    if (end - field < 20) { return; }
+    uint32_t minimum = get32(field + 16);
+    lower_ttl(scan, minimum < record->ttl ? minimum : record->ttl);
+}
+
+static size_t hash(char const *name, int type) {
+    size_t hash = type;
+    for (; *name; ++name) { hash = hash * 31 + tolower((unsigned char)*name); }
+    return hash % DNS_CACHE_BUCKETS;
+}
+
+static void remove_entry(struct dns_cache *cache,
+    struct dns_cache_entry *entry)
+{
+    TAILQ_REMOVE(&cache->entries, entry, link);
+    LIST_REMOVE(entry, bucket_link);
+    --cache->entries_size;
+    free(entry->reply);
+    free(entry->name);
+    free(entry);
+}
+
+static struct dns_cache_entry *find_entry(struct dns_cache *cache,
+    char const *name, int type)
+{
+    struct dns_cache_entry *entry =
+        LIST_FIRST(&cache->buckets[hash(name, type)]);
+    while (entry && (entry->type != type || strcasecmp(entry->name, name))) {
+        entry = LIST_NEXT(entry, bucket_link);
+    }
+    return entry;
+}
+
+static void insert(struct dns_cache *cache, char const *name, int type,
+    int status, uint32_t ttl, unsigned char *reply, int reply_size)
+{
+    struct dns_cache_entry *entry = find_entry(cache, name, type);
+    if (entry) { remove_entry(cache, entry); }
+
+    entry = malloc(sizeof(*entry));
+    if (!entry) {
+        die("`malloc(%zu)` failed: %s\n", sizeof(*entry), strerror(errno));
+    }
+    entry->name = strdup(name);
+    if (!entry->name) {
+        die("`strdup(\"%s\")` failed: %s\n", name, strerror(errno));
+    }
+    entry->type = type;
+    entry->status = status;
+    entry->expires_at = time(NULL) + ttl;
+    entry->reply_size = reply_size;
+    entry->reply = reply;
+    TAILQ_INSERT_HEAD(&cache->entries, entry, link);
+    LIST_INSERT_HEAD(&cache->buckets[hash(name, type)], entry, bucket_link);
+
+    if (++cache->entries_size > DNS_CACHE_SIZE) {
+        remove_entry(cache,
+            TAILQ_LAST(&cache->entries, dns_cache_entry_list));
+    }
+}
+
+static unsigned char *copy_reply(unsigned char const *reply, int reply_size) {
+    unsigned char *copy = malloc(reply_size);
+    if (!copy) {
+        die("`malloc(%d)` failed: %s\n", reply_size, strerror(errno));
+    }
+    return memcpy(copy, reply, reply_size);
+}
+
+// Addresses of one MX host gathered from the additional records, rebuilt
+// into a reply of its own as if they had been asked for.
+struct additional_scan {
+    char const *exchange;
+    int type;
+    size_t capacity;
+    size_t size;
+    unsigned char *reply;
+    unsigned answers;
+    struct ttl_scan ttl;
+};
+
+static void scan_additional(struct dns_record const *record, void *data) {
+    struct additional_scan *scan = data;
+    if (record->section != DNS_ADDITIONAL || record->type != scan->type ||
+        strcasecmp(record->name, scan->exchange)) { return; }
+
+    // The owner name points back at the question.
+    size_t len = 12 + record->len;
+    if (scan->capacity - scan->size < len) {
+        scan->capacity = (scan->size + len) * 5 / 3 + 1;
+        scan->reply = realloc(scan->reply, scan->capacity);
+        if (!scan->reply) {
+            die("`realloc(/* ... */, %zu)` failed: %s\n",
+                scan->capacity, strerror(errno));
+        }
+    }
+    unsigned char *answer = scan->reply + scan->size;
+    put16(answer, 0xc000 | 12);
+    put16(answer + 2, record->type);
+    put16(answer + 4, ns_c_in);
+    put32(answer + 6, record->ttl);
+    put16(answer + 10, record->len);
+    memcpy(answer + 12, record->data, record->len);
+    scan->size += len;
+    ++scan->answers;
+    lower_ttl(&scan->ttl, record->ttl);
+}
+
+static void store_additional(struct dns_cache *cache,
+    unsigned char const *reply, int reply_size, char const *exchange,
+    int type)
+{
+    unsigned char *query;
+    int query_size;
+    if (ares_create_query(exchange, ns_c_in, type, 0, 1, &query, &query_size,
+                          0) != ARES_SUCCESS) { return; }
+
+    struct additional_scan scan = {
+        .exchange = exchange,
+        .type = type,
+        .capacity = query_size,
+        .size = query_size,
+    };
+    scan.reply = copy_reply(query, query_size);
+    ares_free_string(query);
+
+    if (walk_reply(reply, reply_size, scan_additional, &scan) &&
+        scan.answers && scan.ttl.ttl)
+    {
+        // A recursive answer to the question.
+        put16(scan.reply + 2, 0x8180);
+        put16(scan.reply + 6, scan.answers);
+        uint32_t ttl = scan.ttl.ttl < DNS_CACHE_MAX_TTL
+            ? scan.ttl.ttl : DNS_CACHE_MAX_TTL;
+        insert(cache, exchange, type, ARES_SUCCESS, ttl, scan.reply,
+            scan.size);
+        return;
+    }
+    free(scan.reply);
+}
+
+void dns_cache_initialize(struct dns_cache *cache) {
+    int error = pthread_mutex_init(&cache->mutex, NULL);
+    if (error) {
+        die("`pthread_mutex_init(/* ... */)` failed: %s\n", strerror(error));
+    }
+
+    cache->entries_size = 0;
+    TAILQ_INIT(&cache->entries);
+    for (size_t i = 0; i < DNS_CACHE_BUCKETS; ++i) {
+        LIST_INIT(&cache->buckets[i]);
+    }
+}
+
+bool dns_cache_find(struct dns_cache *cache, char const *name, int type,
+    int *status, unsigned char **reply, int *reply_size)
+{
+    lock(cache);
+    struct dns_cache_entry *entry = find_entry(cache, name, type);
+    if (entry && entry->expires_at <= time(NULL)) {
+        remove_entry(cache, entry);
+        entry = NULL;
+    }
+    if (!entry) {
+        unlock(cache);
+        return false;
+    }
+
+    TAILQ_REMOVE(&cache->entries, entry, link);
+    TAILQ_INSERT_HEAD(&cache->entries, entry, link);
+    *status = entry->status;
+    *reply = copy_reply(entry->reply, entry->reply_size);
+    *reply_size = entry->reply_size;
+    unlock(cache);
+    return true;
+}
+
+void dns_cache_store(struct dns_cache *cache, char const *name, int type,
+    int status, unsigned char const *reply, int reply_size)
+{
+    if (status != ARES_SUCCESS && status != ARES_ENOTFOUND &&
+        status != ARES_ENODATA) { return; }
+    if (!reply) { return; }
+
+    struct ttl_scan scan = {
+        .reply = reply,
+        .reply_size = reply_size,
+        .negative = status != ARES_SUCCESS,
+    };
+    if (!walk_reply(reply, reply_size, scan_ttl, &scan)) { return; }
+    uint32_t ttl;
+    if (scan.negative) {
+        ttl = scan.found ? scan.ttl : DNS_CACHE_DEFAULT_NEGATIVE_TTL;
+        if (ttl > DNS_CACHE_MAX_NEGATIVE_TTL) {
+            ttl = DNS_CACHE_MAX_NEGATIVE_TTL;
+        }
+    } else {
+        ttl = scan.ttl < DNS_CACHE_MAX_TTL ? scan.ttl : DNS_CACHE_MAX_TTL;
+    }
+    if (!ttl) { return; }
+
+    lock(cache);
+    insert(cache, name, type, status, ttl, copy_reply(reply, reply_size),
+        reply_size);
+
+    // RFC 5321, section 5.1 allows for the addresses sent along.
+    struct ares_mx_reply *mx_replies;
+    if (status == ARES_SUCCESS && type == ns_t_mx &&
+        ares_parse_mx_reply(reply, reply_size, &mx_replies) == ARES_SUCCESS)
+    {
+        for (struct ares_mx_reply *mx_reply = mx_replies; mx_reply;
+             mx_reply = mx_reply->next)
+        {
+            store_additional(cache, reply, reply_size, mx_reply->host,
+                ns_t_a);
+            store_additional(cache, reply, reply_size, mx_reply->host,
+                ns_t_aaaa);
+        }
+        ares_free_data(mx_replies);
+    }
+    unlock(cache);
+}
+
+void dns_cache_finalize(struct dns_cache *cache) {
+    while (true) {
+        struct dns_cache_entry *entry = TAILQ_FIRST(&cache->entries);
+        if (!entry) { break; }
+        remove_entry(cache, entry);
+    }
+
+    int error = pthread_mutex_destroy(&cache->mutex);
+    if (error) {
+        die("`pthread_mutex_destroy(/* ... */)` failed: %s\n",
+            strerror(error));
+    }
+}
+
+
+/*! \file */
@@ -0,0 +1,23 @@
+#include <domain_pattern.h>
+
+#include <string.h>
+#include <strings.h>
+
+bool domain_pattern_matches(char const *pattern, char const *domain,
+    size_t domain_len)
+{
+    if (!strcmp(pattern, "*")) { return true; }
+    if (strncmp(pattern, "*.", 2)) {
+        return strlen(pattern) == domain_len &&
+            !strncasecmp(pattern, domain, domain_len);
+    }
+
+    // The leading dot is kept, so that only subdomains match.
+    char const *suffix = pattern + 1;
+    size_t suffix_len = strlen(suffix);
+    return domain_len > suffix_len &&
+        !strncasecmp(domain + domain_len - suffix_len, suffix, suffix_len);
+}
+
+
+/*! \file */
@@ -0,0 +1,88 @@
+#include <dot_stuffing.h>
+
+#include <string.h>
+#include <stdbool.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define DOT_STUFFING_X86
+#endif
+
+static bool starts_line(char const *data, size_t offset) {
+    return offset == 0 ||
+        (offset >= 2 && data[offset - 2] == '\r' && data[offset - 1] == '\n');
+}
+
+static size_t find_scalar(char const *data, size_t size, size_t offset) {
+    while (offset < size) {
+        char const *dot = memchr(data + offset, '.', size - offset);
+        if (!dot) { break; }
+        offset = dot - data;
+        if (starts_line(data, offset)) { return offset; }
+        ++offset;
+    }
+    return size;
+}
+
+#ifdef DOT_STUFFING_X86
+
+// Every position is matched against "\r\n." at once, with the two bytes
+// before it loaded from one and two bytes back.
+static size_t find_sse2(char const *data, size_t size, size_t offset) {
+    __m128i const cr = _mm_set1_epi8('\r');
+    __m128i const lf = _mm_set1_epi8('\n');
+    __m128i const dot = _mm_set1_epi8('.');
+    for (; offset + 16 <= size; offset += 16) {
+        char const *p = data + offset;
+        __m128i match = _mm_and_si128(
+            _mm_cmpeq_epi8(_mm_loadu_si128((void const*)p), dot),
+            _mm_and_si128(
+                _mm_cmpeq_epi8(_mm_loadu_si128((void const*)(p - 1)), lf),
+                _mm_cmpeq_epi8(_mm_loadu_si128((void const*)(p - 2)), cr)));
+        unsigned mask = _mm_movemask_epi8(match);
+        if (mask) { return offset + __builtin_ctz(mask); }
+    }
+    return find_scalar(data, size, offset);
+}
+
+__attribute__((target("avx2")))
+static size_t find_avx2(char const *data, size_t size, size_t offset) {
+    __m256i const cr = _mm256_set1_epi8('\r');
+    __m256i const lf = _mm256_set1_epi8('\n');
+    __m256i const dot = _mm256_set1_epi8('.');
+    for (; offset + 32 <= size; offset += 32) {
+        char const *p = data + offset;
+        __m256i match = _mm256_and_si256(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((void const*)p), dot),
+            _mm256_and_si256(
+                _mm256_cmpeq_epi8(
+                    _mm256_loadu_si256((void const*)(p - 1)), lf),
+                _mm256_cmpeq_epi8(
+                    _mm256_loadu_si256((void const*)(p - 2)), cr)));
+        unsigned mask = _mm256_movemask_epi8(match);
+        if (mask) { return offset + __builtin_ctz(mask); }
+    }
+    return find_sse2(data, size, offset);
+}
+
+#endif
+
+size_t dot_stuffing_find(char const *data, size_t size, size_t offset) {
+    // The vector loops look two bytes back.
+    for (; offset < size && offset < 2; ++offset) {
+        if (data[offset] == '.' && starts_line(data, offset)) {
+            return offset;
+        }
+    }
+#ifdef DOT_STUFFING_X86
+    if (__builtin_cpu_supports("avx2")) {
+        return find_avx2(data, size, offset);
+    }
+    return find_sse2(data, size, offset);
+#else
+    return find_scalar(data, size, offset);
+#endif
+}
+
+
+/*! \file */
@@ -0,0 +1,420 @@
+#include <event_loop.h>
+
+#include <die.h>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <time.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+static uint64_t monotonic_now() {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts)) {
+        die("`clock_gettime(CLOCK_MONOTONIC, /*...*/)` failed: %s\n",
+            strerror(errno));
+    }
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void event_handler_initialize(struct event_handler *handler,
+    void (*notify)(struct event_handler *handler, uint32_t events))
+{
+    handler->fd = -1;
+    handler->events = 0;
+    handler->notify = notify;
+    handler->scheduled = false;
+    handler->posted = false;
+}
+
+void event_timer_initialize(struct event_timer *timer,
+    void (*expire)(struct event_timer *timer))
+{
+    timer->armed = false;
+    timer->deadline = 0;
+    timer->expire = expire;
+}
+
+static void lock(struct event_loop *loop) {
+    int error = pthread_mutex_lock(&loop->mutex);
+    if (error) {
+        die("`pthread_mutex_lock(/* ... */)` failed: %s\n", strerror(error));
+    }
+}
+
+static void unlock(struct event_loop *loop) {
+    int error = pthread_mutex_unlock(&loop->mutex);
+    if (error) {
+        die("`pthread_mutex_unlock(/* ... */)` failed: %s\n",
+            strerror(error));
+    }
+}
+
+static void take_posted(struct event_loop *loop) {
+    lock(loop);
+    while (true) {
+        struct event_handler *handler = TAILQ_FIRST(&loop->posted);
+        if (!handler) { break; }
+        TAILQ_REMOVE(&loop->posted, handler, posted_link);
+        handler->posted = false;
+        event_loop_schedule(loop, handler);
+    }
+    unlock(loop);
+}
+
+static void wakeup_notify(struct event_handler *handler, uint32_t events) {
+    struct event_loop *loop =
+        container_of(handler, struct event_loop, wakeup_handler);
+    if (!(events & EPOLLIN)) { return; }
+
+    uint64_t value;
+    if (read(handler->fd, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+        die("`read(%d, /*...*/)` failed: %s\n", handler->fd, strerror(errno));
+    }
+    take_posted(loop);
+}
+
+void event_loop_initialize(struct event_loop *loop) {
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd == -1) {
+        die("`epoll_create1(EPOLL_CLOEXEC)` failed: %s\n", strerror(errno));
+    }
+
+    loop->now = monotonic_now();
+
+    loop->ready_size = 0;
+
+    loop->scheduled_size = 0;
+    TAILQ_INIT(&loop->scheduled);
+
+    loop->wheel_time = loop->now;
+    loop->timers_size = 0;
+    for (size_t level = 0; level < EVENT_LOOP_WHEEL_LEVELS; ++level) {
+        loop->wheel_occupied[level] = 0;
+        for (size_t slot = 0; slot < EVENT_LOOP_WHEEL_SLOTS; ++slot) {
+            LIST_INIT(&loop->wheel[level][slot]);
+        }
+    }
+    LIST_INIT(&loop->expired);
+
+    loop->thread = pthread_self();
+
+    {
+        int error = pthread_mutex_init(&loop->mutex, NULL);
+        if (error) {
+            die("`pthread_mutex_init(/* ... */)` failed: %s\n",
+                strerror(error));
+        }
+    }
+    TAILQ_INIT(&loop->posted);
+
+    int wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeup_fd == -1) {
+        die("`eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)` failed: %s\n",
+            strerror(errno));
+    }
+    event_handler_initialize(&loop->wakeup_handler, wakeup_notify);
+    event_loop_add(loop, &loop->wakeup_handler, wakeup_fd, EPOLLIN);
+
+    loop->ring = NULL;
+}
+
+void event_loop_add(struct event_loop *loop, struct event_handler *handler,
+    int fd, uint32_t events)
+{
+    assert(handler->fd == -1);
+    struct epoll_event event = { .events = events, .data.ptr = handler };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event)) {
+        die("`epoll_ctl(%d, EPOLL_CTL_ADD, %d, /*...*/)` failed: %s\n",
+            loop->epoll_fd, fd, strerror(errno));
+    }
+    handler->fd = fd;
+    handler->events = events;
+}
+
+void event_loop_modify(struct event_loop *loop, struct event_handler *handler,
+    uint32_t events)
+{
+    assert(handler->fd != -1);
+    if (handler->events == events) { return; }
+    struct epoll_event event = { .events = events, .data.ptr = handler };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, handler->fd, &event)) {
+        die("`epoll_ctl(%d, EPOLL_CTL_MOD, %d, /*...*/)` failed: %s\n",
+            loop->epoll_fd, handler->fd, strerror(errno));
+    }
+    handler->events = events;
+}
+
+void event_loop_remove(struct event_loop *loop, struct event_handler *handler)
+{
+    if (handler->fd == -1) { return; }
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, handler->fd, NULL)) {
+        die("`epoll_ctl(%d, EPOLL_CTL_DEL, %d, NULL)` failed: %s\n",
+            loop->epoll_fd, handler->fd, strerror(errno));
+    }
+    handler->fd = -1;
+    handler->events = 0;
+
+    // The handler may still be referenced by the batch being dispatched.
+    for (size_t i = 0; i < loop->ready_size; ++i) {
+        if (loop->ready[i].data.ptr == handler) {
+            loop->ready[i].data.ptr = NULL;
+        }
+    }
+}
+
+void event_loop_schedule(struct event_loop *loop,
+    struct event_handler *handler)
+{
+    if (handler->scheduled) { return; }
+    handler->scheduled = true;
+    TAILQ_INSERT_TAIL(&loop->scheduled, handler, scheduled_link);
+    ++loop->scheduled_size;
+}
+
+void event_loop_post(struct event_loop *loop, struct event_handler *handler) {
+    if (pthread_equal(pthread_self(), loop->thread)) {
+        event_loop_schedule(loop, handler);
+        return;
+    }
+
+    lock(loop);
+    bool wakeup = TAILQ_EMPTY(&loop->posted);
+    if (!handler->posted) {
+        handler->posted = true;
+        TAILQ_INSERT_TAIL(&loop->posted, handler, posted_link);
+    }
+    unlock(loop);
+
+    if (wakeup &&
+        write(loop->wakeup_handler.fd, &(uint64_t){1}, sizeof(uint64_t)) ==
+            -1 &&
+        errno != EAGAIN)
+    {
+        die("`write(%d, /*...*/)` failed: %s\n",
+            loop->wakeup_handler.fd, strerror(errno));
+    }
+}
+
+void event_loop_cancel(struct event_loop *loop, struct event_handler *handler)
+{
+    if (handler->scheduled) {
+        handler->scheduled = false;
+        TAILQ_REMOVE(&loop->scheduled, handler, scheduled_link);
+        --loop->scheduled_size;
+    }
+
+    lock(loop);
+    if (handler->posted) {
+        handler->posted = false;
+        TAILQ_REMOVE(&loop->posted, handler, posted_link);
+    }
+    unlock(loop);
+}
+
+static uint64_t level_shift(size_t level) {
+    return level * EVENT_LOOP_WHEEL_BITS;
+}
+
+static void insert_timer(struct event_loop *loop, struct event_timer *timer) {
+    uint64_t deadline = timer->deadline > loop->wheel_time
+        ? timer->deadline : loop->wheel_time;
+
+    // Timers beyond the last level wait in its farthest slot and are
+    // placed again when it cascades.
+    size_t level = 0;
+    while (level + 1 < EVENT_LOOP_WHEEL_LEVELS &&
+           deadline - loop->wheel_time >=
+               (uint64_t)1 << level_shift(level + 1)) { ++level; }
+    uint64_t range = (uint64_t)1 << level_shift(EVENT_LOOP_WHEEL_LEVELS);
+    if (deadline - loop->wheel_time >= range) {
+        deadline = loop->wheel_time + range - 1;
+    }
+
+    size_t slot = (deadline >> level_shift(level)) &
+        (EVENT_LOOP_WHEEL_SLOTS - 1);
+    LIST_INSERT_HEAD(&loop->wheel[level][slot], timer, link);
+    loop->wheel_occupied[level] |= (uint64_t)1 << slot;
+}
+
+void event_loop_arm(struct event_loop *loop, struct event_timer *timer,
+    uint64_t timeout)
+{
+    if (timer->armed) {
+        LIST_REMOVE(timer, link);
+    } else {
+        timer->armed = true;
+        ++loop->timers_size;
+    }
+    timer->deadline = loop->now + timeout;
+    insert_timer(loop, timer);
+}
+
+void event_loop_disarm(struct event_loop *loop, struct event_timer *timer) {
+    if (!timer->armed) { return; }
+    timer->armed = false;
+    --loop->timers_size;
+    // Occupancy bits are cleared lazily by whoever finds the slot empty.
+    LIST_REMOVE(timer, link);
+}
+
+// Distance in slots from `start` to the first occupied slot at or after it,
+// `EVENT_LOOP_WHEEL_SLOTS` when there is none.
+static size_t find_slot(struct event_loop *loop, size_t level, size_t start) {
+    uint64_t occupied = loop->wheel_occupied[level];
+    while (true) {
+        start &= EVENT_LOOP_WHEEL_SLOTS - 1;
+        uint64_t rotated = start
+            ? occupied >> start | occupied << (EVENT_LOOP_WHEEL_SLOTS - start)
+            : occupied;
+        if (!rotated) {
+            loop->wheel_occupied[level] = 0;
+            return EVENT_LOOP_WHEEL_SLOTS;
+        }
+        size_t distance = __builtin_ctzll(rotated);
+        size_t slot = (start + distance) & (EVENT_LOOP_WHEEL_SLOTS - 1);
+        if (!LIST_EMPTY(&loop->wheel[level][slot])) { return distance; }
+        occupied &= ~((uint64_t)1 << slot);
+        loop->wheel_occupied[level] = occupied;
+    }
+}
+
+static int next_timeout(struct event_loop *loop) {
+    if (loop->scheduled_size) { return 0; }
+    if (!loop->timers_size) { return -1; }
+
+    // The earliest slot of every level gives a lower bound: level zero
+    // holds exact ticks, higher ones the tick their slot cascades at.
+    uint64_t wakeup = UINT64_MAX;
+    for (size_t level = 0; level < EVENT_LOOP_WHEEL_LEVELS; ++level) {
+        uint64_t position = loop->wheel_time >> level_shift(level);
+        // The current slot was cascaded already, unless `wheel_time` sits
+        // right at its start.
+        uint64_t skip = (loop->wheel_time &
+            (((uint64_t)1 << level_shift(level)) - 1)) ? 1 : 0;
+        size_t distance = find_slot(loop, level, position + skip);
+        if (distance == EVENT_LOOP_WHEEL_SLOTS) { continue; }
+        uint64_t candidate = (position + skip + distance) << level_shift(level);
+        if (candidate < wakeup) { wakeup = candidate; }
+    }
+
+    if (wakeup <= loop->now) { return 0; }
+    return wakeup - loop->now > INT_MAX ? INT_MAX : (int)(wakeup - loop->now);
+}
+
+static void cascade(struct event_loop *loop, size_t level) {
+    size_t slot = (loop->wheel_time >> level_shift(level)) &
+        (EVENT_LOOP_WHEEL_SLOTS - 1);
+    struct event_timer *timer;
+    while ((timer = LIST_FIRST(&loop->wheel[level][slot]))) {
+        LIST_REMOVE(timer, link);
+        insert_timer(loop, timer);
+    }
+    loop->wheel_occupied[level] &= ~((uint64_t)1 << slot);
+
+    if (!slot && level + 1 < EVENT_LOOP_WHEEL_LEVELS) {
+        cascade(loop, level + 1);
+    }
+}
+
+static void expire_timers(struct event_loop *loop) {
+    while (loop->wheel_time <= loop->now) {
+        size_t slot = loop->wheel_time & (EVENT_LOOP_WHEEL_SLOTS - 1);
+        if (!slot) { cascade(loop, 1); }
+
+        if (!loop->wheel_occupied[0]) {
+            // Nothing can expire before the next cascade.
+            uint64_t next = (loop->wheel_time | (EVENT_LOOP_WHEEL_SLOTS - 1))
+                + 1;
+            loop->wheel_time = next <= loop->now + 1 ? next : loop->now + 1;
+            continue;
+        }
+
+        // Timers rearmed by `expire` must not land in the slot being
+        // drained, so it is emptied up front.
+        struct event_timer *timer;
+        while ((timer = LIST_FIRST(&loop->wheel[0][slot]))) {
+            LIST_REMOVE(timer, link);
+            LIST_INSERT_HEAD(&loop->expired, timer, link);
+        }
+        loop->wheel_occupied[0] &= ~((uint64_t)1 << slot);
+        ++loop->wheel_time;
+
+        while ((timer = LIST_FIRST(&loop->expired))) {
+            event_loop_disarm(loop, timer);
+            timer->expire(timer);
+        }
+    }
+}
+
+void event_loop_run(struct event_loop *loop) {
+    int timeout = next_timeout(loop);
+    int size = epoll_wait(loop->epoll_fd, loop->ready,
+        EVENT_LOOP_BATCH_SIZE, timeout);
+    if (size < 0) {
+        if (errno != EINTR) {
+            die("`epoll_wait(%d, /*...*/, %d, %d)` failed: %s\n",
+                loop->epoll_fd, EVENT_LOOP_BATCH_SIZE, timeout,
+                strerror(errno));
+        }
+        size = 0;
+    }
+    loop->now = monotonic_now();
+
+    loop->ready_size = size;
+    for (size_t i = 0; i < loop->ready_size; ++i) {
+        struct event_handler *handler = loop->ready[i].data.ptr;
+        if (!handler) { continue; }
+        handler->notify(handler, loop->ready[i].events);
+    }
+    loop->ready_size = 0;
+
+    expire_timers(loop);
+
+    // Handlers scheduled from here on wait for the next round, so a handler
+    // rescheduling itself cannot starve the sockets.
+    for (size_t count = loop->scheduled_size; count > 0; --count) {
+        struct event_handler *handler = TAILQ_FIRST(&loop->scheduled);
+        if (!handler) { break; }
+        event_loop_cancel(loop, handler);
+        handler->notify(handler, 0);
+    }
+}
+
+void event_loop_flush(struct event_loop *loop) {
+    while (true) {
+        take_posted(loop);
+        struct event_handler *handler = TAILQ_FIRST(&loop->scheduled);
+        if (!handler) { break; }
+        event_loop_cancel(loop, handler);
+        handler->notify(handler, 0);
+    }
+}
+
+void event_loop_finalize(struct event_loop *loop) {
+    assert(!loop->timers_size);
+
+    int wakeup_fd = loop->wakeup_handler.fd;
+    event_loop_remove(loop, &loop->wakeup_handler);
+    if (close(wakeup_fd)) {
+        die("`close(%d)` failed: %s\n", wakeup_fd, strerror(errno));
+    }
+
+    {
+        int error = pthread_mutex_destroy(&loop->mutex);
+        if (error) {
+            die("`pthread_mutex_destroy(/* ... */)` failed: %s\n",
+                strerror(error));
+        }
+    }
+
+    if (close(loop->epoll_fd)) {
+        die("`close(%d)` failed: %s\n", loop->epoll_fd, strerror(errno));
+    }
+}
+
+
+/*! \file */
@@ -0,0 +1,217 @@
+#include <host_table.h>
+
+#include <die.h>
+
+#include <sys/socket.h>
+
+#include <ctype.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+
+enum {
+    HOST_TABLE_SIZE = 1024,
+    // Seconds a winning address family is preferred for; routes change.
+    HOST_TABLE_FAMILY_TTL = 10 * 60,
+    // Milliseconds of latency telling hosts apart.
+    HOST_TABLE_LATENCY_TOLERANCE = 50,
+    // Failures in a row that open a circuit, and the seconds it stays open
+    // at first; every further failure doubles that.
+    HOST_TABLE_FAILURE_THRESHOLD = 3,
+    HOST_TABLE_OPEN_INTERVAL = 60,
+    HOST_TABLE_MAX_OPEN_INTERVAL = 30 * 60,
+};
+
+struct host_table_entry {
+    TAILQ_ENTRY(host_table_entry) link;
+    LIST_ENTRY(host_table_entry) bucket_link;
+    char *host;
+    int family;
+    time_t connected_at;
+    // Smoothed as TCP does round-trip times (RFC 6298), zero until known.
+    uint64_t latency;
+    unsigned failures;
+    // The circuit is open until then.
+    time_t open_until;
+};
+
+static void lock(struct host_table *table) {
+    int error = pthread_mutex_lock(&table->mutex);
+    if (error) {
+        die("`pthread_mutex_lock(/* ... */)` failed: %s\n", strerror(error));
+    }
+}
+
+static void unlock(struct host_table *table) {
+    int error = pthread_mutex_unlock(&table->mutex);
+    if (error) {
+        die("`pthread_mutex_unlock(/* ... */)` failed: %s\n",
+            strerror(error));
+    }
+}
+
+static size_t hash(char const *host) {
+    size_t hash = 0;
+    for (; *host; ++host) { hash = hash * 31 + tolower((unsigned char)*host); }
+    return hash % HOST_TABLE_BUCKETS;
+}
+
+static void free_entry(struct host_table_entry *entry) {
+    LIST_REMOVE(entry, bucket_link);
+    free(entry->host);
+    free(entry);
+}
+
+static struct host_table_entry *find_entry(struct host_table *table,
+    char const *host, bool create)
+{
+    struct host_table_entry *entry = LIST_FIRST(&table->buckets[hash(host)]);
+    while (entry && strcasecmp(entry->host, host)) {
+        entry = LIST_NEXT(entry, bucket_link);
+    }
+    if (entry) {
+        TAILQ_REMOVE(&table->entries, entry, link);
+        TAILQ_INSERT_HEAD(&table->entries, entry, link);
+        return entry;
+    }
+    if (!create) { return NULL; }
+
+    entry = malloc(sizeof(*entry));
+    if (!entry) {
+        die("`malloc(%zu)` failed: %s\n", sizeof(*entry), strerror(errno));
+    }
+    entry->host = strdup(host);
+    if (!entry->host) {
+        die("`strdup(\"%s\")` failed: %s\n", host, strerror(errno));
+    }
+    entry->family = AF_UNSPEC;
+    entry->connected_at = 0;
+    entry->latency = 0;
+    entry->failures = 0;
+    entry->open_until = 0;
+    TAILQ_INSERT_HEAD(&table->entries, entry, link);
+    LIST_INSERT_HEAD(&table->buckets[hash(host)], entry, bucket_link);
+
+    if (++table->entries_size > HOST_TABLE_SIZE) {
+        struct host_table_entry *last =
+            TAILQ_LAST(&table->entries, host_table_entry_list);
+        TAILQ_REMOVE(&table->entries, last, link);
+        --table->entries_size;
+        free_entry(last);
+    }
+    return entry;
+}
+
+void host_table_initialize(struct host_table *table) {
+    {
+        int error = pthread_mutex_init(&table->mutex, NULL);
+        if (error) {
+            die("`pthread_mutex_init(/* ... */)` failed: %s\n",
+                strerror(error));
+        }
+    }
+
+    table->entries_size = 0;
+    TAILQ_INIT(&table->entries);
+    for (size_t i = 0; i < HOST_TABLE_BUCKETS; ++i) {
+        LIST_INIT(&table->buckets[i]);
+    }
+}
+
+int host_table_family(struct host_table *table, char const *host) {
+    int family = AF_UNSPEC;
+    lock(table);
+    struct host_table_entry *entry = find_entry(table, host, false);
+    if (entry && time(NULL) - entry->connected_at < HOST_TABLE_FAMILY_TTL) {
+        family = entry->family;
+    }
+    unlock(table);
+    return family;
+}
+
+unsigned host_table_rank(struct host_table *table, char const *host) {
+    unsigned rank = 0;
+    lock(table);
+    struct host_table_entry *entry = find_entry(table, host, false);
+    if (entry && entry->open_until > time(NULL)) {
+        rank = UINT_MAX;
+    } else if (entry) {
+        rank = entry->latency / HOST_TABLE_LATENCY_TOLERANCE;
+    }
+    unlock(table);
+    return rank;
+}
+
+bool host_table_usable(struct host_table *table, char const *host) {
+    bool usable = true;
+    time_t now = time(NULL);
+    lock(table);
+    struct host_table_entry *entry = find_entry(table, host, false);
+    if (entry && entry->open_until > now) {
+        usable = false;
+    } else if (entry && entry->failures >= HOST_TABLE_FAILURE_THRESHOLD) {
+        // Half-open: others wait for how this one goes.
+        entry->open_until = now + HOST_TABLE_OPEN_INTERVAL;
+    }
+    unlock(table);
+    return usable;
+}
+
+void host_table_connected(struct host_table *table, char const *host,
+    int family, uint64_t latency)
+{
+    lock(table);
+    struct host_table_entry *entry = find_entry(table, host, true);
+    entry->family = family;
+    entry->connected_at = time(NULL);
+    entry->latency = entry->latency
+        ? (entry->latency * 7 + latency) / 8 : latency;
+    unlock(table);
+}
+
+void host_table_succeeded(struct host_table *table, char const *host) {
+    lock(table);
+    struct host_table_entry *entry = find_entry(table, host, true);
+    entry->failures = 0;
+    entry->open_until = 0;
+    unlock(table);
+}
+
+void host_table_failed(struct host_table *table, char const *host) {
+    lock(table);
+    struct host_table_entry *entry = find_entry(table, host, true);
+    if (++entry->failures >= HOST_TABLE_FAILURE_THRESHOLD) {
+        time_t interval = HOST_TABLE_OPEN_INTERVAL;
+        for (unsigned i = HOST_TABLE_FAILURE_THRESHOLD;
+             i < entry->failures && interval < HOST_TABLE_MAX_OPEN_INTERVAL;
+             ++i) { interval *= 2; }
+        if (interval > HOST_TABLE_MAX_OPEN_INTERVAL) {
+            interval = HOST_TABLE_MAX_OPEN_INTERVAL;
+        }
+        entry->open_until = time(NULL) + interval;
+    }
+    unlock(table);
+}
+
+void host_table_finalize(struct host_table *table) {
+    while (true) {
+        struct host_table_entry *entry = TAILQ_FIRST(&table->entries);
+        if (!entry) { break; }
+        TAILQ_REMOVE(&table->entries, entry, link);
+        free_entry(entry);
+    }
+
+    {
+        int error = pthread_mutex_destroy(&table->mutex);
+        if (error) {
+            die("`pthread_mutex_destroy(/* ... */)` failed: %s\n",
+                strerror(error));
+        }
+    }
+}
+
+
+/*! \file */
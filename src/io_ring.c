@@ -0,0 +1,287 @@
+#include <io_ring.h>
+
+#include <die.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+static int enter(struct io_ring *ring, unsigned to_submit,
+    unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, ring->handler.fd,
+        to_submit, min_complete, flags, NULL, 0);
+}
+
+static void submit(struct io_ring *ring) {
+    while (ring->queued > 0) {
+        int result = enter(ring, ring->queued, 0, 0);
+        if (result < 0) {
+            if (errno == EINTR) { continue; }
+            if (errno == EAGAIN || errno == EBUSY) { return; }
+            die("`io_uring_enter(%d, %u, 0, 0)` failed: %s\n",
+                ring->handler.fd, ring->queued, strerror(errno));
+        }
+        ring->queued -= result;
+    }
+}
+
+static void reap(struct io_ring *ring) {
+    while (true) {
+        unsigned head = *ring->cq_head;
+        if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+        struct io_ring_request *request = (void*)(uintptr_t)cqe->user_data;
+        int result = cqe->res;
+        // Release the entry before `complete` runs, it may reap as well.
+        __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+        // Zero-copy sends complete with the result, the notification that
+        // the kernel is done with the buffer may outlive the request.
+        if (!request || cqe->flags & IORING_CQE_F_NOTIF) { continue; }
+        request->in_flight = false;
+        --ring->in_flight;
+        if (!request->cancelled) { request->complete(request, result); }
+    }
+}
+
+static void notify(struct event_handler *handler, uint32_t events) {
+    struct io_ring *ring = container_of(handler, struct io_ring, handler);
+    (void)events;
+    reap(ring);
+}
+
+static void submit_notify(struct event_handler *handler, uint32_t events) {
+    struct io_ring *ring =
+        container_of(handler, struct io_ring, submit_handler);
+    (void)events;
+    submit(ring);
+    if (ring->queued > 0) {
+        event_loop_schedule(ring->loop, &ring->submit_handler);
+    }
+}
+
+static struct io_uring_sqe *get_sqe(struct io_ring *ring,
+    struct io_ring_request *request)
+{
+    unsigned tail = *ring->sq_tail;
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >
+        ring->sq_mask)
+    {
+        submit(ring);
+        while (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >
+               ring->sq_mask)
+        {
+            if (enter(ring, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+                errno != EINTR)
+            {
+                die("`io_uring_enter(%d, 0, 1, IORING_ENTER_GETEVENTS)` "
+                    "failed: %s\n", ring->handler.fd, strerror(errno));
+            }
+            reap(ring);
+            submit(ring);
+        }
+    }
+
+    unsigned index = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uintptr_t)request;
+    ring->sq_array[index] = index;
+
+    if (request) {
+        assert(!request->in_flight);
+        request->in_flight = true;
+        request->cancelled = false;
+        ++ring->in_flight;
+    }
+    return sqe;
+}
+
+static void push_sqe(struct io_ring *ring) {
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+    ++ring->queued;
+    // Everything queued during one loop round goes out in a single syscall.
+    event_loop_schedule(ring->loop, &ring->submit_handler);
+}
+
+void io_ring_request_initialize(struct io_ring_request *request,
+    void (*complete)(struct io_ring_request *request, int result))
+{
+    request->complete = complete;
+    request->in_flight = false;
+    request->cancelled = false;
+}
+
+int io_ring_initialize(struct io_ring *ring, struct event_loop *loop,
+    unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd == -1) { return -1; }
+
+    ring->sq_ring_size =
+        params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) { goto failed; }
+
+    ring->cq_ring_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) { goto unmap_sq_ring; }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) { goto unmap_cq_ring; }
+
+    char *sq = ring->sq_ring;
+    ring->sq_head = (void*)(sq + params.sq_off.head);
+    ring->sq_tail = (void*)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (void*)(sq + params.sq_off.array);
+
+    char *cq = ring->cq_ring;
+    ring->cq_head = (void*)(cq + params.cq_off.head);
+    ring->cq_tail = (void*)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (void*)(cq + params.cq_off.cqes);
+
+    ring->queued = 0;
+    ring->in_flight = 0;
+
+    ring->loop = loop;
+    event_handler_initialize(&ring->handler, notify);
+    event_handler_initialize(&ring->submit_handler, submit_notify);
+    event_loop_add(loop, &ring->handler, fd, EPOLLIN);
+
+    return 0;
+
+unmap_cq_ring:
+    munmap(ring->cq_ring, ring->cq_ring_size);
+unmap_sq_ring:
+    munmap(ring->sq_ring, ring->sq_ring_size);
+failed:;
+    int error = errno;
+    close(fd);
+    errno = error;
+    return -1;
+}
+
+void io_ring_read(struct io_ring *ring, struct io_ring_request *request,
+    int fd, void *buffer, size_t size, uint64_t offset)
+{
+    struct io_uring_sqe *sqe = get_sqe(ring, request);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buffer;
+    sqe->len = size;
+    sqe->off = offset;
+    push_sqe(ring);
+}
+
+void io_ring_recv(struct io_ring *ring, struct io_ring_request *request,
+    int fd, void *buffer, size_t size)
+{
+    struct io_uring_sqe *sqe = get_sqe(ring, request);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buffer;
+    sqe->len = size;
+    push_sqe(ring);
+}
+
+void io_ring_sendmsg(struct io_ring *ring, struct io_ring_request *request,
+    int fd, struct msghdr const *msghdr)
+{
+    struct io_uring_sqe *sqe = get_sqe(ring, request);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)msghdr;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    push_sqe(ring);
+}
+
+void io_ring_sendmsg_zc(struct io_ring *ring, struct io_ring_request *request,
+    int fd, struct msghdr const *msghdr)
+{
+    struct io_uring_sqe *sqe = get_sqe(ring, request);
+    sqe->opcode = IORING_OP_SENDMSG_ZC;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)msghdr;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    push_sqe(ring);
+}
+
+void io_ring_unlink(struct io_ring *ring, struct io_ring_request *request,
+    int dir_fd, char const *path)
+{
+    struct io_uring_sqe *sqe = get_sqe(ring, request);
+    sqe->opcode = IORING_OP_UNLINKAT;
+    sqe->fd = dir_fd;
+    sqe->addr = (uintptr_t)path;
+    push_sqe(ring);
+}
+
+void io_ring_cancel(struct io_ring *ring, struct io_ring_request *request) {
+    if (!request->in_flight) { return; }
+    request->cancelled = true;
+
+    struct io_uring_sqe *sqe = get_sqe(ring, NULL);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uintptr_t)request;
+    push_sqe(ring);
+    submit(ring);
+
+    // The owner is about to release the buffers the kernel may still touch.
+    while (request->in_flight) {
+        if (enter(ring, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+            die("`io_uring_enter(%d, 0, 1, IORING_ENTER_GETEVENTS)` "
+                "failed: %s\n", ring->handler.fd, strerror(errno));
+        }
+        reap(ring);
+    }
+}
+
+void io_ring_wait(struct io_ring *ring) {
+    submit(ring);
+    while (ring->in_flight > 0) {
+        if (enter(ring, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+            die("`io_uring_enter(%d, 0, 1, IORING_ENTER_GETEVENTS)` "
+                "failed: %s\n", ring->handler.fd, strerror(errno));
+        }
+        reap(ring);
+    }
+}
+
+void io_ring_finalize(struct io_ring *ring) {
+    io_ring_wait(ring);
+    event_loop_cancel(ring->loop, &ring->submit_handler);
+
+    int fd = ring->handler.fd;
+    event_loop_remove(ring->loop, &ring->handler);
+
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+
+    if (close(fd)) {
+        die("`close(%d)` failed: %s\n", fd, strerror(errno));
+    }
+}
+
+
+/*! \file */
@@ -3,39 +3,565 @@
 #include <die.h>
 #include <masprintf.h>
 #include <ensure_directory.h>
+#include <io_ring.h>
 #include <logger.h>
 
+#include <dirent.h>
+#include <fcntl.h>
 #include <sys/inotify.h>
+#include <sys/stat.h>
 #include <sys/unistd.h>
 
+#include <stdio.h>
+#include <time.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <assert.h>
 #include <stdbool.h>
 
+enum maildir_message_state {
+    // Not yet handed out.
+    MESSAGE_HELD,
+    // Found unindexed by the initial scan, its age to be looked up.
+    MESSAGE_UNAGED,
+    // Handed out once the batch is sorted.
+    MESSAGE_BATCHED,
+    MESSAGE_PENDING,
+    MESSAGE_DISCOVERED,
+};
+
 struct maildir_message {
-    STAILQ_ENTRY(maildir_message) link;
+    LIST_ENTRY(maildir_message) bucket_link;
+    // Linked into `pending` or `unaged` as per `state`.
+    TAILQ_ENTRY(maildir_message) link;
+    enum maildir_message_state state;
+    // That of the last scan to come across the file.
+    unsigned generation;
+    size_t hash;
+
+    // Set along with `sender` and `domains` once the file is in the index.
+    bool indexed;
+    uint64_t inode;
+    // Nanoseconds since the epoch, orders the backlog found on startup.
+    int64_t mtime;
+    uint64_t size;
+    char *sender;
+    size_t sender_len;
+    char *domains;
+    size_t domains_len;
+    // Left by the last attempt, as in `struct queue_index_entry`.
+    uint32_t attempts;
+    int64_t retry_at;
+    char *deferred;
+    size_t deferred_len;
+    char *rejected;
+    size_t rejected_len;
+
     char name[];
 };
 
-static void enqueue(struct maildir *maildir, char const* name) {
-    for (struct maildir_message *message = STAILQ_FIRST(&maildir->messages);
-         message; message = STAILQ_NEXT(message, link))
-    { if (!strcmp(message->name, name)) { return; } }
+enum { INITIAL_BUCKETS = 64 };
 
-    struct maildir_message *message =
-        malloc(sizeof(*message) + strlen(name) + 1);
+enum { INITIAL_BATCH = 256 };
+
+// Records of files long gone the index may hold beyond twice the live ones
+// before it is rewritten.
+enum { INDEX_SLACK = 1000 };
+
+// Directory entries are read a large batch at a time and for up to
+// `SCAN_BUDGET` milliseconds in a row, so that a backlog of many files is
+// listed in few loop rounds without starving everything else.
+enum {
+    SCAN_BUFFER_SIZE = 256 * 1024,
+    SCAN_BUDGET = 10,
+};
+
+enum { INOTIFY_BUFFER_SIZE = 64 * 1024 };
+
+static uint64_t monotonic_now(void) {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts)) {
+        die("`clock_gettime(CLOCK_MONOTONIC, /*...*/)` failed: %s\n",
+            strerror(errno));
+    }
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// FNV-1a.
+static size_t hash(char const *name) {
+    uint64_t hash = UINT64_C(14695981039346656037);
+    for (; *name; ++name) {
+        hash = (hash ^ (unsigned char)*name) * UINT64_C(1099511628211);
+    }
+    return hash;
+}
+
+static struct maildir_bucket *bucket(struct maildir *maildir, size_t hash) {
+    return &maildir->buckets[hash & (maildir->buckets_size - 1)];
+}
+
+static struct maildir_message *find(struct maildir *maildir,
+    char const *name, size_t hash)
+{
+    struct maildir_message *message = LIST_FIRST(bucket(maildir, hash));
+    while (message &&
+           (message->hash != hash || strcmp(message->name, name)))
+    { message = LIST_NEXT(message, bucket_link); }
+    return message;
+}
+
+static void allocate_buckets(struct maildir *maildir, size_t size) {
+    maildir->buckets_size = size;
+    maildir->buckets = malloc(size * sizeof(*maildir->buckets));
+    if (!maildir->buckets) {
+        die("`malloc(%zu)` failed: %s\n",
+            size * sizeof(*maildir->buckets), strerror(errno));
+    }
+    for (size_t i = 0; i < size; ++i) { LIST_INIT(&maildir->buckets[i]); }
+}
+
+// Keeps the buckets at most one name deep on average.
+static void grow(struct maildir *maildir) {
+    size_t old_size = maildir->buckets_size;
+    struct maildir_bucket *old_buckets = maildir->buckets;
+    allocate_buckets(maildir, old_size * 2);
+    for (size_t i = 0; i < old_size; ++i) {
+        while (true) {
+            struct maildir_message *message = LIST_FIRST(&old_buckets[i]);
+            if (!message) { break; }
+            LIST_REMOVE(message, bucket_link);
+            LIST_INSERT_HEAD(bucket(maildir, message->hash), message,
+                bucket_link);
+        }
+    }
+    free(old_buckets);
+}
+
+static char *duplicate(char const *text, size_t text_len) {
+    char *result = malloc(text_len + 1);
+    if (!result) {
+        die("`malloc(%zu)` failed: %s\n", text_len + 1, strerror(errno));
+    }
+    if (text_len) { memcpy(result, text, text_len); }
+    result[text_len] = '\0';
+    return result;
+}
+
+static int64_t nanoseconds(struct timespec const *ts) {
+    return (int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+static struct maildir_message *insert(struct maildir *maildir,
+    char const *name, size_t name_hash)
+{
+    struct maildir_message *message = malloc(sizeof(*message) +
+        strlen(name) + 1);
     if (!message) {
         die("`malloc(%zu)` failed: %s\n",
             sizeof(*message) + strlen(name) + 1, strerror(errno));
     }
     strcpy(message->name, name);
+    message->hash = name_hash;
+    message->generation = maildir->generation;
+    message->state = MESSAGE_HELD;
+    message->indexed = false;
+    message->sender = NULL;
+    message->domains = NULL;
+    message->deferred = NULL;
+    message->rejected = NULL;
+
+    LIST_INSERT_HEAD(bucket(maildir, name_hash), message, bucket_link);
+    if (++maildir->messages_size > maildir->buckets_size) { grow(maildir); }
+    return message;
+}
+
+static void set_progress(struct maildir_message *message,
+    struct queue_index_entry const *entry)
+{
+    message->attempts = entry->attempts;
+    message->retry_at = entry->retry_at;
+    message->deferred = duplicate(entry->deferred, entry->deferred_len);
+    message->deferred_len = entry->deferred_len;
+    message->rejected = duplicate(entry->rejected, entry->rejected_len);
+    message->rejected_len = entry->rejected_len;
+}
+
+static struct queue_index_entry index_entry(
+    struct maildir_message const *message)
+{
+    return (struct queue_index_entry){
+        .name = message->name,
+        .inode = message->inode,
+        .mtime = message->mtime,
+        .size = message->size,
+        .sender = message->sender,
+        .sender_len = message->sender_len,
+        .domains = message->domains,
+        .domains_len = message->domains_len,
+        .attempts = message->attempts,
+        .retry_at = message->retry_at,
+        .deferred = message->deferred,
+        .deferred_len = message->deferred_len,
+        .rejected = message->rejected,
+        .rejected_len = message->rejected_len,
+    };
+}
+
+static void set_indexed(struct maildir *maildir,
+    struct maildir_message *message, struct queue_index_entry const *entry)
+{
+    message->indexed = true;
+    message->inode = entry->inode;
+    message->mtime = entry->mtime;
+    message->size = entry->size;
+    message->sender = duplicate(entry->sender, entry->sender_len);
+    message->sender_len = entry->sender_len;
+    message->domains = duplicate(entry->domains, entry->domains_len);
+    message->domains_len = entry->domains_len;
+    set_progress(message, entry);
+    ++maildir->indexed_size;
+}
+
+static void unset_indexed(struct maildir *maildir,
+    struct maildir_message *message)
+{
+    if (!message->indexed) { return; }
+    message->indexed = false;
+    free(message->sender);
+    message->sender = NULL;
+    free(message->domains);
+    message->domains = NULL;
+    free(message->deferred);
+    message->deferred = NULL;
+    free(message->rejected);
+    message->rejected = NULL;
+    --maildir->indexed_size;
+}
+
+static void remove_message(struct maildir *maildir,
+    struct maildir_message *message)
+{
+    LIST_REMOVE(message, bucket_link);
+    // Batches are handed out before anything else can remove their files.
+    assert(message->state != MESSAGE_BATCHED);
+    if (message->state == MESSAGE_PENDING) {
+        TAILQ_REMOVE(&maildir->pending, message, link);
+    } else if (message->state == MESSAGE_UNAGED) {
+        TAILQ_REMOVE(&maildir->unaged, message, link);
+    }
+    --maildir->messages_size;
+    unset_indexed(maildir, message);
+    free(message);
+}
+
+// The file is gone, and so goes its record.
+static void drop(struct maildir *maildir, struct maildir_message *message) {
+    if (message->indexed) {
+        queue_index_remove(&maildir->index, message->name);
+    }
+    remove_message(maildir, message);
+}
+
+static void add_all(void *arg, struct queue_index *index) {
+    struct maildir *maildir = arg;
+    for (size_t i = 0; i < maildir->buckets_size; ++i) {
+        for (struct maildir_message *message =
+                LIST_FIRST(&maildir->buckets[i]);
+             message; message = LIST_NEXT(message, bucket_link))
+        {
+            if (!message->indexed) { continue; }
+            struct queue_index_entry entry = index_entry(message);
+            queue_index_add(index, &entry);
+        }
+    }
+}
+
+static void compact_index(struct maildir *maildir) {
+    if (maildir->index.records <= 2 * maildir->indexed_size + INDEX_SLACK) {
+        return;
+    }
+    queue_index_rewrite(&maildir->index, add_all, maildir);
+}
+
+static void load(void *arg, struct queue_index_entry const *entry,
+    bool removed)
+{
+    struct maildir *maildir = arg;
+    size_t name_hash = hash(entry->name);
+    struct maildir_message *message = find(maildir, entry->name, name_hash);
+    if (removed) {
+        if (message) { remove_message(maildir, message); }
+        return;
+    }
+
+    if (message) {
+        unset_indexed(maildir, message);
+    } else {
+        message = insert(maildir, entry->name, name_hash);
+    }
+    set_indexed(maildir, message, entry);
+}
+
+static int compare_age(void const *a, void const *b) {
+    struct maildir_message const *message_a =
+        *(struct maildir_message const * const *)a;
+    struct maildir_message const *message_b =
+        *(struct maildir_message const * const *)b;
+    if (message_a->mtime != message_b->mtime) {
+        return message_a->mtime < message_b->mtime ? -1 : 1;
+    }
+    return strcmp(message_a->name, message_b->name);
+}
+
+static void batch(struct maildir *maildir, struct maildir_message *message) {
+    if (maildir->batch_size == maildir->batch_capacity) {
+        size_t capacity = maildir->batch_capacity * 2;
+        struct maildir_message **messages =
+            realloc(maildir->batch, capacity * sizeof(*messages));
+        if (!messages) {
+            die("`realloc(/* ... */, %zu)` failed: %s\n",
+                capacity * sizeof(*messages), strerror(errno));
+        }
+        maildir->batch = messages;
+        maildir->batch_capacity = capacity;
+    }
+    message->state = MESSAGE_BATCHED;
+    maildir->batch[maildir->batch_size++] = message;
+}
+
+static void queue(struct maildir *maildir, struct maildir_message *message) {
+    message->state = MESSAGE_PENDING;
+    TAILQ_INSERT_TAIL(&maildir->pending, message, link);
+}
+
+static void queue_batch(struct maildir *maildir) {
+    qsort(maildir->batch, maildir->batch_size, sizeof(*maildir->batch),
+        compare_age);
+    for (size_t i = 0; i < maildir->batch_size; ++i) {
+        queue(maildir, maildir->batch[i]);
+    }
+    maildir->batch_size = 0;
+}
+
+// The indexed files are handed out oldest first as soon as the index is
+// loaded. Whether they are still there, and still the files indexed, is
+// only found out as they are opened.
+static void hand_out_indexed(struct maildir *maildir) {
+    for (size_t i = 0; i < maildir->buckets_size; ++i) {
+        for (struct maildir_message *message =
+                LIST_FIRST(&maildir->buckets[i]);
+             message; message = LIST_NEXT(message, bucket_link))
+        { batch(maildir, message); }
+    }
+    queue_batch(maildir);
+}
+
+// While the initial scan is on, the files it finds unindexed are handed out
+// once their age is looked up, oldest first within each round.
+static void hand_out(struct maildir *maildir,
+    struct maildir_message *message)
+{
+    if (!maildir->ordering) {
+        queue(maildir, message);
+    } else {
+        message->state = MESSAGE_UNAGED;
+        TAILQ_INSERT_TAIL(&maildir->unaged, message, link);
+    }
+}
+
+// `inode` is 0 if unknown.
+static void enqueue(struct maildir *maildir, char const* name,
+    uint64_t inode)
+{
+    size_t name_hash = hash(name);
+    struct maildir_message *message = find(maildir, name, name_hash);
+    if (message) {
+        // Another file has taken the name since it was indexed.
+        if (message->indexed && message->inode != inode) {
+            unset_indexed(maildir, message);
+        }
+        message->generation = maildir->generation;
+        if (message->state == MESSAGE_HELD) { hand_out(maildir, message); }
+        return;
+    }
+
+    message = insert(maildir, name, name_hash);
+    hand_out(maildir, message);
+}
+
+static void forget(struct maildir *maildir, char const *name) {
+    struct maildir_message *message = find(maildir, name, hash(name));
+    if (message) { drop(maildir, message); }
+}
+
+// Drops the names of files that the last scan did not come across, whose
+// events may have been lost.
+static void sweep(struct maildir *maildir) {
+    for (size_t i = 0; i < maildir->buckets_size; ++i) {
+        struct maildir_message *message = LIST_FIRST(&maildir->buckets[i]);
+        while (message) {
+            struct maildir_message *next = LIST_NEXT(message, bucket_link);
+            if (message->generation != maildir->generation) {
+                drop(maildir, message);
+            }
+            message = next;
+        }
+    }
+}
+
+// False if the file is gone.
+static bool stat_message(struct maildir *maildir,
+    struct maildir_message *message)
+{
+    struct stat st;
+    if (fstatat(maildir->out_fd, message->name, &st, AT_SYMLINK_NOFOLLOW)) {
+        if (errno == ENOENT) { return false; }
+        die("`fstatat(%d, \"%s\", /* ... */, AT_SYMLINK_NOFOLLOW)` failed: "
+            "%s\n", maildir->out_fd, message->name, strerror(errno));
+    }
+    message->mtime = nanoseconds(&st.st_mtim);
+    return true;
+}
+
+static void notify_observer(struct maildir *maildir) {
+    if (TAILQ_EMPTY(&maildir->pending)) { return; }
+    event_loop_schedule(maildir->loop, maildir->observer);
+}
+
+// Directories cannot be polled, so the scan advances a batch per
+// scheduling round instead.
+static void start_scan(struct maildir *maildir) {
+    if (lseek(maildir->out_fd, 0, SEEK_SET) == -1) {
+        die("`lseek(%d, 0, SEEK_SET)` failed: %s\n",
+            maildir->out_fd, strerror(errno));
+    }
+    ++maildir->generation;
+    if (!maildir->scanning) {
+        maildir->scanning = true;
+        maildir->scan_buffer = malloc(SCAN_BUFFER_SIZE);
+        if (!maildir->scan_buffer) {
+            die("`malloc(%d)` failed: %s\n",
+                SCAN_BUFFER_SIZE, strerror(errno));
+        }
+    }
+    event_loop_schedule(maildir->loop, &maildir->scan_handler);
+}
+
+static void inotify_notify(struct event_handler *handler, uint32_t events) {
+    struct maildir *maildir =
+        container_of(handler, struct maildir, inotify_handler);
+    if (!(events & EPOLLIN)) { return; }
+
+    union {
+        struct inotify_event event;
+        char bytes[INOTIFY_BUFFER_SIZE];
+    } buffer;
+    bool overflowed = false;
+    // Everything queued is read at once, bursts would overflow the queue
+    // otherwise.
+    while (true) {
+        ssize_t size = read(handler->fd, &buffer, sizeof(buffer));
+        if (size == -1) {
+            if (errno == EINTR) { continue; }
+            if (errno == EAGAIN) { break; }
+            die("`read(%d, /* ... */, %zu)` failed: %s\n",
+                handler->fd, sizeof(buffer), strerror(errno));
+        }
+
+        for (ssize_t offset = 0; offset < size; ) {
+            struct inotify_event *event = (void*)(buffer.bytes + offset);
+            if (event->mask & IN_Q_OVERFLOW) {
+                overflowed = true;
+            } else if (event->mask & IN_MOVED_TO) {
+                enqueue(maildir, event->name, 0);
+            } else if (event->mask & (IN_MOVED_FROM | IN_DELETE)) {
+                forget(maildir, event->name);
+            }
+            offset += sizeof(*event) + event->len;
+        }
+    }
+
+    if (overflowed) {
+        logger_printf("inotify queue overflowed, rescanning %s/out\n",
+            maildir->path);
+        start_scan(maildir);
+    }
+    compact_index(maildir);
+    notify_observer(maildir);
+}
+
+static void scan(struct maildir *maildir, uint64_t deadline) {
+    do {
+        ssize_t size = getdents64(maildir->out_fd, maildir->scan_buffer,
+            SCAN_BUFFER_SIZE);
+        if (size == -1) {
+            die("`getdents64(%d, /* ... */, %d)` failed: %s\n",
+                maildir->out_fd, SCAN_BUFFER_SIZE, strerror(errno));
+        }
+        if (!size) {
+            free(maildir->scan_buffer);
+            maildir->scan_buffer = NULL;
+            maildir->scanning = false;
+            sweep(maildir);
+            compact_index(maildir);
+            break;
+        }
+
+        for (ssize_t offset = 0; offset < size; ) {
+            struct dirent64 *dirent =
+                (void*)(maildir->scan_buffer + offset);
+            if (strcmp(dirent->d_name, ".") && strcmp(dirent->d_name, "..")) {
+                enqueue(maildir, dirent->d_name, dirent->d_ino);
+            }
+            offset += dirent->d_reclen;
+        }
+    } while (monotonic_now() < deadline);
+}
+
+// Looks up the age of the files the initial scan found unindexed, which
+// ends the ordering once all are handed out.
+static void age(struct maildir *maildir, uint64_t deadline) {
+    do {
+        struct maildir_message *message = TAILQ_FIRST(&maildir->unaged);
+        if (!message) {
+            maildir->ordering = false;
+            break;
+        }
+        TAILQ_REMOVE(&maildir->unaged, message, link);
+        message->state = MESSAGE_HELD;
+        if (stat_message(maildir, message)) {
+            batch(maildir, message);
+        } else {
+            drop(maildir, message);
+        }
+    } while (monotonic_now() < deadline);
+}
+
+static void scan_notify(struct event_handler *handler, uint32_t events) {
+    struct maildir *maildir =
+        container_of(handler, struct maildir, scan_handler);
+    (void)events;
 
-    STAILQ_INSERT_TAIL(&maildir->messages, message, link);
+    uint64_t deadline = monotonic_now() + SCAN_BUDGET;
+    if (maildir->scanning) {
+        scan(maildir, deadline);
+    } else {
+        age(maildir, deadline);
+    }
+    queue_batch(maildir);
+
+    if (maildir->scanning || maildir->ordering) {
+        event_loop_schedule(maildir->loop, &maildir->scan_handler);
+    }
+    // Messages are handed out while the scan goes on.
+    notify_observer(maildir);
 }
 
-void maildir_initialize(struct maildir *maildir, char const *path) {
+void maildir_initialize(struct maildir *maildir, struct event_loop *loop,
+    char const *path, struct event_handler *observer)
+{
     maildir->path = strdup(path);
     if (!maildir->path) {
         die("`strdup(\"%s\")` failed: %s\n", path, strerror(errno));
@@ -53,118 +579,176 @@ void maildir_initialize(struct maildir *maildir, char const *path) {
             out_path, strerror(errno));
     }
 
-    maildir->inotify_fd = inotify_init();
-    if (maildir->inotify_fd == -1) {
-        die("`inotify_init()` failed: %s\n", strerror(errno));
+    maildir->loop = loop;
+    maildir->observer = observer;
+
+    int inotify_fd = inotify_init1(IN_NONBLOCK);
+    if (inotify_fd == -1) {
+        die("`inotify_init1(IN_NONBLOCK)` failed: %s\n", strerror(errno));
     }
-    if (inotify_add_watch(maildir->inotify_fd, out_path, IN_MOVED_TO) == -1) {
-        die("`inotify_add_watch(%d, \"%s\", IN_MOVED_TO)` failed: %s\n",
-            maildir->inotify_fd, out_path, strerror(errno));
+    // Files going away are forgotten, deliveries unlinking them.
+    uint32_t mask = IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE;
+    if (inotify_add_watch(inotify_fd, out_path, mask) == -1) {
+        die("`inotify_add_watch(%d, \"%s\", IN_MOVED_TO | IN_MOVED_FROM | "
+            "IN_DELETE)` failed: %s\n",
+            inotify_fd, out_path, strerror(errno));
     }
+    event_handler_initialize(&maildir->inotify_handler, inotify_notify);
+    event_loop_add(loop, &maildir->inotify_handler, inotify_fd, EPOLLIN);
 
-    maildir->dir = opendir(out_path);
-    if (!maildir->dir) {
-        die("`opendir(\"%s\")` failed: %s\n", out_path, strerror(errno));
+    maildir->out_fd = open(out_path, O_RDONLY | O_DIRECTORY);
+    if (maildir->out_fd == -1) {
+        die("`open(\"%s\", O_RDONLY | O_DIRECTORY)` failed: %s\n",
+            out_path, strerror(errno));
     }
 
     free(out_path);
 
-    STAILQ_INIT(&maildir->messages);
-}
+    char *failed_path = masprintf("%s/failed", maildir->path);
+    if (ensure_directory(failed_path)) {
+        die("`ensure_directory(\"%s\")` failed: %s\n",
+            failed_path, strerror(errno));
+    }
+    maildir->failed_fd = open(failed_path, O_RDONLY | O_DIRECTORY);
+    if (maildir->failed_fd == -1) {
+        die("`open(\"%s\", O_RDONLY | O_DIRECTORY)` failed: %s\n",
+            failed_path, strerror(errno));
+    }
+    free(failed_path);
 
-void maildir_subscribe(struct maildir *maildir, struct fd_set *fd_set) {
-    fd_set_add(fd_set, maildir->inotify_fd, POLLIN, -1);
-    if (maildir->dir) {
-        int fd = dirfd(maildir->dir);
-        if (fd == -1) {
-            die("`dirfd((DIR*)%p)` failed: %s\n",
-                (void*)maildir->dir, strerror(errno));
-        }
-        fd_set_add(fd_set, fd, POLLIN | POLLHUP, -1);
+    maildir->messages_size = 0;
+    allocate_buckets(maildir, INITIAL_BUCKETS);
+    TAILQ_INIT(&maildir->pending);
+
+    maildir->scanning = false;
+    maildir->scan_buffer = NULL;
+    maildir->generation = 0;
+    maildir->ordering = true;
+    TAILQ_INIT(&maildir->unaged);
+    maildir->batch_size = 0;
+    maildir->batch_capacity = INITIAL_BATCH;
+    maildir->batch = malloc(INITIAL_BATCH * sizeof(*maildir->batch));
+    if (!maildir->batch) {
+        die("`malloc(%zu)` failed: %s\n",
+            INITIAL_BATCH * sizeof(*maildir->batch), strerror(errno));
     }
+
+    maildir->indexed_size = 0;
+    char *index_path = masprintf("%s/queue.index", maildir->path);
+    queue_index_initialize(&maildir->index, index_path, load, maildir);
+    free(index_path);
+    hand_out_indexed(maildir);
+
+    event_handler_initialize(&maildir->scan_handler, scan_notify);
+    start_scan(maildir);
 }
 
-void maildir_notify(struct maildir *maildir, struct fd_set const *fd_set) {
-    if (fd_set_get_events(fd_set, maildir->inotify_fd) & POLLIN) {
-        struct inotify_event *event;
-        char buffer[sizeof(*event) + NAME_MAX + 1];
-        event = (void*)buffer;
-        ssize_t size = read(maildir->inotify_fd, event, sizeof(buffer));
-        if (size == -1) {
-            die("`read(%d, (struct inotify_event*)%p, %zu)` failed: %s\n",
-                maildir->inotify_fd, (void*)event, sizeof(buffer),
-                strerror(errno));
-        }
-        while (size > 0) {
-            // It's unclear if partial event reads are possible.
-            assert(size >= sizeof(*event));
-            size_t event_size = sizeof(*event) + event->len;
-            assert(size >= event_size);
+struct queue_index_entry const *maildir_discover_message(
+    struct maildir *maildir)
+{
+    struct maildir_message *message = TAILQ_FIRST(&maildir->pending);
+    if (!message) { return NULL; }
+
+    // The name stays known for as long as the file is there.
+    TAILQ_REMOVE(&maildir->pending, message, link);
+    message->state = MESSAGE_DISCOVERED;
+    maildir->discovered = message->indexed ? index_entry(message)
+        : (struct queue_index_entry){ .name = message->name };
+    return &maildir->discovered;
+}
 
-            enqueue(maildir, event->name);
+void maildir_index_message(struct maildir *maildir, char const *name,
+    char const *sender, size_t sender_len,
+    char const *domains, size_t domains_len)
+{
+    struct maildir_message *message = find(maildir, name, hash(name));
+    if (!message) { return; }
 
-            size -= event_size;
-            event = (void*)((char*)event + event_size);
-        }
+    struct stat st;
+    if (fstatat(maildir->out_fd, name, &st, AT_SYMLINK_NOFOLLOW)) {
+        if (errno == ENOENT) { return; }
+        die("`fstatat(%d, \"%s\", /* ... */, AT_SYMLINK_NOFOLLOW)` failed: "
+            "%s\n", maildir->out_fd, name, strerror(errno));
     }
-
-    if (maildir->dir) {
-        int fd = dirfd(maildir->dir);
-        if (fd == -1) {
-            die("`dirfd((DIR*)%p)` failed: %s\n",
-                (void*)maildir->dir, strerror(errno));
-        }
-        if (fd_set_get_events(fd_set, fd) & (POLLIN | POLLHUP)) {
-            errno = 0;
-            struct dirent *dirent = readdir(maildir->dir);
-            if (!dirent) {
-                if (errno) {
-                    die("`readdir((DIR*)%p)` failed: %s\n",
-                        (void*)maildir->dir, strerror(errno));
-                }
-
-                if (closedir(maildir->dir)) {
-                    die("`closedir((DIR*)%p)` failed: %s\n",
-                        (void*)maildir->dir, strerror(errno));
-                }
-                maildir->dir = NULL;
-            } else if (strcmp(dirent->d_name, ".") &&
-                       strcmp(dirent->d_name, ".."))
-            { enqueue(maildir, dirent->d_name); }
-        }
+    if (message->indexed) {
+        if (message->inode == (uint64_t)st.st_ino) { return; }
+        // Another file has taken the name since it was indexed.
+        unset_indexed(maildir, message);
     }
+    struct queue_index_entry entry = {
+        .name = name,
+        .inode = st.st_ino,
+        .mtime = nanoseconds(&st.st_mtim),
+        .size = st.st_size,
+        .sender = sender,
+        .sender_len = sender_len,
+        .domains = domains,
+        .domains_len = domains_len,
+    };
+    set_indexed(maildir, message, &entry);
+    queue_index_add(&maildir->index, &entry);
 }
 
-char *maildir_discover_message(struct maildir *maildir) {
-    if (maildir->dir) { return NULL; }
-    struct maildir_message *message = STAILQ_FIRST(&maildir->messages);
-    if (!message) { return NULL; }
-
-    char *path = masprintf("%s/out/%s", maildir->path, message->name);
+void maildir_defer_message(struct maildir *maildir,
+    struct queue_index_entry const *progress)
+{
+    struct maildir_message *message =
+        find(maildir, progress->name, hash(progress->name));
+    if (!message || !message->indexed) { return; }
 
-    STAILQ_REMOVE_HEAD(&maildir->messages, link);
-    free(message);
+    free(message->deferred);
+    free(message->rejected);
+    set_progress(message, progress);
+    struct queue_index_entry entry = index_entry(message);
+    queue_index_add(&maildir->index, &entry);
+    compact_index(maildir);
+}
 
-    return path;
+void maildir_set_aside(struct maildir *maildir, char const *name) {
+    if (renameat(maildir->out_fd, name, maildir->failed_fd, name)) {
+        if (errno == ENOENT) { return; }
+        die("`renameat(%d, \"%s\", %d, \"%s\")` failed: %s\n",
+            maildir->out_fd, name, maildir->failed_fd, name, strerror(errno));
+    }
+    logger_printf("moved %s to %s/failed\n", name, maildir->path);
 }
 
 void maildir_finalize(struct maildir *maildir) {
-    while (true) {
-        struct maildir_message *message = STAILQ_FIRST(&maildir->messages);
-        if (!message) { break; }
-        STAILQ_REMOVE_HEAD(&maildir->messages, link);
-        free(message);
+    event_loop_cancel(maildir->loop, &maildir->scan_handler);
+    free(maildir->scan_buffer);
+    free(maildir->batch);
+
+    int inotify_fd = maildir->inotify_handler.fd;
+    event_loop_remove(maildir->loop, &maildir->inotify_handler);
+    if (close(inotify_fd)) {
+        die("`close(%d)` failed: %s\n", inotify_fd, strerror(errno));
     }
 
-    if (maildir->dir) {
-        if (closedir(maildir->dir)) {
-            die("`closedir((DIR*)%p)` failed: %s\n",
-                (void*)maildir->dir, strerror(errno));
+    for (size_t i = 0; i < maildir->buckets_size; ++i) {
+        while (true) {
+            struct maildir_message *message =
+                LIST_FIRST(&maildir->buckets[i]);
+            if (!message) { break; }
+            LIST_REMOVE(message, bucket_link);
+            free(message->sender);
+            free(message->domains);
+            free(message->deferred);
+            free(message->rejected);
+            free(message);
         }
     }
+    free(maildir->buckets);
+    queue_index_finalize(&maildir->index);
 
-    if (close(maildir->inotify_fd)) { 
-        die("`close(%d)` failed: %s\n", maildir->inotify_fd, strerror(errno));
+    // Messages released by the workers last are destroyed here, and unlinked
+    // relative to `out_fd`, which has to stay open until that is done.
+    event_loop_flush(maildir->loop);
+    if (maildir->loop->ring) { io_ring_wait(maildir->loop->ring); }
+    if (close(maildir->out_fd)) {
+        die("`close(%d)` failed: %s\n", maildir->out_fd, strerror(errno));
+    }
+    if (close(maildir->failed_fd)) {
+        die("`close(%d)` failed: %s\n", maildir->failed_fd, strerror(errno));
     }
 
     free(maildir->path);
@@ -3,7 +3,8 @@
 #include <signal_handler.h>
 #include <maildir.h>
 #include <client.h>
-#include <fd_set.h>
+#include <event_loop.h>
+#include <io_ring.h>
 #include <die.h>
 #include <ensure_directory.h>
 
@@ -12,40 +13,51 @@
 #include <stdlib.h>
 
 int main(int argc, char *argv[]) {
-    signal_handler_initialize();
+    struct event_loop event_loop;
+    event_loop_initialize(&event_loop);
+
+    signal_handler_initialize(&event_loop);
 
     settings_initialize(argc, argv);
 
     logger_initialize();
 
-    struct client client;
-    client_initialize(&client, settings.maildir_path, settings.host);
+    struct io_ring ring;
+    if (!strcmp(settings.io_engine, "io_uring")) {
+        if (io_ring_initialize(&ring, &event_loop, 256)) {
+            logger_printf("`io_ring_initialize(/*...*/, 256)` failed: %s\n"
+                "  falling back to the epoll I/O engine\n", strerror(errno));
+        } else {
+            event_loop.ring = &ring;
+        }
+    } else if (strcmp(settings.io_engine, "epoll")) {
+        die("unknown I/O engine \"%s\"\n", settings.io_engine);
+    }
 
-    struct fd_set fd_set;
-    fd_set_initialize(&fd_set);
+    struct client client;
+    client_initialize(&client, &event_loop,
+        settings.maildir_path, settings.host, settings.workers,
+        settings.max_sessions, settings.max_destination_sessions,
+        settings.starttls, &settings.transport_map);
 
     while (!signal_handler.termination_requested) {
-        signal_handler_subscribe(&fd_set);
-        client_subscribe(&client, &fd_set);
-
-        fd_set_poll(&fd_set);
-
-        signal_handler_notify(&fd_set);
-        client_notify(&client, &fd_set);
-
-        fd_set_clear(&fd_set);
+        event_loop_run(&event_loop);
     }
 
-    fd_set_finalize(&fd_set);
-
     client_finalize(&client);
 
+    event_loop_flush(&event_loop);
+
+    if (event_loop.ring) { io_ring_finalize(event_loop.ring); }
+
     logger_finalize();
 
     settings_finalize();
 
     signal_handler_finalize();
 
+    event_loop_finalize(&event_loop);
+
     return EXIT_SUCCESS;
 }
 
@@ -1,7 +1,9 @@
 #include <message.h>
 
 #include <die.h>
+#include <dot_stuffing.h>
 #include <logger.h>
+#include <io_ring.h>
 
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -12,15 +14,41 @@
 #include <stdbool.h>
 #include <assert.h>
 
+static void lock(struct message *message) {
+    int error = pthread_mutex_lock(&message->mutex);
+    if (error) {
+        die("`pthread_mutex_lock(/* ... */)` failed: %s\n", strerror(error));
+    }
+}
+
+static void unlock(struct message *message) {
+    int error = pthread_mutex_unlock(&message->mutex);
+    if (error) {
+        die("`pthread_mutex_unlock(/* ... */)` failed: %s\n",
+            strerror(error));
+    }
+}
+
+enum { BODY_SCAN_SIZE = 64 * 1024 };
+
+static void set_state(struct message *message, enum message_state state) {
+    __atomic_store_n(&message->state, state, __ATOMIC_RELEASE);
+}
+
+struct message_unlink {
+    struct io_ring_request request;
+    char name[];
+};
+
 static void parse_header(struct message *message, char *line, size_t line_len)
 {
     char *line_end = line + line_len;
     char *colon = line;
     while (colon < line_end && *colon != ':') { ++colon; }
     if (colon == line_end) {
-        message->state = MESSAGE_LOADING_FAILED;
+        set_state(message, MESSAGE_LOADING_FAILED);
         logger_printf("malformed header: no ':' separating name from value\n"
-            "  message %s skipped\n", message->path);
+            "  message %s skipped\n", message->name);
         return;
     }
 
@@ -104,7 +132,7 @@ static void parse_sender_and_destinations(struct message *message) {
             char *at = value;
             while (at < value_end && *at != '@') { ++at; }
             if (at == value_end) {
-                message->state = MESSAGE_LOADING_FAILED;
+                set_state(message, MESSAGE_LOADING_FAILED);
                 logger_printf("malformed 'X-Original-To' header: "
                     "not an email address\n  potential recepient skipped\n");
                 return;
@@ -131,7 +159,10 @@ static void parse_sender_and_destinations(struct message *message) {
                 destination->host = host;
                 destination->host_len = host_len;
                 TAILQ_INIT(&destination->recepients);
+                destination->settled = false;
+                destination->rejected = false;
                 TAILQ_INSERT_TAIL(&message->destinations, destination, link);
+                ++message->pending_destinations;
             }
 
             struct message_recepient *recepient =
@@ -148,6 +179,8 @@ static void parse_sender_and_destinations(struct message *message) {
                 }
                 recepient->user = user;
                 recepient->user_len = user_len;
+                recepient->settled = false;
+                recepient->rejected = false;
                 TAILQ_INSERT_TAIL(&destination->recepients, recepient, link);
             }
 
@@ -165,244 +198,469 @@ static void parse_sender_and_destinations(struct message *message) {
     }
 }
 
-struct message *message_create(char const *path) {
-    struct message *message = malloc(sizeof(*message));
-    if (!message) {
-        die("`malloc(%zu)` failed: %s\n", sizeof(*message), strerror(errno));
-    }
-
-    message->state = MESSAGE_LOADING_HEADERS;
+static void notify_observers(struct message *message) {
+    lock(message);
+    for (struct message_observer *observer = LIST_FIRST(&message->observers);
+         observer; observer = LIST_NEXT(observer, link))
+    { event_loop_post(observer->loop, observer->handler); }
+    unlock(message);
+}
 
-    message->path = strdup(path);
-    if (!message->path) {
-        die("`strdup(\"%s\")` failed: %s\n", path, strerror(errno));
+static bool open_file(struct message *message) {
+    message->fd = openat(message->dir_fd, message->name,
+        O_RDONLY | O_NONBLOCK);
+    // Если файл не существует, то open() вернет значение (-1)
+    if (message->fd == -1) {
+        logger_printf("`openat(%d, \"%s\", O_RDONLY | O_NONBLOCK)` failed: "
+            "%s\n  message skipped\n",
+            message->dir_fd, message->name, strerror(errno));
+        set_state(message, MESSAGE_LOADING_FAILED);
+        return false;
     }
 
-    message->fd = -1;
-
-    message->offset = 0;
-
-    message->capacity = 0;
-    message->size = 0;
-    message->buffer = NULL;
-
-    message->headers_ = NULL;
-    message->headers_len = 0;
+    if (lseek(message->fd, message->offset, SEEK_SET) == -1) {
+        logger_printf("`lseek(%d, %zu, SEEK_SET)` failed: %s\n"
+            "  message %s skipped\n",
+            message->fd, message->offset, strerror(errno), message->name);
+    }
 
-    TAILQ_INIT(&message->headers);
+    return true;
+}
 
-    message->sender = NULL;
-    message->sender_len = 0;
+static void reserve(struct message *message) {
+    if (message->size < message->capacity) { return; }
+    static size_t const min_capacity = 4096;
+    message->capacity = message->capacity * 5 / 3 + 1;
+    if (message->capacity < min_capacity) {
+        message->capacity = min_capacity;
+    }
+    message->buffer = realloc(message->buffer, message->capacity);
+    if (!message->buffer) {
+        die("`realloc((void*)%p, %zu)` failed: %s",
+            (void*)message->buffer, message->capacity, strerror(errno));
+    }
+}
 
-    TAILQ_INIT(&message->destinations);
+static void cleanup(struct message *message) {
+    if (message->fd != -1 && message->state != MESSAGE_BODY_LOADED) {
+        if (close(message->fd)) {
+            die("`close(%d)` failed: %s",
+                message->fd, strerror(errno));
+        }
+        message->fd = -1;
+    }
 
-    message->body = NULL;
-    message->body_len = 0;
+    if (message->buffer) {
+        free(message->buffer);
 
-    message->ref_count = 1;
+        message->capacity = 0;
+        message->size = 0;
+        message->buffer = NULL;
+    }
+}
 
-    return message;
+// The two bytes before each window stay in front of it, since a dot
+// following CRLF starts a line.
+static void start_scanning_body(struct message *message) {
+    message->capacity = BODY_SCAN_SIZE + 2;
+    message->buffer = malloc(message->capacity);
+    if (!message->buffer) {
+        die("`malloc(%zu)` failed: %s\n", message->capacity, strerror(errno));
+    }
+    // The body itself starts a line.
+    memcpy(message->buffer, "\r\n", 2);
+    message->size = 2;
 }
 
-struct message *message_retain(struct message *message) {
-    ++message->ref_count;
-    return message;
+// BINARYMIME is only declared for content that is not plain 7-bit text and
+// only lines starting with a dot need stuffing in DATA.
+static void scan_body(struct message *message, size_t read_size) {
+    char const *window = message->buffer + message->size - read_size;
+    for (size_t i = 0; i < read_size && !message->body_binary; ++i) {
+        unsigned char c = window[i];
+        message->body_binary = !c || c >= 0x80;
+    }
+
+    if (!message->body_dot_lines) {
+        message->body_dot_lines = dot_stuffing_find(message->buffer,
+            message->size, message->size - read_size) != message->size;
+    }
 }
 
-void message_subscribe(struct message *message, struct fd_set *fd_set) {
-    if (message->state != MESSAGE_LOADING_HEADERS && 
-        message->state != MESSAGE_LOADING_BODY) { return; }
+// Returns `true` once the current loading stage is over.
+static bool consume(struct message *message, size_t read_size) {
+    message->size += read_size;
+
+    if (message->state == MESSAGE_LOADING_HEADERS) {
+       if (read_size == 0) {
+           set_state(message, MESSAGE_LOADING_FAILED);
+           logger_printf("message %s loading failed: "
+               "no empty line separting headers from body\n  skipped\n",
+               message->name);
+           return true;
+       }
+
+        static char const separator[] = "\r\n\r\n";
+        // static char const separator[] = "\n\n";
+        static size_t const separator_len = sizeof(separator) - 1;
+        while (message->headers_len + separator_len <= message->size) {
+            if (!strncmp(message->buffer + message->headers_len,
+                         separator, separator_len))
+            {
+                set_state(message, MESSAGE_HEADERS_LOADED);
+
+                message->offset += message->headers_len + separator_len;
+                message->body_offset = message->offset;
+
+                message->headers_ = 
+                    realloc(message->buffer, message->headers_len);
+                if (!message->headers_) {
+                    die("`realloc((void*)%p, %zu)` failed: %s",
+                        (void*)message->buffer, message->headers_len,
+                        strerror(errno));
+                }
+                message->capacity = 0;
+                message->size = 0;
+                message->buffer = NULL;
 
-    if (message->fd == -1) {
-        message->fd = open(message->path, O_RDONLY);
-        // Если файл не существует, то open() вернет значение (-1)
-        if (message->fd == -1) {
-            logger_printf("`open(\"%s\", O_RDONLY)` failed: %s\n"
-                "  message skipped\n", message->path, strerror(errno));
-            message->state = MESSAGE_LOADING_FAILED;
-            return;
-        }
+                parse_headers(message);
+                parse_sender_and_destinations(message);
 
-        int flags = fcntl(message->fd, F_GETFL);
-        if (flags == -1) {
-            die("`fcntl(%d, F_GETFL)` failed: %s\n",
-                message->fd, strerror(errno));
+                return true;
+            }
+            ++message->headers_len;
         }
-        if (fcntl(message->fd, F_SETFL, flags | O_NONBLOCK) == -1) {
-            die("`fcntl(%d, F_SETFL, %d | O_NONBLOCK)` failed: %s\n",
-                message->fd, flags, strerror(errno));
+    } else if (message->state == MESSAGE_LOADING_BODY) {
+        char const *end = message->buffer + message->size;
+        if (read_size == 0) {
+            message->body_len = message->offset - message->body_offset;
+            message->body_ends_line = end[-2] == '\r' && end[-1] == '\n';
+
+            // Publishes the body to sessions on other threads.
+            set_state(message, MESSAGE_BODY_LOADED);
+            return true;
         }
 
-        if (lseek(message->fd, message->offset, SEEK_SET) == -1) {
-            logger_printf("`lseek(%d, %zu, SEEK_SET)` failed: %s\n"
-                "  message %s skipped\n",
-                message->fd, message->offset, strerror(errno), message->path);
-        }
+        scan_body(message, read_size);
+        message->offset += read_size;
+        memmove(message->buffer, end - 2, 2);
+        message->size = 2;
     }
 
-    fd_set_add(fd_set, message->fd, POLLIN, -1);
+    return false;
 }
 
-void message_notify(struct message *message, struct fd_set const *fd_set) {
-    if (message->state != MESSAGE_LOADING_HEADERS && 
-        message->state != MESSAGE_LOADING_BODY) { return; }
-
-    if (!(fd_set_get_events(fd_set, message->fd) & POLLIN)) { return; }
-
+static void load(struct message *message) {
     while (true) {
-        if (message->size == message->capacity) {
-            message->capacity = message->capacity * 5 / 3 + 1;
-            message->buffer = realloc(message->buffer, message->capacity);
-            if (!message->buffer) {
-                die("`realloc((void*)%p, %zu)` failed: %s",
-                    (void*)message->buffer, message->capacity,
-                    strerror(errno));
-            }
-        }
+        reserve(message);
 
         ssize_t read_size = read(message->fd,
             message->buffer + message->size,
             message->capacity - message->size);
         if (read_size == -1) {
             if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                message->state = MESSAGE_LOADING_FAILED;
+                set_state(message, MESSAGE_LOADING_FAILED);
                 logger_printf("`read(%d, (void*)%p, %zu)` failed: %s\n"
                     "  message %s skipped\n",
                     message->fd, (void*)(message->buffer + message->size),
                     message->capacity - message->size,
-                    strerror(errno), message->path);
-                goto cleanup;
+                    strerror(errno), message->name);
+                break;
             }
+            // Regular files never block, so simply retry on the next round.
+            event_loop_schedule(message->loop, &message->handler);
             return;
         }
-        message->size += read_size;
-
-        if (message->state == MESSAGE_LOADING_HEADERS) {
-           if (read_size == 0) {
-               message->state = MESSAGE_LOADING_FAILED;
-               logger_printf("message %s loading failed: "
-                   "no empty line separting headers from body\n  skipped\n",
-                   message->path);
-               goto cleanup;
-           }
-
-            static char const separator[] = "\r\n\r\n";
-            // static char const separator[] = "\n\n";
-            static size_t const separator_len = sizeof(separator) - 1;
-            while (message->headers_len + separator_len <= message->size) {
-                if (!strncmp(message->buffer + message->headers_len,
-                             separator, separator_len))
-                {
-                    message->state = MESSAGE_HEADERS_LOADED;
-
-                    message->offset += message->headers_len + separator_len;
-
-                    message->headers_ = 
-                        realloc(message->buffer, message->headers_len);
-                    if (!message->headers_) {
-                        die("`realloc((void*)%p, %zu)` failed: %s",
-                            (void*)message->buffer, message->headers_len,
-                            strerror(errno));
-                    }
-                    message->capacity = 0;
-                    message->size = 0;
-                    message->buffer = NULL;
-
-                    parse_headers(message);
-                    parse_sender_and_destinations(message);
-
-                    goto cleanup;
-                }
-                ++message->headers_len;
-            }
-        } else if (message->state == MESSAGE_LOADING_BODY) {
-            if (read_size == 0) {
-                message->state = MESSAGE_BODY_LOADED;
+        if (consume(message, read_size)) { break; }
+    }
 
-                message->offset += message->size;
+    cleanup(message);
+}
 
-                message->body_len = message->size;
-                message->body = realloc(message->buffer, message->body_len);
-                if (!message->body) {
-                    die("`realloc((void*)%p, %zu)` failed: %s",
-                        (void*)message->buffer, message->body_len,
-                        strerror(errno));
-                }
-                message->capacity = 0;
-                message->size = 0;
-                message->buffer = NULL;
-                
-                goto cleanup;
-            }
+static void submit_read(struct message *message) {
+    reserve(message);
+    // Keep the message alive until the kernel is done with its buffer.
+    message_retain(message);
+    // While the body is scanned `size` only counts the bytes kept in front.
+    size_t offset = message->state == MESSAGE_LOADING_BODY
+        ? message->offset : message->offset + message->size;
+    io_ring_read(message->loop->ring, &message->read_request, message->fd,
+        message->buffer + message->size, message->capacity - message->size,
+        offset);
+}
+
+static void read_complete(struct io_ring_request *request, int result) {
+    struct message *message =
+        container_of(request, struct message, read_request);
+    enum message_state state = message->state;
+
+    if (result < 0) {
+        set_state(message, MESSAGE_LOADING_FAILED);
+        logger_printf("`read(%d, (void*)%p, %zu)` failed: %s\n"
+            "  message %s skipped\n",
+            message->fd, (void*)(message->buffer + message->size),
+            message->capacity - message->size,
+            strerror(-result), message->name);
+        cleanup(message);
+    } else if (consume(message, result)) {
+        cleanup(message);
+    } else {
+        submit_read(message);
+    }
+
+    if (message->state != state) { notify_observers(message); }
+    message_release(message);
+}
+
+static void destroy(struct message *message);
+
+static void notify(struct event_handler *handler, uint32_t events) {
+    struct message *message = container_of(handler, struct message, handler);
+    (void)events;
+
+    if (__atomic_load_n(&message->released, __ATOMIC_ACQUIRE)) {
+        destroy(message);
+        return;
+    }
+
+    lock(message);
+    if (message->body_requested && message->state == MESSAGE_HEADERS_LOADED) {
+        set_state(message, MESSAGE_LOADING_BODY);
+        start_scanning_body(message);
+    }
+    unlock(message);
+
+    if (message->state != MESSAGE_LOADING_HEADERS && 
+        message->state != MESSAGE_LOADING_BODY) { return; }
+    if (message->read_request.in_flight) { return; }
+
+    enum message_state state = message->state;
+
+    if (message->fd != -1 || open_file(message)) {
+        if (message->loop->ring) {
+            submit_read(message);
+        } else {
+            load(message);
         }
     }
 
-cleanup:
-    if (message->fd != -1) {
-        if (close(message->fd)) {
-            die("`close(%d)` failed: %s",
-                message->fd, strerror(errno));
+    if (message->state != state) { notify_observers(message); }
+}
+
+void message_observer_initialize(struct message_observer *observer,
+    struct event_loop *loop, struct event_handler *handler)
+{
+    observer->message = NULL;
+    observer->loop = loop;
+    observer->handler = handler;
+}
+
+struct message *message_create(struct event_loop *loop, int dir_fd,
+    char const *name)
+{
+    struct message *message = malloc(sizeof(*message));
+    if (!message) {
+        die("`malloc(%zu)` failed: %s\n", sizeof(*message), strerror(errno));
+    }
+
+    set_state(message, MESSAGE_LOADING_HEADERS);
+
+    message->loop = loop;
+    event_handler_initialize(&message->handler, notify);
+    io_ring_request_initialize(&message->read_request, read_complete);
+
+    {
+        int error = pthread_mutex_init(&message->mutex, NULL);
+        if (error) {
+            die("`pthread_mutex_init(/* ... */)` failed: %s\n",
+                strerror(error));
         }
-        message->fd = -1;
     }
+    LIST_INIT(&message->observers);
+    message->body_requested = false;
 
-    if (message->buffer) {
-        free(message->buffer);
+    message->released = false;
 
-        message->capacity = 0;
-        message->size = 0;
-        message->buffer = NULL;
+    message->dir_fd = dir_fd;
+    message->name = strdup(name);
+    if (!message->name) {
+        die("`strdup(\"%s\")` failed: %s\n", name, strerror(errno));
     }
+
+    message->fd = -1;
+
+    message->offset = 0;
+
+    message->capacity = 0;
+    message->size = 0;
+    message->buffer = NULL;
+
+    message->headers_ = NULL;
+    message->headers_len = 0;
+
+    TAILQ_INIT(&message->headers);
+
+    message->sender = NULL;
+    message->sender_len = 0;
+
+    TAILQ_INIT(&message->destinations);
+    message->pending_destinations = 0;
+
+    message->finished = NULL;
+    message->finished_arg = NULL;
+
+    message->body_offset = 0;
+    message->body_len = 0;
+    message->body_binary = false;
+    message->body_dot_lines = false;
+    message->body_ends_line = false;
+
+    message->ref_count = 1;
+
+    event_loop_schedule(loop, &message->handler);
+
+    return message;
+}
+
+struct message *message_retain(struct message *message) {
+    __atomic_add_fetch(&message->ref_count, 1, __ATOMIC_RELAXED);
+    return message;
+}
+
+enum message_state message_get_state(struct message *message) {
+    return __atomic_load_n(&message->state, __ATOMIC_ACQUIRE);
+}
+
+void message_add_observer(struct message *message,
+    struct message_observer *observer)
+{
+    assert(!observer->message);
+    observer->message = message;
+    lock(message);
+    LIST_INSERT_HEAD(&message->observers, observer, link);
+    unlock(message);
+}
+
+void message_remove_observer(struct message_observer *observer) {
+    struct message *message = observer->message;
+    if (!message) { return; }
+    lock(message);
+    LIST_REMOVE(observer, link);
+    unlock(message);
+    observer->message = NULL;
 }
 
 void message_start_loading_body(struct message *message) {
-    if (message->state == MESSAGE_LOADING_FAILED ||
-        message->state == MESSAGE_LOADING_BODY ||
-        message->state == MESSAGE_BODY_LOADED) { return; }
-    assert(message->state == MESSAGE_HEADERS_LOADED);
-    message->state = MESSAGE_LOADING_BODY;
+    lock(message);
+    // The transition itself happens on the loop that owns the message.
+    if (!message->body_requested) {
+        message->body_requested = true;
+        event_loop_post(message->loop, &message->handler);
+    }
+    unlock(message);
+}
+
+void message_set_finished_callback(struct message *message,
+    void (*finished)(void *arg, struct message *message), void *arg)
+{
+    message->finished = finished;
+    message->finished_arg = arg;
+}
+
+void message_skip_destination(struct message *message,
+    struct message_destination *destination)
+{
+    assert(message_get_state(message) == MESSAGE_HEADERS_LOADED);
+    destination->settled = true;
+    --message->pending_destinations;
 }
 
+// Only the session holding the destination settles it; the final release
+// orders that before `destroy` reads it.
 void message_mark_as_sent(struct message *message,
-    char const* destination_host)
+    struct message_destination *destination)
 {
-    assert(message->state == MESSAGE_BODY_LOADED);
-    
-    for (struct message_destination *destination =
-             TAILQ_FIRST(&message->destinations);
-        destination; destination = TAILQ_NEXT(destination, link))
+    assert(message_get_state(message) == MESSAGE_BODY_LOADED);
+    destination->settled = true;
+
+    // Destinations stay in place since sessions on other loops may still be
+    // walking them; the spool file goes once every one of them is sent.
+    __atomic_sub_fetch(&message->pending_destinations, 1, __ATOMIC_ACQ_REL);
+}
+
+void message_mark_as_rejected(struct message *message,
+    struct message_destination *destination)
+{
+    (void)message;
+    destination->settled = true;
+    destination->rejected = true;
+}
+
+void message_mark_recepient_as_sent(struct message_recepient *recepient) {
+    recepient->settled = true;
+}
+
+void message_mark_recepient_as_rejected(struct message_recepient *recepient)
+{
+    recepient->settled = true;
+    recepient->rejected = true;
+}
+
+bool message_recepients_settled(
+    struct message_destination const *destination, bool *sent)
+{
+    *sent = false;
+    for (struct message_recepient *recepient =
+            TAILQ_FIRST(&destination->recepients);
+         recepient; recepient = TAILQ_NEXT(recepient, link))
     {
-        if (destination->host_len != strlen(destination_host) ||
-            strncmp(destination_host, destination->host,
-                                      destination->host_len)) { continue; }
+        if (!recepient->settled) { return false; }
+        if (!recepient->rejected) { *sent = true; }
+    }
+    return true;
+}
 
-        while (true) {
-            struct message_recepient *recepient =
-                TAILQ_FIRST(&destination->recepients);
-            if (!recepient) { break; }
-            TAILQ_REMOVE(&destination->recepients, recepient, link);
-            free(recepient);
+static void unlink_complete(struct io_ring_request *request, int result) {
+    struct message_unlink *unlink =
+        container_of(request, struct message_unlink, request);
+    if (result < 0) {
+        die("`unlinkat(/* ... */, \"%s\", 0)` failed: %s",
+            unlink->name, strerror(-result));
+    }
+    free(unlink);
+}
+
+static void unlink_file(struct message *message) {
+    if (!message->loop->ring) {
+        if (unlinkat(message->dir_fd, message->name, 0)) {
+            die("`unlinkat(%d, \"%s\", 0)` failed: %s",
+                message->dir_fd, message->name, strerror(errno));
         }
+        return;
+    }
 
-        TAILQ_REMOVE(&message->destinations, destination, link);
-        free(destination);
-        break;
+    size_t size = sizeof(struct message_unlink) + strlen(message->name) + 1;
+    struct message_unlink *unlink = malloc(size);
+    if (!unlink) {
+        die("`malloc(%zu)` failed: %s\n", size, strerror(errno));
     }
+    strcpy(unlink->name, message->name);
+    io_ring_request_initialize(&unlink->request, unlink_complete);
+    io_ring_unlink(message->loop->ring, &unlink->request, message->dir_fd,
+        unlink->name);
 }
 
-void message_release(struct message *message) {
-    if (--message->ref_count > 0) { return; }
-    
-    if (message->state == MESSAGE_BODY_LOADED &&
-        TAILQ_EMPTY(&message->destinations))
-    {
-        if (unlink(message->path)) {
-            die("`unlink(\"%s\")` failed: %s",
-                message->path, strerror(errno));
-        }
+static void destroy(struct message *message) {
+    assert(LIST_EMPTY(&message->observers));
+    event_loop_cancel(message->loop, &message->handler);
+
+    if (message->finished) {
+        message->finished(message->finished_arg, message);
     }
 
-    free(message->body);
+    if (message->state == MESSAGE_BODY_LOADED &&
+        __atomic_load_n(&message->pending_destinations, __ATOMIC_ACQUIRE) == 0)
+    { unlink_file(message); }
 
     while (true) {
         struct message_destination *destination =
@@ -437,10 +695,32 @@ void message_release(struct message *message) {
             message->fd, strerror(errno));
     }
 
-    free(message->path);
+    free(message->name);
+
+    {
+        int error = pthread_mutex_destroy(&message->mutex);
+        if (error) {
+            die("`pthread_mutex_destroy(/* ... */)` failed: %s\n",
+                strerror(error));
+        }
+    }
 
     free(message);
 }
 
+void message_release(struct message *message) {
+    if (__atomic_sub_fetch(&message->ref_count, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+
+    // The spool file and the loading state belong to the creating loop.
+    if (pthread_equal(pthread_self(), message->loop->thread)) {
+        destroy(message);
+        return;
+    }
+    __atomic_store_n(&message->released, true, __ATOMIC_RELEASE);
+    event_loop_post(message->loop, &message->handler);
+}
+
 
 /*! \file */
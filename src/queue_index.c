@@ -0,0 +1,281 @@
+#include <queue_index.h>
+
+#include <die.h>
+#include <logger.h>
+#include <masprintf.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+static char const MAGIC[8] = "SMTPQIX2";
+
+enum queue_index_record_type {
+    RECORD_ADDED = 1,
+    RECORD_REMOVED = 2,
+};
+
+// Followed by the name and the sender, each terminated by '\0', the
+// domains, the deferred and the rejected recipients; padded to
+// `RECORD_ALIGNMENT`. `checksum` covers all that comes
+// after it, so that a record torn by a crash is told apart.
+struct queue_index_record {
+    uint32_t size;
+    uint32_t checksum;
+    uint32_t type;
+    uint32_t name_len;
+    uint64_t inode;
+    int64_t mtime;
+    uint64_t file_size;
+    uint32_t sender_len;
+    uint32_t domains_len;
+    int64_t retry_at;
+    uint32_t attempts;
+    uint32_t deferred_len;
+    uint32_t rejected_len;
+    uint32_t padding;
+};
+
+enum { RECORD_ALIGNMENT = 8 };
+
+// FNV-1a.
+static uint32_t checksum(char const *data, size_t size) {
+    uint32_t hash = UINT32_C(2166136261);
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ (unsigned char)data[i]) * UINT32_C(16777619);
+    }
+    return hash;
+}
+
+static size_t record_size(size_t data_len) {
+    return (sizeof(struct queue_index_record) + data_len +
+            RECORD_ALIGNMENT - 1) & ~(size_t)(RECORD_ALIGNMENT - 1);
+}
+
+// `lists_len` covers the domains and the recipients.
+static size_t data_len(size_t name_len, size_t sender_len, size_t lists_len)
+{ return name_len + 1 + sender_len + 1 + lists_len; }
+
+static char *append_list(char *data, char const *list, size_t list_len) {
+    if (list_len) { memcpy(data, list, list_len); }
+    return data + list_len;
+}
+
+static void write_all(struct queue_index *index, void const *data,
+    size_t size)
+{
+    ssize_t result = write(index->fd, data, size);
+    if (result != (ssize_t)size) {
+        die("`write(%d, /* ... */, %zu)` failed on %s: %s\n", index->fd,
+            size, index->path, result == -1 ? strerror(errno) : "short");
+    }
+}
+
+static void append(struct queue_index *index,
+    enum queue_index_record_type type, struct queue_index_entry const *entry)
+{
+    size_t name_len = strlen(entry->name);
+    size_t size = record_size(data_len(name_len, entry->sender_len,
+        entry->domains_len + entry->deferred_len + entry->rejected_len));
+    char *buffer = calloc(1, size);
+    if (!buffer) {
+        die("`calloc(1, %zu)` failed: %s\n", size, strerror(errno));
+    }
+
+    struct queue_index_record *record = (void*)buffer;
+    record->size = size;
+    record->type = type;
+    record->name_len = name_len;
+    record->inode = entry->inode;
+    record->mtime = entry->mtime;
+    record->file_size = entry->size;
+    record->sender_len = entry->sender_len;
+    record->domains_len = entry->domains_len;
+    record->retry_at = entry->retry_at;
+    record->attempts = entry->attempts;
+    record->deferred_len = entry->deferred_len;
+    record->rejected_len = entry->rejected_len;
+
+    char *data = buffer + sizeof(*record);
+    data = append_list(data, entry->name, name_len) + 1;
+    data = append_list(data, entry->sender, entry->sender_len) + 1;
+    data = append_list(data, entry->domains, entry->domains_len);
+    data = append_list(data, entry->deferred, entry->deferred_len);
+    append_list(data, entry->rejected, entry->rejected_len);
+
+    size_t covered = offsetof(struct queue_index_record, type);
+    record->checksum = checksum(buffer + covered, size - covered);
+
+    write_all(index, buffer, size);
+    free(buffer);
+
+    ++index->records;
+    if (type == RECORD_REMOVED) { ++index->removals; }
+}
+
+static void open_file(struct queue_index *index, char const *path,
+    int flags)
+{
+    index->fd = open(path, flags | O_CREAT | O_APPEND, 0600);
+    if (index->fd == -1) {
+        die("`open(\"%s\", /* ... */)` failed: %s\n", path, strerror(errno));
+    }
+}
+
+static void start_over(struct queue_index *index) {
+    if (ftruncate(index->fd, 0)) {
+        die("`ftruncate(%d, 0)` failed: %s\n", index->fd, strerror(errno));
+    }
+    write_all(index, MAGIC, sizeof(MAGIC));
+}
+
+// Returns the bytes of intact records.
+static size_t load_records(struct queue_index *index, char const *map,
+    size_t size,
+    void (*load)(void *arg, struct queue_index_entry const *entry,
+        bool removed),
+    void *arg)
+{
+    size_t offset = sizeof(MAGIC);
+    while (size - offset >= sizeof(struct queue_index_record)) {
+        struct queue_index_record const *record = (void const*)(map + offset);
+        if (record->size > size - offset ||
+            record->size != record_size(data_len(record->name_len,
+                record->sender_len, (size_t)record->domains_len +
+                record->deferred_len + record->rejected_len)))
+        { break; }
+        size_t covered = offsetof(struct queue_index_record, type);
+        if (checksum(map + offset + covered, record->size - covered) !=
+            record->checksum)
+        { break; }
+        if (record->type != RECORD_ADDED && record->type != RECORD_REMOVED) {
+            break;
+        }
+
+        char const *data = map + offset + sizeof(*record);
+        char const *domains =
+            data + record->name_len + 1 + record->sender_len + 1;
+        struct queue_index_entry entry = {
+            .name = data,
+            .inode = record->inode,
+            .mtime = record->mtime,
+            .size = record->file_size,
+            .sender = data + record->name_len + 1,
+            .sender_len = record->sender_len,
+            .domains = domains,
+            .domains_len = record->domains_len,
+            .attempts = record->attempts,
+            .retry_at = record->retry_at,
+            .deferred = domains + record->domains_len,
+            .deferred_len = record->deferred_len,
+            .rejected = domains + record->domains_len + record->deferred_len,
+            .rejected_len = record->rejected_len,
+        };
+        load(arg, &entry, record->type == RECORD_REMOVED);
+
+        ++index->records;
+        if (record->type == RECORD_REMOVED) { ++index->removals; }
+        offset += record->size;
+    }
+    return offset;
+}
+
+void queue_index_initialize(struct queue_index *index, char const *path,
+    void (*load)(void *arg, struct queue_index_entry const *entry,
+        bool removed),
+    void *arg)
+{
+    index->path = strdup(path);
+    if (!index->path) {
+        die("`strdup(\"%s\")` failed: %s\n", path, strerror(errno));
+    }
+    index->records = 0;
+    index->removals = 0;
+    open_file(index, path, O_RDWR);
+
+    struct stat st;
+    if (fstat(index->fd, &st)) {
+        die("`fstat(%d, /* ... */)` failed: %s\n", index->fd, strerror(errno));
+    }
+    size_t size = st.st_size;
+    if (!size) {
+        write_all(index, MAGIC, sizeof(MAGIC));
+        return;
+    }
+
+    char *map = size < sizeof(MAGIC) ? MAP_FAILED
+        : mmap(NULL, size, PROT_READ, MAP_PRIVATE, index->fd, 0);
+    if (size >= sizeof(MAGIC) && map == MAP_FAILED) {
+        die("`mmap(NULL, %zu, PROT_READ, MAP_PRIVATE, %d, 0)` failed: %s\n",
+            size, index->fd, strerror(errno));
+    }
+    if (map == MAP_FAILED || memcmp(map, MAGIC, sizeof(MAGIC))) {
+        logger_printf("%s is no queue index, starting it over\n", path);
+        if (map != MAP_FAILED) { munmap(map, size); }
+        start_over(index);
+        return;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    size_t intact = load_records(index, map, size, load, arg);
+    if (munmap(map, size)) {
+        die("`munmap(/* ... */, %zu)` failed: %s\n", size, strerror(errno));
+    }
+
+    if (intact < size) {
+        logger_printf("queue index %s torn after %zu of %zu bytes, "
+            "cutting it off\n", path, intact, size);
+        if (ftruncate(index->fd, intact)) {
+            die("`ftruncate(%d, %zu)` failed: %s\n",
+                index->fd, intact, strerror(errno));
+        }
+    }
+}
+
+void queue_index_add(struct queue_index *index,
+    struct queue_index_entry const *entry)
+{ append(index, RECORD_ADDED, entry); }
+
+void queue_index_remove(struct queue_index *index, char const *name) {
+    append(index, RECORD_REMOVED, &(struct queue_index_entry){
+        .name = name,
+    });
+}
+
+void queue_index_rewrite(struct queue_index *index,
+    void (*add_all)(void *arg, struct queue_index *index), void *arg)
+{
+    char *new_path = masprintf("%s.new", index->path);
+    int old_fd = index->fd;
+    open_file(index, new_path, O_WRONLY | O_TRUNC);
+    index->records = 0;
+    index->removals = 0;
+    write_all(index, MAGIC, sizeof(MAGIC));
+
+    add_all(arg, index);
+
+    if (rename(new_path, index->path)) {
+        die("`rename(\"%s\", \"%s\")` failed: %s\n",
+            new_path, index->path, strerror(errno));
+    }
+    if (close(old_fd)) {
+        die("`close(%d)` failed: %s\n", old_fd, strerror(errno));
+    }
+    free(new_path);
+}
+
+void queue_index_finalize(struct queue_index *index) {
+    if (close(index->fd)) {
+        die("`close(%d)` failed: %s\n", index->fd, strerror(errno));
+    }
+    free(index->path);
+}
+
+
+/*! \file */
@@ -0,0 +1,228 @@
+#include <resolver.h>
+
+#include <logger.h>
+#include <die.h>
+
+#include <arpa/nameser.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+struct resolver_socket {
+    LIST_ENTRY(resolver_socket) link;
+    struct resolver *resolver;
+    struct event_handler handler;
+};
+
+struct resolver_waiter {
+    STAILQ_ENTRY(resolver_waiter) link;
+    ares_callback callback;
+    void *arg;
+};
+
+// Queries for the same name and type made while one is pending wait for
+// its reply rather than going out again.
+struct resolver_query {
+    LIST_ENTRY(resolver_query) link;
+    struct resolver *resolver;
+    char *name;
+    int type;
+    STAILQ_HEAD(, resolver_waiter) waiters;
+};
+
+static void rearm(struct resolver *resolver) {
+    struct timeval tv;
+    if (ares_timeout(resolver->channel, NULL, &tv)) {
+        event_loop_arm(resolver->loop, &resolver->timer,
+            tv.tv_sec * 1000 + tv.tv_usec / 1000);
+    } else {
+        event_loop_disarm(resolver->loop, &resolver->timer);
+    }
+}
+
+static void socket_notify(struct event_handler *handler, uint32_t events) {
+    struct resolver_socket *socket =
+        container_of(handler, struct resolver_socket, handler);
+    // The socket may be closed while its events are processed.
+    struct resolver *resolver = socket->resolver;
+
+    ares_socket_t fd = handler->fd;
+    ares_process_fd(resolver->channel,
+        events & (EPOLLIN | EPOLLHUP | EPOLLERR) ? fd : ARES_SOCKET_BAD,
+        events & (EPOLLOUT | EPOLLHUP | EPOLLERR) ? fd : ARES_SOCKET_BAD);
+
+    rearm(resolver);
+}
+
+static void socket_state_callback(void *data, ares_socket_t fd,
+    int readable, int writable)
+{
+    struct resolver *resolver = data;
+
+    struct resolver_socket *socket = LIST_FIRST(&resolver->sockets);
+    while (socket && socket->handler.fd != fd) {
+        socket = LIST_NEXT(socket, link);
+    }
+
+    if (!readable && !writable) {
+        if (socket) {
+            event_loop_remove(resolver->loop, &socket->handler);
+            LIST_REMOVE(socket, link);
+            free(socket);
+        }
+        return;
+    }
+
+    uint32_t events = 0;
+    if (readable) { events |= EPOLLIN; }
+    if (writable) { events |= EPOLLOUT; }
+
+    if (socket) {
+        event_loop_modify(resolver->loop, &socket->handler, events);
+        return;
+    }
+
+    socket = malloc(sizeof(*socket));
+    if (!socket) {
+        die("`malloc(%zu)` failed: %s\n", sizeof(*socket), strerror(errno));
+    }
+    socket->resolver = resolver;
+    event_handler_initialize(&socket->handler, socket_notify);
+    event_loop_add(resolver->loop, &socket->handler, fd, events);
+    LIST_INSERT_HEAD(&resolver->sockets, socket, link);
+}
+
+static void timer_expire(struct event_timer *timer) {
+    struct resolver *resolver = container_of(timer, struct resolver, timer);
+
+    ares_process_fd(resolver->channel, ARES_SOCKET_BAD, ARES_SOCKET_BAD);
+
+    rearm(resolver);
+}
+
+static void query_callback(void *arg, int status, int timeouts,
+    unsigned char *reply_data, int reply_size)
+{
+    struct resolver_query *query = arg;
+
+    if (query->resolver->cache) {
+        dns_cache_store(query->resolver->cache, query->name, query->type,
+            status, reply_data, reply_size);
+    }
+    while (true) {
+        struct resolver_waiter *waiter = STAILQ_FIRST(&query->waiters);
+        if (!waiter) { break; }
+        STAILQ_REMOVE_HEAD(&query->waiters, link);
+        waiter->callback(waiter->arg, status, timeouts, reply_data,
+            reply_size);
+        free(waiter);
+    }
+    // Kept listed until now, so that callbacks may still cancel waiters.
+    LIST_REMOVE(query, link);
+
+    free(query->name);
+    free(query);
+}
+
+bool resolver_initialize(struct resolver *resolver, struct event_loop *loop,
+    struct dns_cache *cache)
+{
+    resolver->loop = loop;
+    resolver->cache = cache;
+
+    event_timer_initialize(&resolver->timer, timer_expire);
+    LIST_INIT(&resolver->sockets);
+    LIST_INIT(&resolver->queries);
+
+    struct ares_options options = {
+        .sock_state_cb = socket_state_callback,
+        .sock_state_cb_data = resolver,
+    };
+    int status = ares_init_options(&resolver->channel, &options,
+        ARES_OPT_SOCK_STATE_CB);
+    resolver->initialized = status == ARES_SUCCESS;
+    if (!resolver->initialized) {
+        logger_printf("`ares_init_options((ares_channnel*)%p, /*...*/)` "
+            "failed: %s\n", (void*)&resolver->channel, ares_strerror(status));
+    }
+    return resolver->initialized;
+}
+
+void resolver_query(struct resolver *resolver, char const *name, int type,
+    ares_callback callback, void *arg)
+{
+    if (resolver->cache) {
+        int status;
+        unsigned char *reply;
+        int reply_size;
+        if (dns_cache_find(resolver->cache, name, type, &status, &reply,
+                           &reply_size))
+        {
+            callback(arg, status, 0, reply, reply_size);
+            free(reply);
+            return;
+        }
+    }
+
+    struct resolver_waiter *waiter = malloc(sizeof(*waiter));
+    if (!waiter) {
+        die("`malloc(%zu)` failed: %s\n", sizeof(*waiter), strerror(errno));
+    }
+    waiter->callback = callback;
+    waiter->arg = arg;
+
+    struct resolver_query *query = LIST_FIRST(&resolver->queries);
+    while (query && (query->type != type || strcasecmp(query->name, name))) {
+        query = LIST_NEXT(query, link);
+    }
+    if (query) {
+        STAILQ_INSERT_TAIL(&query->waiters, waiter, link);
+        return;
+    }
+
+    query = malloc(sizeof(*query));
+    if (!query) {
+        die("`malloc(%zu)` failed: %s\n", sizeof(*query), strerror(errno));
+    }
+    query->resolver = resolver;
+    query->name = strdup(name);
+    if (!query->name) {
+        die("`strdup(\"%s\")` failed: %s\n", name, strerror(errno));
+    }
+    query->type = type;
+    STAILQ_INIT(&query->waiters);
+    STAILQ_INSERT_TAIL(&query->waiters, waiter, link);
+    LIST_INSERT_HEAD(&resolver->queries, query, link);
+
+    // Mail domains are fully qualified, the search list does not apply.
+    ares_query(resolver->channel, name, ns_c_in, type, query_callback, query);
+    rearm(resolver);
+}
+
+void resolver_cancel(struct resolver *resolver, void *arg) {
+    for (struct resolver_query *query = LIST_FIRST(&resolver->queries);
+         query; query = LIST_NEXT(query, link))
+    {
+        struct resolver_waiter *waiter = STAILQ_FIRST(&query->waiters);
+        while (waiter) {
+            struct resolver_waiter *next = STAILQ_NEXT(waiter, link);
+            if (waiter->arg == arg) {
+                STAILQ_REMOVE(&query->waiters, waiter, resolver_waiter, link);
+                free(waiter);
+            }
+            waiter = next;
+        }
+    }
+}
+
+void resolver_finalize(struct resolver *resolver) {
+    event_loop_disarm(resolver->loop, &resolver->timer);
+    if (resolver->initialized) {
+        // Closes the sockets, which takes them off the loop.
+        ares_destroy(resolver->channel);
+    }
+}
+
+
+/*! \file */
@@ -1,112 +1,381 @@
 #include <session.h>
 
+#include <dot_stuffing.h>
 #include <logger.h>
+#include <settings.h>
 #include <die.h>
+#include <io_ring.h>
+
+#include <openssl/err.h>
 
 #include <arpa/nameser.h>
 #include <arpa/inet.h>
-#include <sys/select.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/random.h>
+#include <sys/sendfile.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include <time.h>
+#include <stdarg.h>
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <assert.h>
 
 struct session_message {
     TAILQ_ENTRY(session_message) link;
     struct message *self;
+    // The recipients to send it to.
+    struct message_destination *destination;
 };
 
-static void a_search_callback(void *arg, int status, int timeouts,
-    unsigned char *reply_data, int reply_size);
+enum { BDAT_CHUNK_SIZE = 64 * 1024 };
 
-static void aaaa_search_callback(void *arg, int status, int timeouts,
-    unsigned char *reply_data, int reply_size);
+// Bodies are read into requests a window at a time wherever they cannot go
+// straight from the spool file, so that memory stays bounded however large
+// they are. Ones shorter than `BODY_SPOOL_SIZE` are always read.
+enum {
+    BODY_WINDOW_SIZE = 64 * 1024,
+    BODY_SPOOL_SIZE = 16 * 1024,
+};
 
-static void try_next_mx_reply(struct session *session) {
-    session->mx_reply = session->mx_reply->next;
+// Below this pinning the pages and the completion notice cost more than the
+// copy that is saved.
+enum { ZEROCOPY_THRESHOLD = 16 * 1024 };
+
+// RFC 5321, section 4.5.3.2; connecting is not covered there.
+enum {
+    CONNECT_TIMEOUT = 30 * 1000,
+    GREETING_TIMEOUT = 5 * 60 * 1000,
+    COMMAND_TIMEOUT = 5 * 60 * 1000,
+    DATA_INITIATION_TIMEOUT = 2 * 60 * 1000,
+    DATA_BLOCK_TIMEOUT = 3 * 60 * 1000,
+    DATA_TERMINATION_TIMEOUT = 10 * 60 * 1000,
+};
+
+// RFC 8305, sections 3 and 5.
+enum {
+    RESOLUTION_DELAY = 50,
+    CONNECTION_ATTEMPT_DELAY = 250,
+};
+
+static void resolve_mx_host(struct session *session);
+static void update(struct session *session);
+
+static size_t family_index(int family) { return family != AF_INET6; }
+
+static void free_hostent(struct session *session, size_t index) {
+    if (session->hostents[index] != &session->literal) {
+        ares_free_hostent(session->hostents[index]);
+    }
+    session->hostents[index] = NULL;
+}
+
+// Hosts with open circuits are skipped.
+static void try_mx_reply(struct session *session) {
+    while (session->mx_reply &&
+           !host_table_usable(session->hosts, session->mx_reply->host))
+    {
+        logger_printf("skipping %s, which has been failing\n",
+            session->mx_reply->host);
+        session->mx_reply = session->mx_reply->next;
+    }
     if (!session->mx_reply) {
         session->state = SESSION_CLOSED;
-        logger_printf("out of MX records to try for %s\n  session aborted",
+        logger_printf("out of MX records to try for %s\n  session aborted\n",
             session->destination_host);
         return;
     }
-    ares_search(session->channel, session->mx_reply->host,
-        ns_c_in, ns_t_aaaa, aaaa_search_callback, session);
+    resolve_mx_host(session);
 }
 
-static void try_addr(struct session *session) {
-start:;
-    char *addr = session->hostent->h_addr_list[session->addr_index];
-    sa_family_t sa_family = session->hostent->h_addrtype;
-    if (!addr) {
-        ares_free_hostent(session->hostent);
-        if (sa_family == AF_INET6) {
-            logger_printf("out of IPv6 addresses to try for %s\n",
-                session->mx_reply->host);
-            ares_search(session->channel, session->mx_reply->host,
-                ns_c_in, ns_t_a, a_search_callback, session);
-            return;
-        }
-        logger_printf("out of IPv4 addresses to try for %s\n",
-            session->mx_reply->host);
-        try_next_mx_reply(session);
+static void try_next_mx_reply(struct session *session) {
+    session->mx_reply = session->mx_reply->next;
+    try_mx_reply(session);
+}
+
+static void log_connect_failure(int fd, struct sockaddr_storage *sockaddr,
+    int error)
+{
+    struct sockaddr *sa = (void*)sockaddr;
+    if (sa->sa_family == AF_UNIX) {
+        logger_printf("`connect(%d, /* %s */)` failed: %s\n",
+            fd, ((struct sockaddr_un*)sa)->sun_path, strerror(error));
         return;
     }
 
-    struct sockaddr *sa = (void*)&session->sockaddr;
+    char addrstr[INET_ADDRSTRLEN > INET6_ADDRSTRLEN ?
+                 INET_ADDRSTRLEN : INET6_ADDRSTRLEN];
+    void *addr = (sa->sa_family == AF_INET6)
+        ? (void*)&((struct sockaddr_in6*)sa)->sin6_addr
+        : (void*)&((struct sockaddr_in*)sa)->sin_addr;
+    inet_ntop(sa->sa_family, addr, addrstr, sizeof(addrstr));
+    logger_printf("`connect(%d, /* %s */)` failed: %s\n",
+        fd, addrstr, strerror(error));
+}
 
-    if (session->fd != -1 && sa->sa_family != sa_family) {
-        if (close(session->fd)) {
-            die("`close(%d)` failed: %s\n", session->fd, strerror(errno));
-        }
-        session->fd = -1;
+static void close_attempt(struct session *session,
+    struct session_attempt *attempt)
+{
+    event_loop_remove(session->loop, &attempt->handler);
+    if (close(attempt->fd)) {
+        die("`close(%d)` failed: %s\n", attempt->fd, strerror(errno));
+    }
+    attempt->fd = -1;
+    --session->attempts_size;
+}
+
+static void abandon_attempts(struct session *session) {
+    for (size_t i = 0; i < SESSION_ATTEMPTS; ++i) {
+        if (session->attempts[i].fd == -1) { continue; }
+        close_attempt(session, &session->attempts[i]);
+    }
+    event_loop_disarm(session->loop, &session->attempt_timer);
+}
+
+static void set_tcp_option(struct session *session, int option,
+    char const *option_name, int value)
+{
+    if (setsockopt(session->fd, IPPROTO_TCP, option, &value, sizeof(value))) {
+        logger_printf("`setsockopt(%d, IPPROTO_TCP, %s, /* %d */)` failed: "
+            "%s\n", session->fd, option_name, value, strerror(errno));
+    }
+}
+
+static void connected(struct session *session,
+    struct session_attempt *attempt)
+{
+    session->fd = attempt->fd;
+    memcpy(&session->sockaddr, &attempt->sockaddr, sizeof(attempt->sockaddr));
+    uint64_t latency = session->loop->now - attempt->started_at;
+    event_loop_remove(session->loop, &attempt->handler);
+    attempt->fd = -1;
+    --session->attempts_size;
+
+    abandon_attempts(session);
+    // The other family is only of use for reconnecting, which makes do with
+    // the one that won.
+    resolver_cancel(session->resolver, session);
+    session->resolving = 0;
+
+    int family = ((struct sockaddr*)&session->sockaddr)->sa_family;
+    host_table_connected(session->hosts, session->mx_reply->host, family,
+        latency);
+
+    // Zero-copy sends through the ring need no socket option.
+    session->zerocopy = session->loop->ring ||
+        !setsockopt(session->fd, SOL_SOCKET, SO_ZEROCOPY,
+                    &(int){1}, sizeof(int));
+    session->zerocopy_sent = false;
+
+    if (session->tcp_options->nodelay) {
+        set_tcp_option(session, TCP_NODELAY, "TCP_NODELAY", 1);
+    }
+    if (session->tcp_options->notsent_lowat) {
+        set_tcp_option(session, TCP_NOTSENT_LOWAT, "TCP_NOTSENT_LOWAT",
+            session->tcp_options->notsent_lowat);
+    }
+    session->corked = false;
+
+    session->state = SESSION_RECEIVING_GREETING;
+}
+
+static bool addresses_left(struct session *session, int family) {
+    struct hostent *hostent = session->hostents[family_index(family)];
+    return hostent &&
+        hostent->h_addr_list[session->addr_indexes[family_index(family)]];
+}
+
+// Alternates between the families, starting with the preferred one, while
+// both have addresses left. Zero if no attempt is to be made yet.
+static int next_family(struct session *session) {
+    int family = !session->attempted ? session->preferred_family
+        : session->last_family == AF_INET6 ? AF_INET : AF_INET6;
+    int other = family == AF_INET6 ? AF_INET : AF_INET6;
+    if (addresses_left(session, family)) { return family; }
+    if (!addresses_left(session, other)) { return 0; }
+
+    if (!session->attempted &&
+        session->resolving & (1u << family_index(family)))
+    {
+        if (session->resolution_delayed) { return other; }
+        session->resolution_delayed = true;
+        event_loop_arm(session->loop, &session->attempt_timer,
+            RESOLUTION_DELAY);
+        return 0;
+    }
+    return other;
+}
+
+static void connect_attempt(struct session *session,
+    struct session_attempt *attempt, socklen_t addrlen)
+{
+    struct sockaddr *sa = (void*)&attempt->sockaddr;
+    attempt->fd = socket(sa->sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (attempt->fd == -1) {
+        die("`socket(%s, SOCK_STREAM | SOCK_NONBLOCK, 0)` failed: %s\n",
+            sa->sa_family == AF_UNIX ? "AF_UNIX"
+                : sa->sa_family == AF_INET6 ? "AF_INET6" : "AF_INET",
+            strerror(errno));
     }
+    ++session->attempts_size;
+    attempt->started_at = session->loop->now;
+
+    if (!connect(attempt->fd, sa, addrlen)) {
+        connected(session, attempt);
+        return;
+    }
+    if (errno != EINPROGRESS) {
+        log_connect_failure(attempt->fd, &attempt->sockaddr, errno);
+        close_attempt(session, attempt);
+        return;
+    }
+
+    event_loop_add(session->loop, &attempt->handler, attempt->fd, EPOLLOUT);
+    event_loop_arm(session->loop, &session->attempt_timer,
+        CONNECTION_ATTEMPT_DELAY);
+}
+
+static void start_attempt(struct session *session, int family) {
+    size_t index = family_index(family);
+    struct hostent *hostent = session->hostents[index];
+    char *addr = hostent->h_addr_list[session->addr_indexes[index]++];
+    session->attempted = true;
+    session->last_family = family;
 
+    struct session_attempt *attempt = session->attempts;
+    while (attempt->fd != -1) { ++attempt; }
+
+    struct sockaddr *sa = (void*)&attempt->sockaddr;
     socklen_t addrlen;
-    if (sa_family == AF_INET6) {
+    if (family == AF_INET6) {
         struct sockaddr_in6 *sin6 = (void*)sa;
         addrlen = sizeof(*sin6);
         memset(sin6, 0, addrlen);
-        memcpy(&sin6->sin6_addr, addr, session->hostent->h_length);
-        sin6->sin6_port = htons(25);
+        memcpy(&sin6->sin6_addr, addr, hostent->h_length);
+        sin6->sin6_port = htons(session->port);
     } else {
         struct sockaddr_in *sin = (void*)sa;
         addrlen = sizeof(*sin);
         memset(sin, 0, addrlen);
-        memcpy(&sin->sin_addr, addr, session->hostent->h_length);
-        sin->sin_port = htons(25);
+        memcpy(&sin->sin_addr, addr, hostent->h_length);
+        sin->sin_port = htons(session->port);
     }
-    sa->sa_family = sa_family;
+    sa->sa_family = family;
+    connect_attempt(session, attempt, addrlen);
+}
 
-    if (session->fd == -1) {
-        session->fd =
-            socket(sa->sa_family, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
-        if (session->fd == -1) {
-            die("`socket(AF_INET%s, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP)`"
-                " failed: %s\n",
-                &"6"[sa->sa_family != AF_INET6], strerror(errno));
-        }
+// Starts whatever attempts are due; the first one to connect wins and the
+// others are abandoned.
+static void race(struct session *session) {
+    while (!session->attempt_timer.armed &&
+           session->attempts_size < SESSION_ATTEMPTS)
+    {
+        int family = next_family(session);
+        if (!family) { break; }
+        start_attempt(session, family);
+        if (session->fd != -1) { return; }
     }
 
-    if (connect(session->fd, (struct sockaddr*)sa, addrlen)) {
-        if (errno == EINPROGRESS) {
-            session->state = SESSION_CONNECTING;
-            return;
-        }
-        char addrstr[INET_ADDRSTRLEN > INET6_ADDRSTRLEN ?
-                     INET_ADDRSTRLEN : INET6_ADDRSTRLEN];
-        inet_ntop(sa_family, addr, addrstr, sizeof(addrstr));
-        logger_printf("`connect(%d, /* %s */)` failed: %s\n",
-            session->fd, addrstr, strerror(errno));
+    if (session->attempts_size) {
+        session->state = SESSION_CONNECTING;
+        return;
+    }
+    session->state = SESSION_RESOLVING_DNS;
+    if (session->attempt_timer.armed || session->resolving) { return; }
+
+    logger_printf("out of addresses to try for %s\n",
+        session->mx_reply->host);
+    host_table_failed(session->hosts, session->mx_reply->host);
+    try_next_mx_reply(session);
+}
+
+static void start_race(struct session *session) {
+    int family = host_table_family(session->hosts, session->mx_reply->host);
+    session->preferred_family = family == AF_INET ? AF_INET : AF_INET6;
+    session->attempted = false;
+    session->resolution_delayed = false;
+    session->addr_indexes[0] = 0;
+    session->addr_indexes[1] = 0;
+    race(session);
+}
+
+// The UNIX-domain socket of an LMTP server takes the place of the
+// addresses of a next hop.
+static bool local_route(struct session *session) {
+    return session->route && session->route->family == AF_UNIX;
+}
 
-        ++session->addr_index;
-        goto start;
+static bool lmtp(struct session *session) {
+    return session->route && session->route->lmtp;
+}
+
+static void connect_local(struct session *session) {
+    struct session_attempt *attempt = session->attempts;
+    struct sockaddr_un *sun = (void*)&attempt->sockaddr;
+    memset(sun, 0, sizeof(*sun));
+    sun->sun_family = AF_UNIX;
+    strcpy(sun->sun_path, session->route->host);
+    session->attempted = true;
+    connect_attempt(session, attempt, sizeof(*sun));
+    // Gives up unless the attempt is still underway.
+    if (session->fd == -1) { race(session); }
+}
+
+static void attempt_notify(struct event_handler *handler, uint32_t events) {
+    struct session_attempt *attempt =
+        container_of(handler, struct session_attempt, handler);
+    struct session *session = attempt->session;
+
+    if (!(events & (EPOLLOUT | EPOLLHUP | EPOLLERR))) { return; }
+
+    int error;
+    if (getsockopt(attempt->fd, SOL_SOCKET, SO_ERROR,
+                   &error, &(socklen_t){sizeof(error)}))
+    {
+        die("`getsockopt(%d, SOL_SOCKET, SO_ERROR, /*...*/)` "
+            "failed: %s\n", attempt->fd, strerror(errno));
+    }
+    if (error) {
+        log_connect_failure(attempt->fd, &attempt->sockaddr, error);
+        close_attempt(session, attempt);
+        // The next address need not wait for its turn.
+        event_loop_disarm(session->loop, &session->attempt_timer);
+        race(session);
+    } else {
+        connected(session, attempt);
     }
 
-    session->state = SESSION_RECEIVING_GREETING;
+    update(session);
+}
+
+static void attempt_timer_expire(struct event_timer *timer) {
+    struct session *session =
+        container_of(timer, struct session, attempt_timer);
+    race(session);
+    update(session);
+}
+
+static void addresses_resolved(struct session *session, int family,
+    struct hostent *hostent)
+{
+    size_t index = family_index(family);
+    session->resolving &= ~(1u << index);
+    if (hostent) {
+        free_hostent(session, index);
+        session->hostents[index] = hostent;
+        session->addr_indexes[index] = 0;
+    }
+    // Either family is as good as the other once both are in.
+    if (!session->attempted) {
+        event_loop_disarm(session->loop, &session->attempt_timer);
+    }
+    if (session->state == SESSION_RESOLVING_DNS ||
+        session->state == SESSION_CONNECTING) { race(session); }
 }
 
 static void a_search_callback(void *arg, int status, int timeouts,
@@ -115,27 +384,26 @@ static void a_search_callback(void *arg, int status, int timeouts,
     struct session *session = arg;
     (void)timeouts;
 
+    if (status == ARES_ECANCELLED || status == ARES_EDESTRUCTION) { return; }
+
+    // Replies of the shared resolver do not update the session itself.
+    event_loop_schedule(session->loop, &session->handler);
+
+    struct hostent *hostent = NULL;
     if (status != ARES_SUCCESS) {
-        logger_printf("`ares_search(/*...*/, \"%s\", ns_c_in, ns_t_a, "
+        logger_printf("`ares_query(/*...*/, \"%s\", ns_c_in, ns_t_a, "
             "a_search_callback, (struct session*)%p)` failed: %s\n",
             session->mx_reply->host, (void*)session, ares_strerror(status));
-        try_next_mx_reply(session);
-        return;
-    }
-
-    {
+    } else {
         int status = ares_parse_a_reply(
-            reply_data, reply_size, &session->hostent, NULL, NULL);
+            reply_data, reply_size, &hostent, NULL, NULL);
         if (status != ARES_SUCCESS) {
             logger_printf("`ares_parse_a_reply(/*...*/)` failed: %s\n",
                 ares_strerror(status));
-            try_next_mx_reply(session);
-            return;
+            hostent = NULL;
         }
     }
-    session->addr_index = 0;
-
-    try_addr(session);
+    addresses_resolved(session, AF_INET, hostent);
 }
  
 static void aaaa_search_callback(void *arg, int status, int timeouts,
@@ -144,29 +412,121 @@ static void aaaa_search_callback(void *arg, int status, int timeouts,
     struct session *session = arg;
     (void)timeouts;
 
+    if (status == ARES_ECANCELLED || status == ARES_EDESTRUCTION) { return; }
+
+    event_loop_schedule(session->loop, &session->handler);
+
+    struct hostent *hostent = NULL;
     if (status != ARES_SUCCESS) {
-        logger_printf("`ares_search(/*...*/, \"%s\", ns_c_in, ns_t_aaaa, "
+        logger_printf("`ares_query(/*...*/, \"%s\", ns_c_in, ns_t_aaaa, "
             "aaaa_search_callback, (struct session*)%p)` failed: %s\n",
             session->mx_reply->host, (void*)session, ares_strerror(status));
-        ares_search(session->channel, session->mx_reply->host,
-            ns_c_in, ns_t_a, a_search_callback, session);
-        return;
-    }
-
-    {
+    } else {
         int status = ares_parse_aaaa_reply(
-            reply_data, reply_size, &session->hostent, NULL, NULL);
+            reply_data, reply_size, &hostent, NULL, NULL);
         if (status != ARES_SUCCESS) {
             logger_printf("`ares_parse_aaaa_reply(/*...*/)` failed: %s\n",
                 ares_strerror(status));
-            ares_search(session->channel, session->mx_reply->host,
-                ns_c_in, ns_t_a, a_search_callback, session);
-            return;
+            hostent = NULL;
+        }
+    }
+    addresses_resolved(session, AF_INET6, hostent);
+}
+
+// Both families are looked up at once, connecting starts with whichever
+// answers first.
+static void resolve_mx_host(struct session *session) {
+    free_hostent(session, 0);
+    free_hostent(session, 1);
+    session->state = SESSION_RESOLVING_DNS;
+
+    if (local_route(session)) {
+        session->resolving = 0;
+        connect_local(session);
+        return;
+    }
+
+    // Address literals of the transport map need no lookup.
+    if (session->literal.h_addr_list) {
+        session->hostents[family_index(session->literal.h_addrtype)] =
+            &session->literal;
+        session->resolving = 0;
+        start_race(session);
+        return;
+    }
+
+    // Answers from the cache come back synchronously; a failing one may
+    // have moved on to the next MX host, which is then resolved already.
+    struct ares_mx_reply *mx_reply = session->mx_reply;
+    session->resolving = 1u << family_index(AF_INET6) |
+                         1u << family_index(AF_INET);
+    start_race(session);
+    if (session->mx_reply != mx_reply) { return; }
+
+    resolver_query(session->resolver, session->mx_reply->host,
+        ns_t_aaaa, aaaa_search_callback, session);
+    if (session->mx_reply != mx_reply) { return; }
+    // Cached addresses may have been connected to already.
+    if (session->resolving & 1u << family_index(AF_INET)) {
+        resolver_query(session->resolver, session->mx_reply->host,
+            ns_t_a, a_search_callback, session);
+    }
+}
+
+struct mx_candidate {
+    struct ares_mx_reply *reply;
+    unsigned rank;
+};
+
+// RFC 5321, section 5.1: hosts are tried in order of preference and ones of
+// the same preference in random order, save that those known to be failing
+// or slow are put behind the others.
+static void sort_mx_replies(struct session *session) {
+    size_t size = 0;
+    for (struct ares_mx_reply *reply = session->first_mx_reply; reply;
+         reply = reply->next) { ++size; }
+    if (size < 2) { return; }
+
+    struct mx_candidate *replies = malloc(size * sizeof(*replies));
+    if (!replies) {
+        die("`malloc(%zu)` failed: %s\n",
+            size * sizeof(*replies), strerror(errno));
+    }
+
+    unsigned seed;
+    if (getrandom(&seed, sizeof(seed), GRND_NONBLOCK) != sizeof(seed)) {
+        seed = time(NULL) ^ (uintptr_t)session;
+    }
+
+    struct ares_mx_reply *reply = session->first_mx_reply;
+    for (size_t i = 0; i < size; ++i, reply = reply->next) {
+        size_t j = rand_r(&seed) % (i + 1);
+        replies[i] = replies[j];
+        replies[j].reply = reply;
+        replies[j].rank = host_table_rank(session->hosts, reply->host);
+    }
+
+    // Insertion sort, being stable, keeps the shuffled order among equals.
+    for (size_t i = 1; i < size; ++i) {
+        for (size_t j = i; j > 0; --j) {
+            struct ares_mx_reply *a = replies[j - 1].reply;
+            struct ares_mx_reply *b = replies[j].reply;
+            if (a->priority < b->priority ||
+                (a->priority == b->priority &&
+                 replies[j - 1].rank <= replies[j].rank)) { break; }
+            struct mx_candidate swap = replies[j - 1];
+            replies[j - 1] = replies[j];
+            replies[j] = swap;
         }
     }
-    session->addr_index = 0;
 
-    try_addr(session);
+    // The list is freed from its head, so it is relinked rather than copied.
+    session->first_mx_reply = replies[0].reply;
+    for (size_t i = 0; i + 1 < size; ++i) {
+        replies[i].reply->next = replies[i + 1].reply;
+    }
+    replies[size - 1].reply->next = NULL;
+    free(replies);
 }
 
 static void mx_search_callback(void *arg, int status, int timeouts,
@@ -175,43 +535,326 @@ static void mx_search_callback(void *arg, int status, int timeouts,
     struct session *session = arg;
     (void)timeouts;
 
-    if (status != ARES_SUCCESS) {
+    if (status == ARES_ECANCELLED || status == ARES_EDESTRUCTION) { return; }
+
+    event_loop_schedule(session->loop, &session->handler);
+
+    if (status == ARES_SUCCESS) {
+        status = ares_parse_mx_reply(
+            reply_data, reply_size, &session->first_mx_reply);
+        if (status != ARES_SUCCESS && status != ARES_ENODATA) {
+            session->state = SESSION_CLOSED;
+            logger_printf("`ares_parse_mx_reply(/*...*/)` failed: %s\n"
+                "  session to %s aborted\n",
+                ares_strerror(status), session->destination_host);
+            return;
+        }
+    } else if (status != ARES_ENODATA) {
         session->state = SESSION_CLOSED;
-        logger_printf("`ares_search(/*...*/, \"%s\", ns_c_in, ns_t_mx, "
+        logger_printf("`ares_query(/*...*/, \"%s\", ns_c_in, ns_t_mx, "
             "mx_search_callback, (struct session*)%p)` failed: %s\n",
             session->destination_host, (void*)session, ares_strerror(status));
         return;
     }
 
+    if (status == ARES_ENODATA) {
+        // Without MX records the domain itself is the mail exchanger.
+        session->implicit_mx_reply = (struct ares_mx_reply){
+            .host = session->destination_host,
+        };
+        session->mx_reply = &session->implicit_mx_reply;
+    } else {
+        sort_mx_replies(session);
+        session->mx_reply = session->first_mx_reply;
+    }
+
+    // A single MX record naming the root refuses all mail (RFC 7505).
+    if (!session->mx_reply->next && (!*session->mx_reply->host ||
+                                     !strcmp(session->mx_reply->host, ".")))
     {
-        int status = ares_parse_mx_reply(
-            reply_data, reply_size, &session->first_mx_reply);
-        if (status != ARES_SUCCESS) {
+        session->state = SESSION_CLOSED;
+        logger_printf("%s accepts no mail\n  session aborted\n",
+            session->destination_host);
+        return;
+    }
+
+    try_mx_reply(session);
+}
+
+static void reserve_response(struct session *session) {
+    if (session->response_size < session->response_capacity) { return; }
+    session->response_capacity = session->response_capacity * 5 / 3 + 1;
+    session->response_buffer =
+        realloc(session->response_buffer, session->response_capacity);
+    if (!session->response_buffer) {
+        die("`realloc(/* ... */, %zu)` failed: %s\n",
+            session->response_capacity, strerror(errno));
+    }
+}
+
+static void reserve_response_lines(struct session *session) {
+    if (session->response_lines_size < session->response_lines_capacity) {
+        return;
+    }
+    session->response_lines_capacity =
+        session->response_lines_capacity * 5 / 3 + 1;
+    session->response_lines = realloc(session->response_lines,
+        session->response_lines_capacity * sizeof(*session->response_lines));
+    if (!session->response_lines) {
+        die("`realloc(/* ... */, %zu)` failed: %s\n",
+            session->response_lines_capacity *
+                sizeof(*session->response_lines),
+            strerror(errno));
+    }
+}
+
+static int parse_code(char const *line, size_t line_len) {
+    if (line_len < 3 || line[0] < '2' || line[0] > '5' ||
+        line[1] < '0' || line[1] > '9' || line[2] < '0' || line[2] > '9')
+    { return -1; }
+    return (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+}
+
+static bool parse_status_number(char const **text, char const *end,
+    int *number)
+{
+    char const *start = *text;
+    *number = 0;
+    while (*text < end && **text >= '0' && **text <= '9' &&
+           *text - start < 3)
+    { *number = *number * 10 + (*(*text)++ - '0'); }
+    return *text > start;
+}
+
+// The status leads the text as "class.subject.detail", its class repeating
+// the first digit of the reply code.
+static struct session_status parse_status(char const *text, size_t len,
+    int code)
+{
+    struct session_status status = {0};
+    char const *end = text + len;
+    if (len < 5 || text[0] - '0' != code / 100 || text[1] != '.') {
+        return status;
+    }
+    text += 2;
+    int subject, detail;
+    if (!parse_status_number(&text, end, &subject) ||
+        text == end || *text++ != '.' ||
+        !parse_status_number(&text, end, &detail) ||
+        (text < end && *text != ' '))
+    { return status; }
+    status.class = code / 100;
+    status.subject = subject;
+    status.detail = detail;
+    return status;
+}
+
+// Multiline replies repeat the code followed by a dash on every line but the
+// last one (RFC 5321, section 4.2.1). Parsing resumes where the previous
+// read left off, so every byte is searched for a line end only once.
+static bool parse_response(struct session *session) {
+    static size_t const code_len = 3;
+    while (session->response_scanned < session->response_size) {
+        char *buffer = session->response_buffer;
+        char *line_end = memchr(buffer + session->response_scanned, '\n',
+            session->response_size - session->response_scanned);
+        if (!line_end) {
+            session->response_scanned = session->response_size;
+            return false;
+        }
+
+        char *line = buffer + session->response_line_start;
+        size_t line_len = line_end - line;
+        if (line_len && line[line_len - 1] == '\r') { --line_len; }
+        session->response_scanned = line_end + 1 - buffer;
+        session->response_line_start = session->response_scanned;
+
+        int code = parse_code(line, line_len);
+        if (code == -1 || (line != buffer && memcmp(line, buffer, code_len))) {
             session->state = SESSION_CLOSED;
-            logger_printf("`ares_parse_mx_reply(/*...*/)` failed: %s\n"
+            logger_printf("malformed reply line \"%.*s\"\n"
                 "  session to %s aborted\n",
-                ares_strerror(status), session->destination_host);
-            return;
+                (int)line_len, line, session->destination_host);
+            return false;
+        }
+        bool last = line_len == code_len || line[code_len] == ' ';
+        if (!last && line[code_len] != '-') {
+            session->state = SESSION_CLOSED;
+            logger_printf("malformed reply line \"%.*s\"\n"
+                "  session to %s aborted\n",
+                (int)line_len, line, session->destination_host);
+            return false;
+        }
+
+        reserve_response_lines(session);
+        struct session_response_line *text =
+            &session->response_lines[session->response_lines_size++];
+        text->offset = line - buffer + code_len + (line_len > code_len);
+        text->len = line_len - (text->offset - (line - buffer));
+
+        if (last) {
+            session->response_code = code;
+            session->response_status =
+                parse_status(buffer + text->offset, text->len, code);
+            session->response_len = session->response_scanned;
+            return true;
         }
     }
-    session->mx_reply = session->first_mx_reply;
+    return false;
+}
 
-    ares_search(session->channel, session->mx_reply->host,
-        ns_c_in, ns_t_aaaa, aaaa_search_callback, session);
+// Text of the final reply line, for log messages.
+static char const *reply_text(struct session *session) {
+    if (!session->response_lines_size) { return ""; }
+    return session->response_buffer +
+        session->response_lines[session->response_lines_size - 1].offset;
 }
 
-static bool try_receive_response(struct session *session) {
+static int reply_text_len(struct session *session) {
+    if (!session->response_lines_size) { return 0; }
+    return session->response_lines[session->response_lines_size - 1].len;
+}
+
+static void reset_response(struct session *session) {
+    session->response_line_start = 0;
+    session->response_scanned = 0;
+    session->response_lines_size = 0;
+    session->response_len = 0;
+    session->response_code = -1;
+}
+
+static char const *tls_error_string(void) {
+    unsigned long error = ERR_get_error();
+    return error ? ERR_reason_error_string(error) : strerror(errno);
+}
+
+// Decrypted data may wait inside OpenSSL where epoll cannot see it, so
+// everything readable is drained before parsing.
+static bool tls_receive_response(struct session *session) {
     while (true) {
-        if (session->response_size == session->response_capacity) {
-            session->response_capacity =
-                session->response_capacity * 5 / 3 + 1;
-            session->response_buffer =
-                realloc(session->response_buffer, session->response_capacity);
-            if (!session->response_buffer) {
-                die("`realloc(/* ... */, %zu)` failed: %s\n",
-                    session->response_capacity, strerror(errno));
-            }
+        reserve_response(session);
+        size_t capacity = session->response_capacity - session->response_size;
+        ERR_clear_error();
+        int read_size = SSL_read(session->ssl,
+            session->response_buffer + session->response_size,
+            capacity < INT_MAX ? capacity : INT_MAX);
+        if (read_size > 0) {
+            session->response_size += read_size;
+            continue;
+        }
+
+        int error = SSL_get_error(session->ssl, read_size);
+        if (error == SSL_ERROR_WANT_READ) { break; }
+        if (error == SSL_ERROR_WANT_WRITE) {
+            session->tls_events |= EPOLLOUT;
+            break;
+        }
+        // A final reply, say to QUIT, may precede the shutdown.
+        if (parse_response(session)) { return true; }
+        session->state = SESSION_CLOSED;
+        if (error == SSL_ERROR_ZERO_RETURN ||
+            (error == SSL_ERROR_SYSCALL && !ERR_peek_error() && !errno))
+        {
+            logger_printf("%s has unexpectedly down shut the connection\n"
+                "  session aborted\n",
+                session->destination_host);
+        } else {
+            logger_printf("`SSL_read(/* ... */)` failed: %s\n"
+                "  session to %s aborted\n",
+                tls_error_string(), session->destination_host);
+        }
+        return false;
+    }
+    return parse_response(session);
+}
+
+static bool request_pending(struct session *session) {
+    return session->request->offset < session->request->len;
+}
+
+static void advance_request(struct session *session, size_t size) {
+    struct session_request *request = session->request;
+    session->sent += size;
+    request->offset += size;
+    while (size) {
+        size_t left = request->parts[request->part].len - request->part_offset;
+        if (size < left) {
+            request->part_offset += size;
+            break;
+        }
+        size -= left;
+        ++request->part;
+        request->part_offset = 0;
+    }
+}
+
+// Fills `request_iovs` with the parts left to send, stopping short of the
+// first one to go from the spool file.
+static size_t gather_request(struct session *session, size_t *size) {
+    struct session_request *request = session->request;
+    size_t iovs = 0;
+    *size = 0;
+    for (size_t i = request->part;
+         i < request->parts_size && iovs < SESSION_REQUEST_IOVS; ++i)
+    {
+        struct session_request_part *part = &request->parts[i];
+        if (part->type == SESSION_REQUEST_BODY) { break; }
+        size_t sent = i == request->part ? request->part_offset : 0;
+        session->request_iovs[iovs++] = (struct iovec){
+            .iov_base = request->buffer + part->offset + sent,
+            .iov_len = part->len - sent,
+        };
+        *size += part->len - sent;
+    }
+    return iovs;
+}
+
+// Body slices are only left in the spool file when the kernel does the
+// encryption.
+static bool tls_send_request(struct session *session) {
+    struct session_request *request = session->request;
+    while (request->offset < request->len) {
+        struct session_request_part *part = &request->parts[request->part];
+        size_t size = part->len - request->part_offset;
+
+        ERR_clear_error();
+        ossl_ssize_t write_size;
+        char const *call = "SSL_write";
+        if (part->type == SESSION_REQUEST_BODY) {
+            call = "SSL_sendfile";
+            write_size = SSL_sendfile(session->ssl, request->message->fd,
+                request->message->body_offset + part->offset +
+                    request->part_offset,
+                size, 0);
+        } else {
+            write_size = SSL_write(session->ssl,
+                request->buffer + part->offset + request->part_offset,
+                size < INT_MAX ? size : INT_MAX);
+        }
+        if (write_size > 0) {
+            advance_request(session, write_size);
+            continue;
+        }
+
+        int error = SSL_get_error(session->ssl, write_size);
+        if (error == SSL_ERROR_WANT_WRITE) { return false; }
+        if (error == SSL_ERROR_WANT_READ) {
+            session->tls_events |= EPOLLIN;
+            return false;
         }
+        session->state = SESSION_CLOSED;
+        logger_printf("`%s(/* ... */)` failed: %s\n"
+            "  session to %s aborted\n",
+            call, tls_error_string(), session->destination_host);
+        return false;
+    }
+    return true;
+}
+
+static bool try_receive_response(struct session *session) {
+    if (session->ssl) { return tls_receive_response(session); }
+    while (true) {
+        reserve_response(session);
         ssize_t read_size = read(session->fd,
             session->response_buffer + session->response_size,
             session->response_capacity - session->response_size);
@@ -236,140 +879,624 @@ static bool try_receive_response(struct session *session) {
         }
         session->response_size += read_size;
 
-        static char const separator[] = "\r\n";
-        static size_t const separator_len = sizeof(separator) - 1;
-        while (session->response_line_len + separator_len <=
-               session->response_size)
-        {
-            if (!strncmp(session->response_buffer + session->response_line_len,
-                         separator, separator_len))
-            { 
-                static size_t const code_len = 3;
-                if (session->response_line_len < code_len) {
-                    session->state = SESSION_CLOSED;
-                    logger_printf("reply too short\n"
-                        "  session to %s aborted\n",
-                        session->destination_host);
-                    return false;
-                }
-
-                char buffer[code_len + 1];
-                memcpy(buffer, session->response_buffer, code_len);
-                buffer[code_len] = '\0';
-                if (sscanf(buffer, "%d", &session->response_code) != 1) {
-                    session->state = SESSION_CLOSED;
-                    logger_printf("failed to parse reponse code\n"
-                        "  session to %s aborted\n",
-                        session->destination_host);
-                    return false;
-                }
+        if (parse_response(session)) { return true; }
+        if (session->state == SESSION_CLOSED) { return false; }
+    }
+}
 
-                return true;
-            }
-            ++session->response_line_len;
-        }
+static ssize_t send_gathered(struct session *session, struct msghdr *msg,
+    size_t size)
+{
+    if (session->zerocopy && session->request->zerocopy &&
+        size >= ZEROCOPY_THRESHOLD)
+    {
+        ssize_t write_size =
+            sendmsg(session->fd, msg, MSG_NOSIGNAL | MSG_ZEROCOPY);
+        if (write_size > 0) { session->zerocopy_sent = true; }
+        // Out of memory to pin the pages with, it is copied after all.
+        if (write_size != -1 || errno != ENOBUFS) { return write_size; }
     }
+    return sendmsg(session->fd, msg, MSG_NOSIGNAL);
 }
 
 static bool try_send_request(struct session *session) {
-    while (true) {
-        if (session->request_offset == session->request_size) { return true; }
-        ssize_t write_size = write(session->fd,
-            session->request_buffer + session->request_offset,
-            session->request_size - session->request_offset);
+    if (session->ssl) { return tls_send_request(session); }
+    struct session_request *request = session->request;
+    while (request->offset < request->len) {
+        struct session_request_part *part = &request->parts[request->part];
+
+        ssize_t write_size;
+        size_t size;
+        char const *call;
+        if (part->type == SESSION_REQUEST_BODY) {
+            call = "sendfile";
+            size = part->len - request->part_offset;
+            off_t offset = request->message->body_offset + part->offset +
+                request->part_offset;
+            write_size =
+                sendfile(session->fd, request->message->fd, &offset, size);
+        } else {
+            call = "sendmsg";
+            struct msghdr msg = {
+                .msg_iov = session->request_iovs,
+                .msg_iovlen = gather_request(session, &size),
+            };
+            write_size = send_gathered(session, &msg, size);
+        }
         if (write_size == -1) {
             if (errno != EAGAIN && errno != EWOULDBLOCK) {
                 session->state = SESSION_CLOSED;
-                logger_printf("`write(%d, (char*)%p, %zu)` failed: %s\n"
+                logger_printf("`%s(%d, /* ... */, %zu)` failed: %s\n"
                     "  session to %s aborted\n",
-                    session->fd,
-                    (void*)(session->request_buffer + session->request_offset),
-                    session->request_size - session->request_offset,
-                    strerror(errno),
+                    call, session->fd, size, strerror(errno),
                     session->destination_host);
             }
             return false;
         } else if (write_size == 0) {
-            logger_printf("write(%d, (char*)%p, %zu) returned 0\n",
-                session->fd,
-                (void*)(session->request_buffer + session->request_offset),
-                session->request_size - session->request_offset);
+            // Only the spool file may run short, if it was truncated.
+            session->state = SESSION_CLOSED;
+            logger_printf("message %s ended before its body did\n"
+                "  session to %s aborted\n",
+                request->message->name, session->destination_host);
             return false;
         }
-        session->request_offset += write_size;
+        advance_request(session, write_size);
     }
+    return true;
+}
+
+// MSG_ZEROCOPY completions are queued on the socket's error queue. Buffers
+// are not held back for them though: they are only let go of once the
+// server has replied to what they carry, so it has all of it by then.
+static void drain_error_queue(struct session *session) {
+    while (true) {
+        char control[128];
+        struct msghdr msg = {
+            .msg_control = control,
+            .msg_controllen = sizeof(control),
+        };
+        if (recvmsg(session->fd, &msg, MSG_ERRQUEUE) == -1) { return; }
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+             cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (!(cmsg->cmsg_level == SOL_IP &&
+                  cmsg->cmsg_type == IP_RECVERR) &&
+                !(cmsg->cmsg_level == SOL_IPV6 &&
+                  cmsg->cmsg_type == IPV6_RECVERR)) { continue; }
+            struct sock_extended_err *error = (void*)CMSG_DATA(cmsg);
+            // Say over loopback or a device without scatter-gather.
+            if (error->ee_origin == SO_EE_ORIGIN_ZEROCOPY &&
+                error->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+            { session->zerocopy = false; }
+        }
+    }
+}
+
+static void reserve_request(struct session_request *request, size_t size) {
+    if (request->capacity - request->size >= size) { return; }
+    static size_t const min_capacity = 1024;
+    request->capacity = request->capacity * 5 / 3 + 1;
+    if (request->capacity < min_capacity) {
+        request->capacity = min_capacity;
+    }
+    if (request->capacity < request->size + size) {
+        request->capacity = request->size + size;
+    }
+    request->buffer = realloc(request->buffer, request->capacity);
+    if (!request->buffer) {
+        die("`realloc(/* ... */, %zu)` failed: %s\n",
+            request->capacity, strerror(errno));
+    }
+}
+
+static void add_part(struct session_request *request,
+    enum session_request_part_type type, size_t offset, size_t len)
+{
+    if (!len) { return; }
+    request->len += len;
+
+    // Text written in a row goes out as one.
+    struct session_request_part *last =
+        request->parts_size ? &request->parts[request->parts_size - 1] : NULL;
+    if (type == SESSION_REQUEST_TEXT && last && last->type == type &&
+        last->offset + last->len == offset)
+    {
+        last->len += len;
+        return;
+    }
+
+    if (request->parts_size == request->parts_capacity) {
+        request->parts_capacity = request->parts_capacity * 2 + 16;
+        size_t size = request->parts_capacity * sizeof(*request->parts);
+        request->parts = realloc(request->parts, size);
+        if (!request->parts) {
+            die("`realloc(/* ... */, %zu)` failed: %s\n",
+                size, strerror(errno));
+        }
+    }
+    request->parts[request->parts_size++] =
+        (struct session_request_part){ type, offset, len };
 }
 
 #ifdef __GNUC__
     __attribute__((format(printf, 2, 3)))
 #endif
-static int checked_fprintf(FILE *stream, char const *format, ...) {
-    va_list args;
-    va_start(args, format);
-    int result = vfprintf(stream, format, args);
-    va_end(args);
-    if (result < 0) {
-        die("`vfprintf(/* ... */)` failed: %s\n", strerror(errno));
+static void request_printf(struct session_request *request,
+    char const *format, ...)
+{
+    reserve_request(request, 1);
+    while (true) {
+        va_list args;
+        va_start(args, format);
+        int len = vsnprintf(request->buffer + request->size,
+            request->capacity - request->size, format, args);
+        va_end(args);
+        if (len < 0) {
+            die("`vsnprintf(/* ... */, \"%s\", /* ... */)` failed\n",
+                format);
+        }
+        if ((size_t)len < request->capacity - request->size) {
+            add_part(request, SESSION_REQUEST_TEXT, request->size, len);
+            request->size += len;
+            return;
+        }
+        reserve_request(request, len + 1);
     }
-    return result;
 }
 
-static void write_data_payload(struct session *session, FILE *stream) {
-    struct session_message *message = TAILQ_FIRST(&session->messages);
+static void request_write(struct session_request *request, void const *data,
+    size_t len)
+{
+    if (!len) { return; }
+    reserve_request(request, len);
+    memcpy(request->buffer + request->size, data, len);
+    add_part(request, SESSION_REQUEST_TEXT, request->size, len);
+    request->size += len;
+}
+
+static void request_body(struct session_request *request,
+    struct message *message, size_t offset, size_t len)
+{
+    if (!len) { return; }
+    if (!request->message) { request->message = message_retain(message); }
+    assert(request->message == message);
+    add_part(request, SESSION_REQUEST_BODY, offset, len);
+}
+
+static void clear_request(struct session_request *request) {
+    if (request->message) {
+        message_release(request->message);
+        request->message = NULL;
+    }
+    request->size = 0;
+    request->parts_size = 0;
+    request->len = 0;
+    request->offset = 0;
+    request->part = 0;
+    request->part_offset = 0;
+    request->zerocopy = true;
+}
+
+static struct session_request *next_request(struct session *session) {
+    return session->request == &session->requests[0]
+        ? &session->requests[1] : &session->requests[0];
+}
+
+// Makes `request` the one to send, unless nothing was rendered into it.
+static void commit_request(struct session *session,
+    struct session_request *request)
+{
+    if (!request->len) { return; }
+    if (session->loop->ring) {
+        io_ring_cancel(session->loop->ring, &session->send_request);
+    }
+    clear_request(session->request);
+    session->request = request;
+}
+
+// Regular files only run short at their end, if the spool file was
+// truncated meanwhile.
+static bool read_body(struct session *session, struct message *message,
+    char *buffer, size_t offset, size_t len)
+{
+    while (len) {
+        ssize_t read_size = pread(message->fd, buffer, len,
+            message->body_offset + offset);
+        if (read_size == -1 && errno == EINTR) { continue; }
+        if (read_size == -1) {
+            session->state = SESSION_CLOSED;
+            logger_printf("`pread(%d, (char*)%p, %zu, %zu)` failed: %s\n"
+                "  session to %s aborted\n",
+                message->fd, (void*)buffer, len,
+                message->body_offset + offset, strerror(errno),
+                session->destination_host);
+            return false;
+        }
+        if (read_size == 0) {
+            session->state = SESSION_CLOSED;
+            logger_printf("message %s ended before its body did\n"
+                "  session to %s aborted\n",
+                message->name, session->destination_host);
+            return false;
+        }
+        buffer += read_size;
+        offset += read_size;
+        len -= read_size;
+    }
+    return true;
+}
+
+// The kernel sends bodies from the spool file itself unless they have to be
+// altered or encrypted on the way, or the ring does the sending.
+static bool body_windowed(struct session *session, bool dot_stuffing) {
+    struct message *message = TAILQ_FIRST(&session->messages)->self;
+    return dot_stuffing || session->loop->ring ||
+        message->body_len < BODY_SPOOL_SIZE ||
+        (session->ssl && !BIO_get_ktls_send(SSL_get_wbio(session->ssl)));
+}
 
+// Reads body bytes from `offset` on into the request. For dot stuffing the
+// two bytes in front of the window are read along, as a dot following CRLF
+// starts a line.
+static bool write_window(struct session *session,
+    struct session_request *request, size_t offset, size_t len,
+    bool dot_stuffing)
+{
+    struct message *message = TAILQ_FIRST(&session->messages)->self;
+    request->zerocopy = false;
+
+    if (!dot_stuffing) {
+        reserve_request(request, len);
+        if (!read_body(session, message, request->buffer + request->size,
+                       offset, len)) { return false; }
+        add_part(request, SESSION_REQUEST_TEXT, request->size, len);
+        request->size += len;
+        return true;
+    }
+
+    assert(len <= BODY_WINDOW_SIZE && (!offset || offset >= 2));
+    if (!session->body_window) {
+        session->body_window = malloc(BODY_WINDOW_SIZE + 2);
+        if (!session->body_window) {
+            die("`malloc(%d)` failed: %s\n",
+                BODY_WINDOW_SIZE + 2, strerror(errno));
+        }
+    }
+    char *window = session->body_window;
+    if (offset) {
+        if (!read_body(session, message, window, offset - 2, len + 2)) {
+            return false;
+        }
+    } else {
+        // The body itself starts a line.
+        memcpy(window, "\r\n", 2);
+        if (!read_body(session, message, window + 2, 0, len)) {
+            return false;
+        }
+    }
+
+    size_t size = len + 2;
+    size_t start = 2;
+    size_t dot = dot_stuffing_find(window, size, start);
+    while (true) {
+        request_write(request, window + start, dot - start);
+        if (dot == size) { break; }
+
+        request_write(request, ".", 1);
+        start = dot;
+        dot = dot_stuffing_find(window, size, dot + 1);
+    }
+    return true;
+}
+
+static void write_headers(struct session_message *message,
+    struct session_request *request, bool dot_stuffing)
+{
     for (struct message_header *header = TAILQ_FIRST(&message->self->headers);
          header; header = TAILQ_NEXT(header, link))
     {
-        checked_fprintf(stream, "%.*s: %.*s\r\n",
-            (int)header->name_len, header->name,
-            (int)header->value_len, header->value);
+        if (dot_stuffing && header->name_len && header->name[0] == '.') {
+            request_write(request, ".", 1);
+        }
+        request_write(request, header->name, header->name_len);
+        request_write(request, ": ", 2);
+        request_write(request, header->value, header->value_len);
+        request_write(request, "\r\n", 2);
+    }
+
+    request_write(request, "\r\n", 2);
+}
+
+static size_t headers_len(struct session_message *message) {
+    size_t len = 2;
+    for (struct message_header *header = TAILQ_FIRST(&message->self->headers);
+         header; header = TAILQ_NEXT(header, link))
+    { len += header->name_len + 2 + header->value_len + 2; }
+    return len;
+}
+
+// The payload is rendered whole when the body goes from the spool file and
+// a window at a time otherwise.
+static void write_data_payload(struct session *session,
+    struct session_request *request)
+{
+    struct session_message *message = TAILQ_FIRST(&session->messages);
+    bool dot_stuffing = message->self->body_dot_lines;
+
+    if (!session->streaming) { write_headers(message, request, true); }
+
+    size_t len = message->self->body_len - session->payload_offset;
+    if (body_windowed(session, dot_stuffing)) {
+        if (len > BODY_WINDOW_SIZE) { len = BODY_WINDOW_SIZE; }
+        if (!write_window(session, request, session->payload_offset, len,
+                          dot_stuffing)) { return; }
+    } else {
+        request_body(request, message->self, session->payload_offset, len);
+    }
+    session->payload_offset += len;
+    session->streaming = session->payload_offset < message->self->body_len;
+    if (session->streaming) { return; }
+
+    // The terminating line has to start a line of its own.
+    if (!message->self->body_ends_line) { request_write(request, "\r\n", 2); }
+    request_write(request, ".\r\n", 3);
+}
+
+// With CHUNKING (RFC 3030) the content goes out as is, framed by BDAT
+// lengths; the first chunk carries the headers.
+static void write_chunk(struct session *session,
+    struct session_request *request)
+{
+    struct session_message *message = TAILQ_FIRST(&session->messages);
+
+    size_t headers_size = session->chunks_written ? 0 : headers_len(message);
+    size_t body_len = message->self->body_len - session->chunk_offset;
+    if (body_len > BDAT_CHUNK_SIZE) { body_len = BDAT_CHUNK_SIZE; }
+    bool last = session->chunk_offset + body_len == message->self->body_len;
+
+    request_printf(request, "BDAT %zu%s\r\n",
+        headers_size + body_len, last ? " LAST" : "");
+    if (!session->chunks_written) { write_headers(message, request, false); }
+    if (body_windowed(session, false)) {
+        if (!write_window(session, request, session->chunk_offset, body_len,
+                          false)) { return; }
+    } else {
+        request_body(request, message->self, session->chunk_offset, body_len);
     }
 
-    checked_fprintf(stream, "\r\n");
+    ++session->chunks_written;
+    session->chunk_offset += body_len;
+    ++session->chunk_replies;
+}
+
+static bool chunks_done(struct session *session) {
+    struct session_message *message = TAILQ_FIRST(&session->messages);
+    return session->chunks_written &&
+        session->chunk_offset == message->self->body_len;
+}
+
+// Pipelined chunks are written all at once when they go from the spool
+// file, and otherwise one more whenever the previous one has been sent.
+static void write_chunks(struct session *session,
+    struct session_request *request)
+{
+    do {
+        write_chunk(session, request);
+    } while (session->state != SESSION_CLOSED && !chunks_done(session) &&
+             !body_windowed(session, false));
+    session->streaming =
+        session->state != SESSION_CLOSED && !chunks_done(session);
+}
+
+// The body is requested from the loop that owns the message, so it may not
+// have left `MESSAGE_HEADERS_LOADED` yet.
+static bool body_loading_done(struct message *message) {
+    enum message_state state = message_get_state(message);
+    return state != MESSAGE_HEADERS_LOADED && state != MESSAGE_LOADING_BODY;
+}
 
-    char *body = message->self->body;
-    size_t body_len = message->self->body_len;
+static void parse_extensions(struct session *session) {
+    static struct {
+        char const *keyword;
+        enum session_extension extension;
+    } const extensions[] = {
+        { "PIPELINING", SESSION_EXTENSION_PIPELINING },
+        { "CHUNKING", SESSION_EXTENSION_CHUNKING },
+        { "BINARYMIME", SESSION_EXTENSION_BINARYMIME },
+        { "STARTTLS", SESSION_EXTENSION_STARTTLS },
+    };
+    session->extensions = 0;
+
+    // The first line is the greeting, every other one an EHLO keyword
+    // optionally followed by parameters.
+    for (size_t i = 1; i < session->response_lines_size; ++i) {
+        char const *keyword =
+            session->response_buffer + session->response_lines[i].offset;
+        size_t len = session->response_lines[i].len;
+        char const *keyword_end = memchr(keyword, ' ', len);
+        size_t keyword_len =
+            keyword_end ? (size_t)(keyword_end - keyword) : len;
+
+        for (size_t j = 0; j < sizeof(extensions) / sizeof(*extensions); ++j) {
+            if (strlen(extensions[j].keyword) == keyword_len &&
+                !strncasecmp(extensions[j].keyword, keyword, keyword_len))
+            { session->extensions |= extensions[j].extension; }
+        }
+    }
 
-    static char const pattern[] = "\r\n";
-    static size_t const pattern_len = sizeof(pattern) - 1;
+    // LMTP servers always pipeline (RFC 2033, section 4.2). Chunks would
+    // be answered per recipient as well, so bodies go by DATA, and a local
+    // socket has nothing for TLS to protect.
+    if (lmtp(session)) {
+        session->extensions |= SESSION_EXTENSION_PIPELINING;
+        session->extensions &= ~(SESSION_EXTENSION_CHUNKING |
+                                 SESSION_EXTENSION_BINARYMIME);
+    }
+    if (local_route(session)) {
+        session->extensions &= ~SESSION_EXTENSION_STARTTLS;
+    }
+}
 
-    size_t start = 0;
-    size_t end = 0;
-    while (start < body_len) {
-        while (end + pattern_len <= body_len &&
-               strncmp(body + end, pattern, pattern_len)) { ++end; }
-        if (end + pattern_len > body_len) { end = body_len; }
+static void write_hello(struct session *session,
+    struct session_request *request)
+{
+    request_printf(request, "%s %s\r\n",
+        lmtp(session) ? "LHLO" : "EHLO", session->host);
+}
 
-        if (end - start == 1 && body[start] == '.') {
-            checked_fprintf(stream, ".");
+static void accept_recepient(struct session *session,
+    struct message_recepient *recepient)
+{
+    if (session->accepted_recepients == session->accepted_capacity) {
+        session->accepted_capacity = session->accepted_capacity * 2 + 4;
+        session->accepted = realloc(session->accepted,
+            session->accepted_capacity * sizeof(*session->accepted));
+        if (!session->accepted) {
+            die("`realloc(/* ... */, %zu)` failed: %s\n",
+                session->accepted_capacity * sizeof(*session->accepted),
+                strerror(errno));
         }
+    }
+    session->accepted[session->accepted_recepients++] = recepient;
+}
 
-        if (end < body_len) { end += pattern_len; }
+static struct message_recepient *unsettled_recepient(
+    struct message_recepient *recepient)
+{
+    while (recepient && recepient->settled) {
+        recepient = TAILQ_NEXT(recepient, link);
+    }
+    return recepient;
+}
 
-        checked_fprintf(stream, "%.*s", (int)(end - start), body + start);
+static void settle_accepted(struct session *session, bool rejected) {
+    for (size_t i = 0; i < session->accepted_recepients; ++i) {
+        if (rejected) {
+            message_mark_recepient_as_rejected(session->accepted[i]);
+        } else {
+            message_mark_recepient_as_sent(session->accepted[i]);
+        }
+    }
+}
 
-        start = end;
+// The spool file goes once every recipient is sent or refused for good and
+// at least one of them was sent; recipients deferred keep their
+// destination pending for a retry.
+static void settle_destination(struct session_message *message) {
+    bool sent;
+    if (!message_recepients_settled(message->destination, &sent)) { return; }
+    if (sent) {
+        message_mark_as_sent(message->self, message->destination);
+    } else {
+        message_mark_as_rejected(message->self, message->destination);
     }
+}
 
-    checked_fprintf(stream, "\r\n.\r\n");
+// A transaction failing as a whole takes down the recipients it reached,
+// or all of them if the sender was refused.
+static void reject_transaction(struct session *session,
+    struct session_message *message)
+{
+    if (session->sender_accepted) {
+        settle_accepted(session, true);
+        return;
+    }
+    for (struct message_recepient *recepient =
+            TAILQ_FIRST(&message->destination->recepients);
+         recepient; recepient = TAILQ_NEXT(recepient, link))
+    {
+        if (!recepient->settled) {
+            message_mark_recepient_as_rejected(recepient);
+        }
+    }
 }
 
-void dispatch(struct session *session) {
-    session->request_size = 0;
+static void start_transaction(struct session *session,
+    struct session_message *message)
+{
+    session->message_recepient =
+        unsettled_recepient(TAILQ_FIRST(&message->destination->recepients));
+    session->reply_recepient = session->message_recepient;
+    session->sender_replied = false;
+    session->sender_accepted = false;
+    session->accepted_recepients = 0;
+    session->deferred = false;
+    session->data_replies = 0;
+
+    session->chunks_written = 0;
+    session->chunk_offset = 0;
+    session->chunk_replies = 0;
+    session->chunk_rejected = false;
+
+    session->streaming = false;
+    session->payload_offset = 0;
+}
+
+static bool binarymime(struct session *session) {
+    unsigned const extensions =
+        SESSION_EXTENSION_CHUNKING | SESSION_EXTENSION_BINARYMIME;
+    return (session->extensions & extensions) == extensions;
+}
 
-    free(session->request_buffer);
-    session->request_buffer = NULL;
+static void write_sender(struct session *session,
+    struct session_message *message, struct session_request *request)
+{
+    request_printf(request, "MAIL FROM:<%.*s>%s\r\n",
+        (int)message->self->sender_len, message->self->sender,
+        binarymime(session) && message->self->body_binary
+            ? " BODY=BINARYMIME" : "");
+}
 
-    session->request_offset = 0;
+static void write_recepient(struct session *session,
+    struct session_request *request)
+{
+    struct message_destination *destination =
+        TAILQ_FIRST(&session->messages)->destination;
+    request_printf(request, "RCPT TO:<%.*s@%.*s>\r\n",
+        (int)session->message_recepient->user_len,
+        session->message_recepient->user,
+        (int)destination->host_len, destination->host);
+    session->message_recepient =
+        unsettled_recepient(TAILQ_NEXT(session->message_recepient, link));
+}
 
-    FILE *stream = open_memstream(&session->request_buffer,
-                                  &session->request_size);
-    if (!stream) {
-        die("`open_memstream(/* ... */)` failed: %s\n",
-            strerror(errno));
+static void continue_payload(struct session *session) {
+    struct session_request *request = next_request(session);
+    assert(!request->len);
+    if (session->state == SESSION_SENDING_DATA_PAYLOAD) {
+        write_data_payload(session, request);
+    } else {
+        write_chunks(session, request);
     }
+    commit_request(session, request);
+}
+
+static void note_reply(struct session *session) {
+    switch (session->state) {
+    case SESSION_SENDING_MAIL_OR_RCPT:
+        if (session->sender_replied) { break; }
+        // fallthrough
+    case SESSION_SENDING_DATA:
+    case SESSION_SENDING_DATA_PAYLOAD:
+    case SESSION_SENDING_BDAT:
+        if (session->response_code >= 400 && session->response_code < 500) {
+            session->deferred = true;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void dispatch(struct session *session) {
+    struct session_request *request = next_request(session);
+    assert(!request->len);
+    note_reply(session);
 
     struct session_message *message = TAILQ_FIRST(&session->messages);
+    bool pipelining = session->extensions & SESSION_EXTENSION_PIPELINING;
+    bool chunking = session->extensions & SESSION_EXTENSION_CHUNKING;
 
     switch (session->state) {
     case SESSION_RESOLVING_DNS:
@@ -377,104 +1504,309 @@ void dispatch(struct session *session) {
         assert(false);
         goto exit;
     case SESSION_RECEIVING_GREETING:
+        if (session->response_code == 220) {
+            host_table_succeeded(session->hosts, session->mx_reply->host);
+            session->state = SESSION_SENDING_EHLO;
+            write_hello(session, request);
+            goto exit;
+        }
+        host_table_failed(session->hosts, session->mx_reply->host);
         if (session->response_code == 554) {
             session->state = SESSION_SENDING_QUIT;
             logger_printf("server %s refused session\n",
                 session->destination_host);
-            checked_fprintf(stream, "QUIT\r\n");
+            request_printf(request, "QUIT\r\n");
             goto exit;
         }
-        if (session->response_code == 220) {
+        break;
+    case SESSION_SENDING_EHLO:
+        if (session->response_code == 250) {
+            parse_extensions(session);
+            pipelining = session->extensions & SESSION_EXTENSION_PIPELINING;
+            chunking = session->extensions & SESSION_EXTENSION_CHUNKING;
+            if (session->tls && !session->ssl &&
+                session->extensions & SESSION_EXTENSION_STARTTLS &&
+                tls_usable(session->tls, session->mx_reply->host))
+            {
+                session->state = SESSION_SENDING_STARTTLS;
+                request_printf(request, "STARTTLS\r\n");
+                goto exit;
+            }
+            goto start_message_transfer;
+        }
+        // LMTP has nothing to fall back on.
+        if (!lmtp(session) &&
+            session->response_code >= 500 && session->response_code < 600)
+        {
             session->state = SESSION_SENDING_HELO;
-            checked_fprintf(stream, "HELO %s\r\n", session->host);
+            request_printf(request, "HELO %s\r\n", session->host);
             goto exit;
         }
         break;
+    case SESSION_SENDING_STARTTLS:
+        if (session->response_code == 220) {
+            // Anything sent along with the reply was not protected by TLS
+            // and must not be taken for part of the session (RFC 3207).
+            if (session->response_size > session->response_len) {
+                session->state = SESSION_CLOSED;
+                logger_printf("server %s sent data after STARTTLS reply\n"
+                    "  session aborted\n",
+                    session->destination_host);
+                goto exit;
+            }
+            if (session->loop->ring) {
+                io_ring_cancel(session->loop->ring, &session->recv_request);
+            }
+            session->state = SESSION_HANDSHAKING;
+            session->ssl = tls_connect(session->tls, session->fd,
+                session->mx_reply->host);
+            session->tls_events = EPOLLOUT;
+            goto exit;
+        }
+        logger_printf("server %s refused STARTTLS: %d %.*s\n",
+            session->destination_host, session->response_code,
+            reply_text_len(session), reply_text(session));
+        goto start_message_transfer;
+    case SESSION_HANDSHAKING:
+        // Nothing the server said before the handshake holds any longer.
+        session->state = SESSION_SENDING_EHLO;
+        write_hello(session, request);
+        goto exit;
     case SESSION_SENDING_HELO:
         if (session->response_code == 250) {
         start_message_transfer:
+            session->established = true;
             if (!message) {
+                if (settings.idle_timeout) {
+                    session->state = SESSION_IDLE;
+                    event_loop_schedule(session->loop, session->observer);
+                    goto exit;
+                }
                 session->state = SESSION_SENDING_QUIT;
-                checked_fprintf(stream, "QUIT\r\n");
+                request_printf(request, "QUIT\r\n");
                 goto exit;
             }
 
-            session->state = SESSION_SENDING_MAIL_OR_RCPT;
-            checked_fprintf(stream, "MAIL FROM:<%.*s>\r\n",
-                (int)message->self->sender_len, message->self->sender);
-
-            struct message_destination *destination = 
-                TAILQ_FIRST(&message->self->destinations);
-            while (destination->host_len !=
-                       strlen(session->destination_host) ||
-                   strncmp(destination->host,
-                           session->destination_host,
-                           destination->host_len))
-            { destination = TAILQ_NEXT(destination, link); }
-            session->message_recepient = 
-                TAILQ_FIRST(&destination->recepients);
-
+            start_transaction(session, message);
+            message_add_observer(message->self, &session->message_observer);
             message_start_loading_body(message->self);
 
+            // The content goes into a pipelined batch and decides on the
+            // BODY parameter, so it has to be at hand first.
+            if (pipelining || binarymime(session)) {
+                if (!body_loading_done(message->self)) {
+                    session->state = SESSION_LOADING_MESSAGE_BODY;
+                    goto exit;
+                }
+            write_transaction:
+                if (message_get_state(message->self) ==
+                    MESSAGE_LOADING_FAILED) { goto dequeue_message; }
+            }
+
+            session->state = SESSION_SENDING_MAIL_OR_RCPT;
+            write_sender(session, message, request);
+            if (pipelining) {
+                while (session->message_recepient) {
+                    write_recepient(session, request);
+                }
+                if (chunking) {
+                    write_chunks(session, request);
+                } else {
+                    request_printf(request, "DATA\r\n");
+                }
+            }
             goto exit;
         }
         break;
     case SESSION_SENDING_MAIL_OR_RCPT:
-        if (session->response_code == 250) {
-            if (session->message_recepient) {
-                checked_fprintf(stream, "RCPT TO:<%.*s@%s>\r\n",
-                    (int)session->message_recepient->user_len,
-                    session->message_recepient->user,
-                    session->destination_host);
-                session->message_recepient =
-                    TAILQ_NEXT(session->message_recepient, link);
-                goto exit;
-            }
-            if (message->self->state == MESSAGE_LOADING_BODY) {
-                session->state = SESSION_LOADING_MESSAGE_BODY;
-                goto exit;
-            }
-            message_body_loading_done:
-            if (message->self->state == MESSAGE_LOADING_FAILED) {
-                session->state = SESSION_SENDING_RSET;
-                checked_fprintf(stream, "RSET\r\n");
-                goto exit;
+        if (!session->sender_replied) {
+            session->sender_replied = true;
+            session->sender_accepted = session->response_code == 250;
+            if (!session->sender_accepted) {
+                logger_printf("server %s rejected sender: %d %.*s\n",
+                    session->destination_host, session->response_code,
+                    reply_text_len(session), reply_text(session));
+                // Pipelined recipients and DATA are still answered.
+                if (!pipelining) { goto reset_transaction; }
             }
-            if (message->self->state == MESSAGE_BODY_LOADED) {
-                session->state = SESSION_SENDING_DATA;
-                checked_fprintf(stream, "DATA\r\n");
-                goto exit;
+        } else {
+            if (session->response_code == 250 ||
+                session->response_code == 251)
+            {
+                accept_recepient(session, session->reply_recepient);
+            } else if (session->sender_accepted) {
+                logger_printf("server %s rejected recipient %.*s: %d %.*s\n",
+                    session->destination_host,
+                    (int)session->reply_recepient->user_len,
+                    session->reply_recepient->user, session->response_code,
+                    reply_text_len(session), reply_text(session));
+                // One deferred is tried again later, without the others.
+                if (session->response_code >= 500) {
+                    message_mark_recepient_as_rejected(
+                        session->reply_recepient);
+                }
             }
+            session->reply_recepient = unsettled_recepient(
+                TAILQ_NEXT(session->reply_recepient, link));
         }
-        break;
+
+        if (session->reply_recepient) {
+            if (!pipelining) { write_recepient(session, request); }
+            goto exit;
+        }
+
+        if (pipelining) {
+            session->state =
+                chunking ? SESSION_SENDING_BDAT : SESSION_SENDING_DATA;
+            goto exit;
+        }
+        if (!session->accepted_recepients) { goto reset_transaction; }
+        if (!body_loading_done(message->self)) {
+            session->state = SESSION_LOADING_MESSAGE_BODY;
+            goto exit;
+        }
+    message_body_loading_done:
+        if (message_get_state(message->self) == MESSAGE_LOADING_FAILED) {
+            goto reset_transaction;
+        }
+        if (chunking) {
+            session->state = SESSION_SENDING_BDAT;
+            write_chunk(session, request);
+            goto exit;
+        }
+        session->state = SESSION_SENDING_DATA;
+        request_printf(request, "DATA\r\n");
+        goto exit;
     case SESSION_SENDING_DATA:
-        if (session->response_code == 354) {
+        if (session->response_code == 354 && session->accepted_recepients) {
             session->state = SESSION_SENDING_DATA_PAYLOAD;
-            write_data_payload(session, stream);
+            write_data_payload(session, request);
             goto exit;
         }
-        break;
-    case SESSION_LOADING_MESSAGE_BODY:
-        if (message->self->state != MESSAGE_LOADING_BODY) {
-            goto message_body_loading_done;
+        // Every pipelined recipient was refused, yet the server is ready
+        // for the data: an empty message ends it (RFC 2920, section 3.1).
+        if (session->response_code == 354) {
+            session->state = SESSION_ABANDONING_DATA;
+            request_printf(request, ".\r\n");
+            goto exit;
         }
+        if (session->accepted_recepients) {
+            logger_printf("server %s rejected DATA: %d %.*s\n",
+                session->destination_host, session->response_code,
+                reply_text_len(session), reply_text(session));
+        }
+    reset_transaction:
+        session->state = SESSION_SENDING_RSET;
+        request_printf(request, "RSET\r\n");
         goto exit;
+    case SESSION_ABANDONING_DATA:
+        // Whatever the server made of the empty message, the transaction
+        // is over.
+        goto reset_transaction;
+    case SESSION_LOADING_MESSAGE_BODY:
+        if (!body_loading_done(message->self)) { goto exit; }
+        if (!session->sender_replied) { goto write_transaction; }
+        goto message_body_loading_done;
     case SESSION_SENDING_DATA_PAYLOAD:
+        if (lmtp(session)) {
+            struct message_recepient *recepient =
+                session->accepted[session->data_replies++];
+            if (session->response_code == 250) {
+                message_mark_recepient_as_sent(recepient);
+            } else {
+                logger_printf("server %s failed to deliver to %.*s: "
+                    "%d %.*s\n",
+                    session->destination_host, (int)recepient->user_len,
+                    recepient->user, session->response_code,
+                    reply_text_len(session), reply_text(session));
+                if (session->response_code >= 500) {
+                    message_mark_recepient_as_rejected(recepient);
+                }
+            }
+            if (session->data_replies < session->accepted_recepients) {
+                goto exit;
+            }
+            settle_destination(message);
+            goto dequeue_message;
+        }
+        if (session->response_code >= 400 && session->response_code < 600) {
+            // The transaction is over and the session goes on, the
+            // recipients left to a retry unless refused for good.
+            logger_printf("server %s rejected message: %d %.*s\n",
+                session->destination_host, session->response_code,
+                reply_text_len(session), reply_text(session));
+            if (session->response_code >= 500) {
+                settle_accepted(session, true);
+                settle_destination(message);
+            }
+            goto dequeue_message;
+        }
         if (session->response_code == 250) {
-            message_mark_as_sent(message->self, session->destination_host);
+            settle_accepted(session, false);
+            settle_destination(message);
         dequeue_message:
+            message_remove_observer(&session->message_observer);
             TAILQ_REMOVE(&session->messages, message, link);
+            __atomic_sub_fetch(&session->messages_size, 1, __ATOMIC_RELAXED);
             message_release(message->self);
             free(message);
             message = TAILQ_FIRST(&session->messages);
             goto start_message_transfer;
         }
         break;
+    case SESSION_SENDING_BDAT:
+        --session->chunk_replies;
+        if (session->response_code != 250) {
+            if (!session->chunk_rejected && session->accepted_recepients) {
+                logger_printf("server %s rejected BDAT: %d %.*s\n",
+                    session->destination_host, session->response_code,
+                    reply_text_len(session), reply_text(session));
+            }
+            // No more chunks may follow a rejected one.
+            session->chunk_rejected = true;
+            session->streaming = false;
+        }
+        if (session->chunk_replies || session->streaming) { goto exit; }
+        if (session->chunk_rejected) { goto reset_transaction; }
+        if (chunks_done(session)) {
+            settle_accepted(session, false);
+            settle_destination(message);
+            goto dequeue_message;
+        }
+        write_chunk(session, request);
+        goto exit;
     case SESSION_SENDING_RSET:
         if (session->response_code == 250) {
+            if (!session->deferred) { reject_transaction(session, message); }
+            settle_destination(message);
             goto dequeue_message;
         }
         break;
+    case SESSION_IDLE:
+        if (session->response_code != -1) {
+            session->state = SESSION_CLOSED;
+            logger_printf("server %s closed idle session: %d %.*s\n",
+                session->destination_host, session->response_code,
+                reply_text_len(session), reply_text(session));
+            goto exit;
+        }
+        if (message) {
+            session->state = SESSION_RESUMING;
+            session->resuming = true;
+            request_printf(request, "RSET\r\n");
+            goto exit;
+        }
+        session->state = SESSION_SENDING_QUIT;
+        request_printf(request, "QUIT\r\n");
+        goto exit;
+    case SESSION_RESUMING:
+        if (session->response_code == 250) {
+            session->resuming = false;
+            goto start_message_transfer;
+        }
+        // `update` reconnects once before giving up on the session.
+        session->state = SESSION_CLOSED;
+        goto exit;
     case SESSION_SENDING_QUIT:
         if (session->response_code == 221) {
             session->state = SESSION_CLOSED;
@@ -487,234 +1819,574 @@ void dispatch(struct session *session) {
     }
 
     session->state = SESSION_CLOSED;
-    logger_printf("server %s sent unexpected response code: %d\n"
+    logger_printf("server %s sent unexpected response: %d %.*s\n"
         "  session aborted\n",
-        session->destination_host, session->response_code);
+        session->destination_host, session->response_code,
+        reply_text_len(session), reply_text(session));
 
 exit:
-    if (fclose(stream)) {
-        die("`fclose(/* in-memory stream */)` failed: %s\n", strerror(errno));
+    // Replies to a pipelined batch leave nothing new to send.
+    commit_request(session, request);
+
+    // Whatever follows the reply belongs to the next one.
+    if (session->response_code != -1) {
+        session->response_size -= session->response_len;
+        memmove(session->response_buffer,
+            session->response_buffer + session->response_len,
+            session->response_size);
     }
-
-    session->response_size = 0;
-    session->response_line_len = 0;
-    session->response_code = -1;
+    reset_response(session);
 }
 
-void session_initialize(struct session *session,
-    char const *host, char const *destination_host)
-{
-    session->state = SESSION_RESOLVING_DNS;
-
-    session->host = strdup(host);
-    if (!session->host) {
-        die("`strdup(\"%s\")` failed: %s\n", host, strerror(errno));
+static void process_responses(struct session *session) {
+    while (session->response_code != -1) {
+        dispatch(session);
+        if (session->state == SESSION_CLOSED) { break; }
+        parse_response(session);
     }
+}
 
-    session->destination_host = strdup(destination_host);
-    if (!session->destination_host) {
-        die("`strdup(\"%s\")` failed: %s\n",
-            destination_host, strerror(errno));
-    }
+static void submit_recv(struct session *session) {
+    reserve_response(session);
+    io_ring_recv(session->loop->ring, &session->recv_request, session->fd,
+        session->response_buffer + session->response_size,
+        session->response_capacity - session->response_size);
+}
 
+// The ring cannot take body slices from the spool file, bodies are read
+// into windows instead.
+static void submit_send(struct session *session) {
+    size_t size;
+    session->request_msghdr = (struct msghdr){
+        .msg_iov = session->request_iovs,
+        .msg_iovlen = gather_request(session, &size),
+    };
+    if (session->zerocopy && session->request->zerocopy &&
+        size >= ZEROCOPY_THRESHOLD)
     {
-        int status = ares_library_init(ARES_LIB_INIT_ALL);
-        if (status != ARES_SUCCESS) {
-            die("`ares_library_init(ARES_LIB_INIT_ALL)` failed: %s\n",
-                ares_strerror(status));
-        }
+        io_ring_sendmsg_zc(session->loop->ring, &session->send_request,
+            session->fd, &session->request_msghdr);
+    } else {
+        io_ring_sendmsg(session->loop->ring, &session->send_request,
+            session->fd, &session->request_msghdr);
     }
+}
 
-    {
-        session->channel_initialized = false;
-        int status = ares_init(&session->channel);
-        if (status != ARES_SUCCESS) {
-            session->state = SESSION_CLOSED;
-            logger_printf("`ares_init((ares_channnel*)%p)` failed: %s\n"
-                "  session to %s aborted\n",
-                (void*)&session->channel, ares_strerror(status),
-                session->destination_host);
-        } else {
-            session->channel_initialized = true;
-        }
+static uint64_t get_timeout(struct session *session) {
+    switch (session->state) {
+    case SESSION_CONNECTING:
+        return CONNECT_TIMEOUT;
+    case SESSION_RECEIVING_GREETING:
+        return GREETING_TIMEOUT;
+    case SESSION_SENDING_EHLO:
+    case SESSION_SENDING_STARTTLS:
+    case SESSION_HANDSHAKING:
+    case SESSION_SENDING_HELO:
+    case SESSION_SENDING_MAIL_OR_RCPT:
+    case SESSION_SENDING_RSET:
+    case SESSION_RESUMING:
+    case SESSION_SENDING_QUIT:
+        return COMMAND_TIMEOUT;
+    case SESSION_IDLE:
+        return (uint64_t)settings.idle_timeout * 1000;
+    case SESSION_SENDING_DATA:
+        return DATA_INITIATION_TIMEOUT;
+    case SESSION_SENDING_DATA_PAYLOAD:
+    case SESSION_SENDING_BDAT:
+    case SESSION_ABANDONING_DATA:
+        return request_pending(session)
+            ? DATA_BLOCK_TIMEOUT : DATA_TERMINATION_TIMEOUT;
+    case SESSION_RESOLVING_DNS:
+    case SESSION_LOADING_MESSAGE_BODY:
+    case SESSION_CLOSED:
+        break;
     }
+    return 0;
+}
 
-    session->first_mx_reply = NULL;
+static void update_timer(struct session *session) {
+    // Timers that have expired are rearmed even if nothing has changed.
+    if (session->state == session->timer_state &&
+        session->sent == session->timer_sent && session->timer.armed)
+    { return; }
+    session->timer_state = session->state;
+    session->timer_sent = session->sent;
+
+    uint64_t timeout = get_timeout(session);
+    if (timeout) {
+        event_loop_arm(session->loop, &session->timer, timeout);
+    } else {
+        event_loop_disarm(session->loop, &session->timer);
+    }
+}
 
-    session->hostent = NULL;
+static void close_tls(struct session *session) {
+    if (!session->ssl) { return; }
+    // Sessions closed without notice may not be resumed.
+    ERR_clear_error();
+    SSL_shutdown(session->ssl);
+    ERR_clear_error();
+    SSL_free(session->ssl);
+    session->ssl = NULL;
+    session->tls_events = 0;
+}
+
+// Starts over with the addresses of the MX host last connected to.
+static bool reconnect(struct session *session) {
+    session->resuming = false;
+    if (!session->hostents[0] && !session->hostents[1] &&
+        !local_route(session)) { return false; }
 
+    if (session->loop->ring) {
+        io_ring_cancel(session->loop->ring, &session->recv_request);
+        io_ring_cancel(session->loop->ring, &session->send_request);
+    }
+    event_loop_remove(session->loop, &session->handler);
+    close_tls(session);
+    if (close(session->fd)) {
+        die("`close(%d)` failed: %s\n", session->fd, strerror(errno));
+    }
     session->fd = -1;
 
-    session->response_capacity = 0;
     session->response_size = 0;
-    session->response_buffer = NULL;
-    session->response_line_len = 0;
-    session->response_code = -1;
-
-    session->request_size = 0;
-    session->request_buffer = NULL;
-    session->request_offset = 0;
+    reset_response(session);
+    session->extensions = 0;
+    clear_request(session->request);
+    session->streaming = false;
 
-    TAILQ_INIT(&session->messages);
+    session->state = SESSION_RESOLVING_DNS;
+    if (local_route(session)) {
+        connect_local(session);
+    } else {
+        start_race(session);
+    }
+    return true;
+}
 
-    logger_printf("initialized session to %s\n", session->destination_host);
+static void handshake(struct session *session) {
+    ERR_clear_error();
+    int result = SSL_connect(session->ssl);
+    if (result == 1) {
+        logger_printf("established %s with %s%s%s\n",
+            SSL_get_version(session->ssl), session->mx_reply->host,
+            SSL_session_reused(session->ssl) ? ", resumed" : "",
+            BIO_get_ktls_send(SSL_get_wbio(session->ssl)) ? ", kTLS" : "");
+        session->tls_events = 0;
+        dispatch(session);
+        return;
+    }
 
-    if (session->state == SESSION_RESOLVING_DNS) {
-        ares_search(session->channel, session->destination_host,
-            ns_c_in, ns_t_mx, mx_search_callback, session);
+    int error = SSL_get_error(session->ssl, result);
+    if (error == SSL_ERROR_WANT_READ) {
+        session->tls_events = EPOLLIN;
+        return;
+    }
+    if (error == SSL_ERROR_WANT_WRITE) {
+        session->tls_events = EPOLLOUT;
+        return;
     }
+
+    logger_printf("TLS handshake with %s failed: %s\n"
+        "  retrying without TLS\n",
+        session->mx_reply->host, tls_error_string());
+    tls_mark_failed(session->tls, session->mx_reply->host);
+    if (!reconnect(session)) { session->state = SESSION_CLOSED; }
 }
 
-void session_subscribe(struct session *session, struct fd_set *fd_set_) {
-    struct session_message *message = TAILQ_FIRST(&session->messages);
-    if (message) { message_subscribe(message->self, fd_set_); }
+static void update(struct session *session) {
+    // The server may have dropped a parked connection without telling us.
+    if (session->state == SESSION_CLOSED && session->resuming) {
+        logger_printf("idle session to %s was lost, reconnecting\n",
+            session->destination_host);
+        reconnect(session);
+    }
+
+    // Windows are read just ahead of the socket, so a slow server holds
+    // back the reading.
+    if (session->streaming && session->state != SESSION_CLOSED &&
+        !request_pending(session)) { continue_payload(session); }
+
+    if (session->state == SESSION_CLOSED) {
+        if (session->loop->ring) {
+            io_ring_cancel(session->loop->ring, &session->recv_request);
+            io_ring_cancel(session->loop->ring, &session->send_request);
+        }
+        event_loop_remove(session->loop, &session->handler);
+        abandon_attempts(session);
+        resolver_cancel(session->resolver, session);
+        event_loop_disarm(session->loop, &session->timer);
+        event_loop_schedule(session->loop, session->observer);
+        return;
+    }
+
+    update_timer(session);
+
+    if (session->fd == -1) { return; }
+
+    // Bodies are corked until the last of them is written.
+    bool cork = session->tcp_options->cork && request_pending(session) &&
+        (session->state == SESSION_SENDING_DATA_PAYLOAD ||
+         session->state == SESSION_SENDING_BDAT);
+    if (cork != session->corked) {
+        session->corked = cork;
+        set_tcp_option(session, TCP_CORK, "TCP_CORK", cork);
+    }
 
+    uint32_t events = 0;
     switch (session->state) {
     case SESSION_RESOLVING_DNS:
-        {
-            struct timeval tv;
-            ares_timeout(session->channel, NULL, &tv);
-            int timeout = tv.tv_sec * 1000 + tv.tv_usec / 1000;
-            fd_set readables; FD_ZERO(&readables);
-            fd_set writables; FD_ZERO(&writables);
-            int limit = ares_fds(session->channel, &readables, &writables);
-            for (int fd = 0; fd < limit; ++fd) {
-                short events = 0;
-                if (FD_ISSET(fd, &readables)) { events |= POLLIN; }
-                if (FD_ISSET(fd, &writables)) { events |= POLLOUT; }
-                if (events) { fd_set_add(fd_set_, fd, events, timeout); }
-            }
-        }
-        break;
     case SESSION_CONNECTING:
-        fd_set_add(fd_set_, session->fd, POLLOUT, -1);
+        break;
+    case SESSION_HANDSHAKING:
+        events = session->tls_events;
         break;
     case SESSION_RECEIVING_GREETING:
+    case SESSION_SENDING_EHLO:
+    case SESSION_SENDING_STARTTLS:
     case SESSION_SENDING_HELO:
     case SESSION_SENDING_MAIL_OR_RCPT:
     case SESSION_SENDING_DATA:
-        goto exchange;
-    case SESSION_LOADING_MESSAGE_BODY:
-        break;
     case SESSION_SENDING_DATA_PAYLOAD:
+    case SESSION_SENDING_BDAT:
+    case SESSION_ABANDONING_DATA:
     case SESSION_SENDING_RSET:
+    case SESSION_IDLE:
+    case SESSION_RESUMING:
     case SESSION_SENDING_QUIT:
-        exchange: {
-            short events = 0;
-            if (session->response_code == -1) { events |= POLLIN; }
-            if (session->request_offset < session->request_size) {
-                events |= POLLOUT;
-            }
-            fd_set_add(fd_set_, session->fd, events, -1);
+        if (session->loop->ring && !session->ssl) {
+            // Readiness is tracked by the ring's own poll requests.
+            event_loop_remove(session->loop, &session->handler);
+            if (session->response_code == -1 &&
+                !session->recv_request.in_flight) { submit_recv(session); }
+            if (request_pending(session) &&
+                !session->send_request.in_flight) { submit_send(session); }
+            return;
         }
+        if (session->response_code == -1) { events |= EPOLLIN; }
+        if (request_pending(session)) { events |= EPOLLOUT; }
+        events |= session->tls_events;
         break;
+    case SESSION_LOADING_MESSAGE_BODY:
     case SESSION_CLOSED:
         break;
     }
+
+    if (session->handler.fd == -1) {
+        event_loop_add(session->loop, &session->handler, session->fd, events);
+    } else {
+        event_loop_modify(session->loop, &session->handler, events);
+    }
 }
 
-void session_notify(struct session *session, struct fd_set const *fd_set_) {
-    struct session_message *message = TAILQ_FIRST(&session->messages);
-    if (message) { message_notify(message->self, fd_set_); }
+static void recv_complete(struct io_ring_request *request, int result) {
+    struct session *session =
+        container_of(request, struct session, recv_request);
 
-    switch (session->state) {
-    case SESSION_RESOLVING_DNS:
-        {
-            fd_set readables; FD_ZERO(&readables);
-            fd_set writables; FD_ZERO(&writables);
-            int limit = ares_fds(session->channel, &readables, &writables);
-            for (int fd = 0; fd < limit; ++fd) {
-                short events = fd_set_get_events(fd_set_, fd);
-                if (!(events & (POLLIN | POLLHUP | POLLERR))) {
-                    FD_CLR(fd, &readables);
-                }
-                if (!(events & (POLLOUT | POLLHUP | POLLERR))) {
-                    FD_CLR(fd, &writables);
-                }
-            }
-            ares_process(session->channel, &readables, &writables);
-        }
-        break;
-    case SESSION_CONNECTING:
-        {
-            short events = fd_set_get_events(fd_set_, session->fd);
-            if (!(events & (POLLOUT | POLLHUP | POLLERR))) { break; }
+    if (result < 0) {
+        session->state = SESSION_CLOSED;
+        logger_printf("`recv(%d, (char*)%p, %zu)` failed: %s\n"
+            "  session to %s aborted\n",
+            session->fd,
+            (void*)(session->response_buffer + session->response_size),
+            session->response_capacity - session->response_size,
+            strerror(-result), session->destination_host);
+    } else if (result == 0) {
+        session->state = SESSION_CLOSED;
+        logger_printf("%s has unexpectedly down shut the connection\n"
+            "  session aborted\n",
+            session->destination_host);
+    } else {
+        session->response_size += result;
+        if (parse_response(session)) { process_responses(session); }
+    }
 
-            int error;
-            if (getsockopt(session->fd, SOL_SOCKET, SO_ERROR,
-                           &error, &(socklen_t){sizeof(error)}))
-            {
-                die("`getsockopt(%d, SOL_SOCKET, SO_ERROR, /*...*/)` "
-                    "failed: %s\n", session->fd, strerror(error));
-            }
-            if (error) {
-                char addrstr[INET_ADDRSTRLEN > INET6_ADDRSTRLEN ?
-                             INET_ADDRSTRLEN : INET6_ADDRSTRLEN];
-                struct sockaddr *sa = (void*)&session->sockaddr;
-                void *addr = (sa->sa_family == AF_INET6)
-                    ? (void*)&((struct sockaddr_in6*)sa)->sin6_addr
-                    : (void*)&((struct sockaddr_in*)sa)->sin_addr;
-                inet_ntop(sa->sa_family, addr, addrstr, sizeof(addrstr));
-                logger_printf("`connect(%d, /* %s */)` failed: %s\n",
-                    session->fd, addrstr, strerror(errno));
-
-                session->state = SESSION_RESOLVING_DNS;
-                ++session->addr_index;
-                try_addr(session);
-                break;
-            }
+    update(session);
+}
+
+static void send_complete(struct io_ring_request *request, int result) {
+    struct session *session =
+        container_of(request, struct session, send_request);
+
+    if ((result == -EINVAL || result == -EOPNOTSUPP) && session->zerocopy) {
+        // Kernels before 6.0 know no zero-copy sends, retry with a copy.
+        session->zerocopy = false;
+    } else if (result < 0) {
+        session->state = SESSION_CLOSED;
+        logger_printf("`sendmsg(%d, /* ... */)` failed: %s\n"
+            "  session to %s aborted\n",
+            session->fd, strerror(-result), session->destination_host);
+    } else {
+        advance_request(session, result);
+    }
 
-            session->state = SESSION_RECEIVING_GREETING;
+    update(session);
+}
+
+static void timer_expire(struct event_timer *timer) {
+    struct session *session = container_of(timer, struct session, timer);
+
+    if (session->state == SESSION_CONNECTING) {
+        logger_printf("connecting to %s timed out\n",
+            session->mx_reply->host);
+        abandon_attempts(session);
+        race(session);
+    } else if (session->state == SESSION_IDLE) {
+        // Nothing arrived during the grace period.
+        dispatch(session);
+    } else {
+        if (session->state == SESSION_RECEIVING_GREETING) {
+            host_table_failed(session->hosts, session->mx_reply->host);
         }
+        session->state = SESSION_CLOSED;
+        logger_printf("server %s timed out\n  session aborted\n",
+            session->destination_host);
+    }
+
+    update(session);
+}
+
+static void notify(struct event_handler *handler, uint32_t events) {
+    struct session *session = container_of(handler, struct session, handler);
+
+    if (events & EPOLLERR && session->zerocopy_sent) {
+        drain_error_queue(session);
+    }
+
+    switch (session->state) {
+    // Attempts to connect have handlers of their own.
+    case SESSION_RESOLVING_DNS:
+    case SESSION_CONNECTING:
         break;
     case SESSION_RECEIVING_GREETING:
+    case SESSION_SENDING_EHLO:
+    case SESSION_SENDING_STARTTLS:
     case SESSION_SENDING_HELO:
     case SESSION_SENDING_MAIL_OR_RCPT:
     case SESSION_SENDING_DATA:
         goto exchange;
+    case SESSION_HANDSHAKING:
+        if (events) { handshake(session); }
+        break;
     case SESSION_LOADING_MESSAGE_BODY:
         dispatch(session);
         break;
     case SESSION_SENDING_DATA_PAYLOAD:
+    case SESSION_SENDING_BDAT:
+    case SESSION_ABANDONING_DATA:
     case SESSION_SENDING_RSET:
+    case SESSION_IDLE:
+    case SESSION_RESUMING:
     case SESSION_SENDING_QUIT:
         exchange: {
-            short events = fd_set_get_events(fd_set_, session->fd);
-            if (!(events & (POLLIN | POLLOUT | POLLHUP | POLLERR))) { break; }
-
-            if (events & (POLLIN | POLLHUP | POLLERR) &&
-                session->response_code == -1)
-            { try_receive_response(session); }
-            if (events & (POLLOUT | POLLHUP | POLLERR) && 
-                session->request_offset < session->request_size)
-            { try_send_request(session); }
+            if (!(events & (EPOLLIN | EPOLLOUT | EPOLLHUP | EPOLLERR))) {
+                break;
+            }
 
-            if (session->response_code == -1) { break; }
+            if (session->ssl) {
+                // OpenSSL may need either direction to make progress in
+                // the other, so both are tried on any readiness.
+                session->tls_events = 0;
+                if (session->response_code == -1) {
+                    try_receive_response(session);
+                }
+                if (session->state != SESSION_CLOSED &&
+                    request_pending(session)) { try_send_request(session); }
+            } else {
+                if (events & (EPOLLIN | EPOLLHUP | EPOLLERR) &&
+                    session->response_code == -1)
+                { try_receive_response(session); }
+                if (events & (EPOLLOUT | EPOLLHUP | EPOLLERR) &&
+                    request_pending(session)) { try_send_request(session); }
+            }
 
-            dispatch(session);
+            if (session->state == SESSION_CLOSED) { break; }
+            process_responses(session);
         } 
         break;
     case SESSION_CLOSED:
-        break;
+        return;
+    }
+
+    update(session);
+}
+
+void session_initialize(struct session *session, struct event_loop *loop,
+    char const *host, char const *destination_host,
+    struct transport_route const *route, struct tls *tls,
+    struct resolver *resolver, struct host_table *hosts,
+    struct event_handler *observer)
+{
+    session->state = SESSION_RESOLVING_DNS;
+
+    session->loop = loop;
+    session->observer = observer;
+
+    event_handler_initialize(&session->handler, notify);
+    io_ring_request_initialize(&session->recv_request, recv_complete);
+    io_ring_request_initialize(&session->send_request, send_complete);
+    message_observer_initialize(&session->message_observer, loop,
+        &session->handler);
+
+    session->host = strdup(host);
+    if (!session->host) {
+        die("`strdup(\"%s\")` failed: %s\n", host, strerror(errno));
+    }
+
+    session->destination_host = strdup(destination_host);
+    if (!session->destination_host) {
+        die("`strdup(\"%s\")` failed: %s\n",
+            destination_host, strerror(errno));
+    }
+
+    event_timer_initialize(&session->timer, timer_expire);
+    session->timer_state = SESSION_RESOLVING_DNS;
+    session->timer_sent = 0;
+    session->sent = 0;
+
+    session->resolver = resolver;
+    if (!resolver->initialized) {
+        session->state = SESSION_CLOSED;
+        logger_printf("no resolver, session to %s aborted\n",
+            session->destination_host);
+    }
+
+    session->first_mx_reply = NULL;
+
+    session->hosts = hosts;
+    session->hostents[0] = NULL;
+    session->hostents[1] = NULL;
+    session->literal.h_addr_list = NULL;
+    session->resolving = 0;
+    session->attempts_size = 0;
+    for (size_t i = 0; i < SESSION_ATTEMPTS; ++i) {
+        struct session_attempt *attempt = &session->attempts[i];
+        attempt->session = session;
+        event_handler_initialize(&attempt->handler, attempt_notify);
+        attempt->fd = -1;
+    }
+    event_timer_initialize(&session->attempt_timer, attempt_timer_expire);
+
+    session->fd = -1;
+    session->zerocopy = false;
+    session->zerocopy_sent = false;
+    // UNIX-domain sockets have no TCP options to tune.
+    static struct tcp_options const no_tcp_options;
+    session->tcp_options = &no_tcp_options;
+    if (!route || route->family != AF_UNIX) {
+        session->tcp_options = tcp_options_find(&settings.tcp_options,
+            route ? route->host : destination_host);
     }
+    session->corked = false;
+
+    session->tls = tls;
+    session->ssl = NULL;
+    session->tls_events = 0;
+
+    session->response_capacity = 0;
+    session->response_size = 0;
+    session->response_buffer = NULL;
+    session->response_lines_capacity = 0;
+    session->response_lines = NULL;
+    reset_response(session);
+
+    session->extensions = 0;
+    session->resuming = false;
+    session->established = false;
+
+    for (size_t i = 0; i < 2; ++i) {
+        struct session_request *request = &session->requests[i];
+        request->capacity = 0;
+        request->buffer = NULL;
+        request->parts_capacity = 0;
+        request->parts = NULL;
+        request->message = NULL;
+        clear_request(request);
+    }
+    session->request = &session->requests[0];
+    session->streaming = false;
+    session->payload_offset = 0;
+    session->body_window = NULL;
+
+    TAILQ_INIT(&session->messages);
+    __atomic_store_n(&session->messages_size, 0, __ATOMIC_RELAXED);
+    session->accepted_capacity = 0;
+    session->accepted = NULL;
+
+    logger_printf("initialized session to %s\n", session->destination_host);
+
+    session->route = route;
+    session->port = route ? route->port : 25;
+    if (route && route->family != AF_UNSPEC) {
+        size_t length = route->family == AF_INET6
+            ? sizeof(route->address.in6) : sizeof(route->address.in);
+        memcpy(session->literal_address, &route->address, length);
+        session->literal_addrs[0] = session->literal_address;
+        session->literal_addrs[1] = NULL;
+        session->literal = (struct hostent){
+            .h_name = route->host,
+            .h_aliases = &session->literal_addrs[1],
+            .h_addrtype = route->family,
+            .h_length = length,
+            .h_addr_list = session->literal_addrs,
+        };
+    }
+
+    if (session->state == SESSION_RESOLVING_DNS) {
+        if (route) {
+            // The next hop stands in for the mail exchangers of the domain.
+            session->implicit_mx_reply = (struct ares_mx_reply){
+                .host = route->host,
+            };
+            session->mx_reply = &session->implicit_mx_reply;
+            try_mx_reply(session);
+        } else {
+            resolver_query(session->resolver, session->destination_host,
+                ns_t_mx, mx_search_callback, session);
+        }
+    }
+
+    update(session);
 }
 
 void session_enqueue_message(struct session *session,
-    struct message* message)
+    struct message* message, struct message_destination *destination)
 {
-    struct session_message *session_message = malloc(sizeof(*message));
+    struct session_message *session_message =
+        malloc(sizeof(*session_message));
     if (!session_message) {
         die("`malloc(%zu)` failed: %s\n",
             sizeof(*session_message), strerror(errno));
     }
     session_message->self = message_retain(message);
+    session_message->destination = destination;
     TAILQ_INSERT_TAIL(&session->messages, session_message, link);
+    __atomic_add_fetch(&session->messages_size, 1, __ATOMIC_RELAXED);
+
+    if (session->state == SESSION_IDLE) {
+        dispatch(session);
+        update(session);
+    }
+}
+
+void session_quit_idle(struct session *session) {
+    if (session->state != SESSION_IDLE) { return; }
+    dispatch(session);
+    update(session);
 }
 
 void session_finalize(struct session *session) {
-    if (session->channel_initialized) {
-        ares_cancel(session->channel);
+    if (session->loop->ring) {
+        io_ring_cancel(session->loop->ring, &session->recv_request);
+        io_ring_cancel(session->loop->ring, &session->send_request);
     }
+    event_loop_remove(session->loop, &session->handler);
+    event_loop_cancel(session->loop, &session->handler);
+    event_loop_disarm(session->loop, &session->timer);
+    abandon_attempts(session);
+
+    message_remove_observer(&session->message_observer);
+
+    resolver_cancel(session->resolver, session);
 
     while (true) {
         struct session_message *message = TAILQ_FIRST(&session->messages);
@@ -726,23 +2398,27 @@ void session_finalize(struct session *session) {
         free(message);
     }
 
-    free(session->request_buffer);
+    for (size_t i = 0; i < 2; ++i) {
+        clear_request(&session->requests[i]);
+        free(session->requests[i].buffer);
+        free(session->requests[i].parts);
+    }
+    free(session->body_window);
 
     free(session->response_buffer);
+    free(session->response_lines);
+    free(session->accepted);
 
+    close_tls(session);
     if (session->fd != -1 && close(session->fd)) {
         die("`close(%d)` failed: %s\n", session->fd, strerror(errno));
     }
 
-    ares_free_hostent(session->hostent);
+    free_hostent(session, 0);
+    free_hostent(session, 1);
 
     ares_free_data(session->first_mx_reply);
 
-    if (session->channel_initialized) {
-        ares_destroy(session->channel);
-    }
-
-    ares_library_cleanup();
 
     logger_printf("finalized session to %s\n", session->destination_host);
     free(session->destination_host);
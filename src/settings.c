@@ -1,8 +1,12 @@
 #include <settings.h>
 
+#include <die.h>
+
 #include <unistd.h>
 
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
 struct settings settings;
 
@@ -21,14 +25,51 @@ static char *get_env_var(char const *name, char *default_value) {
     return default_value;
 }
 
+static size_t get_size_env_var(char const *name, char *default_value,
+    size_t min_value, size_t max_value)
+{
+    char *value = get_env_var(name, default_value);
+    char *end;
+    errno = 0;
+    unsigned long result = strtoul(value, &end, 10);
+    if (errno || end == value || *end || result < min_value ||
+        result > max_value)
+    {
+        die("invalid %s value \"%s\"\n", name, value);
+    }
+    return result;
+}
+
 void settings_initialize(int argc, char *argv[]) {
     settings.log_path = get_env_var("SMTP_CLIENT_LOG", "/dev/stderr");
     settings.maildir_path = get_env_var("SMTP_MAILDIR", "maildir");
     settings.host = get_env_var("SMTP_HOST", "localhost");
+    settings.io_engine = get_env_var("SMTP_IO_ENGINE", "epoll");
+    settings.workers = get_size_env_var("SMTP_WORKERS", "0", 0, 1024);
+    settings.idle_timeout =
+        get_size_env_var("SMTP_IDLE_TIMEOUT", "5", 0, 24 * 60 * 60);
+    settings.max_sessions =
+        get_size_env_var("SMTP_MAX_SESSIONS", "256", 1, 65536);
+    settings.max_destination_sessions =
+        get_size_env_var("SMTP_MAX_DESTINATION_SESSIONS", "4", 1, 1024);
+    settings.retry_interval =
+        get_size_env_var("SMTP_RETRY_INTERVAL", "60", 1, 24 * 60 * 60);
+    settings.max_retry_interval = get_size_env_var("SMTP_MAX_RETRY_INTERVAL",
+        "3600", settings.retry_interval, 7 * 24 * 60 * 60);
+    settings.max_message_age = get_size_env_var("SMTP_MAX_MESSAGE_AGE",
+        "432000", 1, 365 * 24 * 60 * 60);
+    settings.retry_rate =
+        get_size_env_var("SMTP_RETRY_RATE", "20", 1, 100000);
+    settings.starttls = get_size_env_var("SMTP_STARTTLS", "1", 0, 1);
+    tcp_options_table_initialize(&settings.tcp_options,
+        get_env_var("SMTP_TCP_OPTIONS", ""));
+    transport_map_initialize(&settings.transport_map,
+        get_env_var("SMTP_TRANSPORT_MAP", ""));
 }
 
 void settings_finalize() {
-
+    transport_map_finalize(&settings.transport_map);
+    tcp_options_table_finalize(&settings.tcp_options);
 }
 
 /*! \file */
@@ -3,7 +3,6 @@
 #include <die.h>
 
 #include <sys/signalfd.h>
-#include <poll.h>
 #include <unistd.h>
 
 #include <string.h>
@@ -11,7 +10,24 @@
 
 struct signal_handler signal_handler;
 
-void signal_handler_initialize() {
+static void notify(struct event_handler *handler, uint32_t events) {
+    if (!(events & EPOLLIN)) { return; }
+
+    int fd = signal_handler.handler.fd;
+    struct signalfd_siginfo siginfo;
+    if (read(fd, &siginfo, sizeof(siginfo)) != sizeof(siginfo))
+    { die("`read(signal_handler.handler.fd, /*...*/)` failed\n"); }
+    switch (siginfo.ssi_signo) {
+        case SIGINT:
+        case SIGQUIT:
+            signal_handler.termination_requested = true;
+            return;
+    }
+    die("unexpected signal read from signal_handler.handler.fd: %s\n",
+        strsignal(siginfo.ssi_signo));
+}
+
+void signal_handler_initialize(struct event_loop *loop) {
     sigset_t sigset;
     if (sigemptyset(&sigset)) { die("`sigemptyset(/*...*/)` failed\n"); }
     if (sigaddset(&sigset, SIGINT)) {
@@ -24,37 +40,33 @@ void signal_handler_initialize() {
     if (sigprocmask(SIG_BLOCK, &sigset, &signal_handler.sigset)) {
         die("`sigprocmask(SIG_BLOCK, /*...*/)` failed: %s\n", strerror(errno));
     }
-    signal_handler.fd = signalfd(-1, &sigset, 0);
-    if (signal_handler.fd == -1) {
+    int fd = signalfd(-1, &sigset, 0);
+    if (fd == -1) {
         die("`signalfd(/*...*/)` failed: %s\n", strerror(errno));
     }
 
-    signal_handler.termination_requested = false;
-}
-
-void signal_handler_subscribe(struct fd_set *fd_set) {
-    fd_set_add(fd_set, signal_handler.fd, POLLIN, -1);
-}
+    // Writes to a connection the peer has reset fail with `EPIPE` instead,
+    // also those OpenSSL makes on the sessions' behalf.
+    if (sigaction(SIGPIPE, &(struct sigaction){ .sa_handler = SIG_IGN },
+                  &signal_handler.sigpipe_action))
+    {
+        die("`sigaction(SIGPIPE, /*...*/)` failed: %s\n", strerror(errno));
+    }
 
-void signal_handler_notify(struct fd_set const *fd_set) {
-    if (!fd_set_get_events(fd_set, signal_handler.fd)) { return; }
+    signal_handler.loop = loop;
+    event_handler_initialize(&signal_handler.handler, notify);
+    event_loop_add(loop, &signal_handler.handler, fd, EPOLLIN);
 
-    struct signalfd_siginfo siginfo;
-    if (read(signal_handler.fd, &siginfo,
-             sizeof(siginfo)) != sizeof(siginfo))
-    { die("`read(signal_handler->fd, /*...*/)` failed\n"); }
-    switch (siginfo.ssi_signo) {
-        case SIGINT:
-        case SIGQUIT:
-            signal_handler.termination_requested = true;
-            return;
-    }
-    die("unexpected signal read from signal_handler->fd: %s\n",
-        strsignal(siginfo.ssi_signo));
+    signal_handler.termination_requested = false;
 }
 
 void signal_handler_finalize() {
-    close(signal_handler.fd);
+    int fd = signal_handler.handler.fd;
+    event_loop_remove(signal_handler.loop, &signal_handler.handler);
+    close(fd);
+    if (sigaction(SIGPIPE, &signal_handler.sigpipe_action, NULL)) {
+        die("`sigaction(SIGPIPE, /*...*/)` failed: %s\n", strerror(errno));
+    }
     if (sigprocmask(SIG_SETMASK, &signal_handler.sigset, NULL)) {
         die("`sigprocmask(SIG_SETMASK, /*...*/, NULL)` failed: %s\n",
             strerror(errno));
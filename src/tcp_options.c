@@ -0,0 +1,115 @@
+#include <tcp_options.h>
+
+#include <die.h>
+#include <domain_pattern.h>
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+struct tcp_options_rule {
+    char *pattern;
+    struct tcp_options options;
+};
+
+static bool parse_option(struct tcp_options *options, char const *option) {
+    static char const lowat[] = "notsent_lowat=";
+    if (!strncmp(option, lowat, sizeof(lowat) - 1)) {
+        char const *value = option + sizeof(lowat) - 1;
+        char *end;
+        errno = 0;
+        unsigned long result = strtoul(value, &end, 10);
+        if (errno || end == value || *end || result > INT_MAX) {
+            return false;
+        }
+        options->notsent_lowat = result;
+        return true;
+    }
+
+    bool enable = strncmp(option, "no", 2);
+    char const *name = enable ? option : option + 2;
+    if (!strcmp(name, "nodelay")) {
+        options->nodelay = enable;
+    } else if (!strcmp(name, "cork")) {
+        options->cork = enable;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void tcp_options_table_initialize(struct tcp_options_table *table,
+    char const *spec)
+{
+    table->defaults = (struct tcp_options){
+        .nodelay = true,
+        .cork = true,
+        .notsent_lowat = 128 * 1024,
+    };
+    table->rules_size = 0;
+    table->rules = NULL;
+
+    char *copy = strdup(spec);
+    if (!copy) {
+        die("`strdup(\"%s\")` failed: %s\n", spec, strerror(errno));
+    }
+
+    char *rule_state;
+    for (char *text = strtok_r(copy, " \t\n", &rule_state); text;
+         text = strtok_r(NULL, " \t\n", &rule_state))
+    {
+        char *colon = strchr(text, ':');
+        if (!colon || colon == text) {
+            die("invalid TCP options rule \"%s\"\n", text);
+        }
+        *colon = '\0';
+
+        table->rules = realloc(table->rules,
+            (table->rules_size + 1) * sizeof(*table->rules));
+        if (!table->rules) {
+            die("`realloc(/* ... */, %zu)` failed: %s\n",
+                (table->rules_size + 1) * sizeof(*table->rules),
+                strerror(errno));
+        }
+        struct tcp_options_rule *rule = &table->rules[table->rules_size++];
+        rule->pattern = strdup(text);
+        if (!rule->pattern) {
+            die("`strdup(\"%s\")` failed: %s\n", text, strerror(errno));
+        }
+        rule->options = table->defaults;
+
+        char *option_state;
+        for (char *option = strtok_r(colon + 1, ",", &option_state); option;
+             option = strtok_r(NULL, ",", &option_state))
+        {
+            if (!parse_option(&rule->options, option)) {
+                die("invalid TCP option \"%s\" for %s\n", option, text);
+            }
+        }
+    }
+
+    free(copy);
+}
+
+struct tcp_options const *tcp_options_find(
+    struct tcp_options_table const *table, char const *domain)
+{
+    size_t domain_len = strlen(domain);
+    for (size_t i = 0; i < table->rules_size; ++i) {
+        if (domain_pattern_matches(table->rules[i].pattern, domain,
+                                   domain_len))
+        { return &table->rules[i].options; }
+    }
+    return &table->defaults;
+}
+
+void tcp_options_table_finalize(struct tcp_options_table *table) {
+    for (size_t i = 0; i < table->rules_size; ++i) {
+        free(table->rules[i].pattern);
+    }
+    free(table->rules);
+}
+
+
+/*! \file */
@@ -0,0 +1,195 @@
+#include <tls.h>
+
+#include <die.h>
+
+#include <openssl/err.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+
+enum {
+    TLS_CACHE_SIZE = 1024,
+    // Seconds before STARTTLS is tried again with a host that failed it.
+    TLS_RETRY_INTERVAL = 60 * 60,
+};
+
+struct tls_cache_entry {
+    TAILQ_ENTRY(tls_cache_entry) link;
+    char *host;
+    SSL_SESSION *session;
+    // Zero unless the last handshake failed.
+    time_t failed_at;
+};
+
+static void lock(struct tls *tls) {
+    int error = pthread_mutex_lock(&tls->mutex);
+    if (error) {
+        die("`pthread_mutex_lock(/* ... */)` failed: %s\n", strerror(error));
+    }
+}
+
+static void unlock(struct tls *tls) {
+    int error = pthread_mutex_unlock(&tls->mutex);
+    if (error) {
+        die("`pthread_mutex_unlock(/* ... */)` failed: %s\n",
+            strerror(error));
+    }
+}
+
+static void free_entry(struct tls_cache_entry *entry) {
+    SSL_SESSION_free(entry->session);
+    free(entry->host);
+    free(entry);
+}
+
+static struct tls_cache_entry *find_entry(struct tls *tls, char const *host,
+    bool create)
+{
+    struct tls_cache_entry *entry = TAILQ_FIRST(&tls->entries);
+    while (entry && strcasecmp(entry->host, host)) {
+        entry = TAILQ_NEXT(entry, link);
+    }
+    if (entry) {
+        TAILQ_REMOVE(&tls->entries, entry, link);
+        TAILQ_INSERT_HEAD(&tls->entries, entry, link);
+        return entry;
+    }
+    if (!create) { return NULL; }
+
+    entry = malloc(sizeof(*entry));
+    if (!entry) {
+        die("`malloc(%zu)` failed: %s\n", sizeof(*entry), strerror(errno));
+    }
+    entry->host = strdup(host);
+    if (!entry->host) {
+        die("`strdup(\"%s\")` failed: %s\n", host, strerror(errno));
+    }
+    entry->session = NULL;
+    entry->failed_at = 0;
+    TAILQ_INSERT_HEAD(&tls->entries, entry, link);
+
+    if (++tls->entries_size > TLS_CACHE_SIZE) {
+        struct tls_cache_entry *last =
+            TAILQ_LAST(&tls->entries, tls_cache_entry_list);
+        TAILQ_REMOVE(&tls->entries, last, link);
+        --tls->entries_size;
+        free_entry(last);
+    }
+    return entry;
+}
+
+// With TLS 1.3 tickets arrive after the handshake, so the cache is filled
+// from OpenSSL's callback rather than once the handshake is done.
+static int new_session(SSL *ssl, SSL_SESSION *session) {
+    struct tls *tls = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+    char const *host = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+    if (!host) { return 0; }
+
+    lock(tls);
+    struct tls_cache_entry *entry = find_entry(tls, host, true);
+    SSL_SESSION_free(entry->session);
+    entry->session = session;
+    entry->failed_at = 0;
+    unlock(tls);
+
+    // The cache keeps the reference.
+    return 1;
+}
+
+void tls_initialize(struct tls *tls) {
+    {
+        int error = pthread_mutex_init(&tls->mutex, NULL);
+        if (error) {
+            die("`pthread_mutex_init(/* ... */)` failed: %s\n",
+                strerror(error));
+        }
+    }
+
+    tls->ctx = SSL_CTX_new(TLS_client_method());
+    if (!tls->ctx) {
+        die("`SSL_CTX_new(TLS_client_method())` failed: %s\n",
+            ERR_error_string(ERR_get_error(), NULL));
+    }
+    SSL_CTX_set_app_data(tls->ctx, tls);
+
+    // Opportunistic encryption (RFC 7435), the peer is not authenticated.
+    SSL_CTX_set_verify(tls->ctx, SSL_VERIFY_NONE, NULL);
+    // Records are encrypted by the kernel where it supports kTLS. Many
+    // servers close right after the QUIT reply without a close_notify,
+    // which must not cost the TLS session its resumability.
+    SSL_CTX_set_options(tls->ctx,
+        SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF);
+    SSL_CTX_set_mode(tls->ctx,
+        SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_CTX_set_session_cache_mode(tls->ctx,
+        SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(tls->ctx, new_session);
+
+    tls->entries_size = 0;
+    TAILQ_INIT(&tls->entries);
+}
+
+bool tls_usable(struct tls *tls, char const *host) {
+    lock(tls);
+    struct tls_cache_entry *entry = find_entry(tls, host, false);
+    bool usable = !entry || !entry->failed_at ||
+        time(NULL) - entry->failed_at >= TLS_RETRY_INTERVAL;
+    unlock(tls);
+    return usable;
+}
+
+SSL *tls_connect(struct tls *tls, int fd, char const *host) {
+    SSL *ssl = SSL_new(tls->ctx);
+    if (!ssl) {
+        die("`SSL_new(/* ... */)` failed: %s\n",
+            ERR_error_string(ERR_get_error(), NULL));
+    }
+    if (!SSL_set_fd(ssl, fd)) {
+        die("`SSL_set_fd(/* ... */, %d)` failed: %s\n",
+            fd, ERR_error_string(ERR_get_error(), NULL));
+    }
+    // Names OpenSSL refuses for SNI are simply not sent, nor cached.
+    if (!SSL_set_tlsext_host_name(ssl, host)) { ERR_clear_error(); }
+
+    lock(tls);
+    struct tls_cache_entry *entry = find_entry(tls, host, false);
+    if (entry && entry->session) { SSL_set_session(ssl, entry->session); }
+    unlock(tls);
+
+    SSL_set_connect_state(ssl);
+    return ssl;
+}
+
+void tls_mark_failed(struct tls *tls, char const *host) {
+    lock(tls);
+    struct tls_cache_entry *entry = find_entry(tls, host, true);
+    SSL_SESSION_free(entry->session);
+    entry->session = NULL;
+    entry->failed_at = time(NULL);
+    unlock(tls);
+}
+
+void tls_finalize(struct tls *tls) {
+    while (true) {
+        struct tls_cache_entry *entry = TAILQ_FIRST(&tls->entries);
+        if (!entry) { break; }
+        TAILQ_REMOVE(&tls->entries, entry, link);
+        free_entry(entry);
+    }
+
+    SSL_CTX_free(tls->ctx);
+
+    {
+        int error = pthread_mutex_destroy(&tls->mutex);
+        if (error) {
+            die("`pthread_mutex_destroy(/* ... */)` failed: %s\n",
+                strerror(error));
+        }
+    }
+}
+
+
+/*! \file */
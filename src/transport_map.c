@@ -0,0 +1,233 @@
+#include <transport_map.h>
+
+#include <die.h>
+#include <domain_pattern.h>
+#include <masprintf.h>
+
+#include <arpa/inet.h>
+#include <sys/un.h>
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+
+struct transport_map_entry {
+    char *pattern;
+    // NULL for "direct".
+    struct transport_route *route;
+};
+
+static void free_route(struct transport_route *route) {
+    free(route->next_hop);
+    free(route->host);
+    free(route);
+}
+
+static bool parse_port(char const *text, uint16_t *port) {
+    char *end;
+    errno = 0;
+    unsigned long result = strtoul(text, &end, 10);
+    if (errno || end == text || *end || !result || result > 65535) {
+        return false;
+    }
+    *port = result;
+    return true;
+}
+
+static struct transport_route *allocate_route(void) {
+    struct transport_route *route = malloc(sizeof(*route));
+    if (!route) {
+        die("`malloc(%zu)` failed: %s\n", sizeof(*route), strerror(errno));
+    }
+    return route;
+}
+
+static struct transport_route *parse_socket_route(char const *path) {
+    if (strlen(path) >= sizeof(((struct sockaddr_un*)NULL)->sun_path)) {
+        return NULL;
+    }
+    struct transport_route *route = allocate_route();
+    route->lmtp = true;
+    route->port = 0;
+    route->family = AF_UNIX;
+    route->host = strdup(path);
+    if (!route->host) {
+        die("`strdup(\"%s\")` failed: %s\n", path, strerror(errno));
+    }
+    route->next_hop = masprintf("lmtp:%s", path);
+    return route;
+}
+
+// Returns NULL if `text` is no valid next hop.
+static struct transport_route *parse_route(char *text) {
+    static char const lmtp_prefix[] = "lmtp:";
+    bool lmtp = !strncmp(text, lmtp_prefix, sizeof(lmtp_prefix) - 1);
+    if (lmtp) {
+        text += sizeof(lmtp_prefix) - 1;
+        if (*text == '/') { return parse_socket_route(text); }
+    }
+
+    char *host = text;
+    char *port = NULL;
+    bool bracketed = *text == '[';
+    if (bracketed) {
+        char *end = strchr(text, ']');
+        if (!end || (end[1] && end[1] != ':')) { return NULL; }
+        host = text + 1;
+        *end = '\0';
+        if (end[1]) { port = end + 2; }
+    } else {
+        char *colon = strchr(text, ':');
+        if (colon) {
+            *colon = '\0';
+            port = colon + 1;
+        }
+    }
+    if (!*host) { return NULL; }
+
+    struct transport_route *route = allocate_route();
+    route->lmtp = lmtp;
+    // RFC 2033 keeps LMTP off port 25, 24 being the one usually taken.
+    route->port = lmtp ? 24 : 25;
+    if (port && !parse_port(port, &route->port)) {
+        free(route);
+        return NULL;
+    }
+
+    if (inet_pton(AF_INET6, host, &route->address.in6) == 1) {
+        route->family = AF_INET6;
+    } else if (inet_pton(AF_INET, host, &route->address.in) == 1) {
+        route->family = AF_INET;
+    } else if (bracketed) {
+        free(route);
+        return NULL;
+    } else {
+        route->family = AF_UNSPEC;
+    }
+
+    route->host = strdup(host);
+    if (!route->host) {
+        die("`strdup(\"%s\")` failed: %s\n", host, strerror(errno));
+    }
+    route->next_hop = masprintf(
+        route->family == AF_INET6 ? "%s[%s]:%u" : "%s%s:%u",
+        lmtp ? lmtp_prefix : "", route->host, (unsigned)route->port);
+    return route;
+}
+
+// Lines naming the same next hop share its route.
+static struct transport_route *add_route(struct transport_map *map,
+    struct transport_route *route)
+{
+    for (size_t i = 0; i < map->routes_size; ++i) {
+        if (!strcasecmp(map->routes[i]->next_hop, route->next_hop)) {
+            free_route(route);
+            return map->routes[i];
+        }
+    }
+
+    map->routes = realloc(map->routes,
+        (map->routes_size + 1) * sizeof(*map->routes));
+    if (!map->routes) {
+        die("`realloc(/* ... */, %zu)` failed: %s\n",
+            (map->routes_size + 1) * sizeof(*map->routes), strerror(errno));
+    }
+    map->routes[map->routes_size++] = route;
+    return route;
+}
+
+static void add_entry(struct transport_map *map, char const *pattern,
+    struct transport_route *route)
+{
+    map->entries = realloc(map->entries,
+        (map->entries_size + 1) * sizeof(*map->entries));
+    if (!map->entries) {
+        die("`realloc(/* ... */, %zu)` failed: %s\n",
+            (map->entries_size + 1) * sizeof(*map->entries),
+            strerror(errno));
+    }
+    struct transport_map_entry *entry = &map->entries[map->entries_size++];
+    entry->pattern = strdup(pattern);
+    if (!entry->pattern) {
+        die("`strdup(\"%s\")` failed: %s\n", pattern, strerror(errno));
+    }
+    entry->route = route;
+}
+
+void transport_map_initialize(struct transport_map *map, char const *path) {
+    map->entries_size = 0;
+    map->entries = NULL;
+    map->routes_size = 0;
+    map->routes = NULL;
+    if (!*path) { return; }
+
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        die("`fopen(\"%s\", \"r\")` failed: %s\n", path, strerror(errno));
+    }
+
+    char *line = NULL;
+    size_t line_capacity = 0;
+    for (size_t line_number = 1; ; ++line_number) {
+        errno = 0;
+        if (getline(&line, &line_capacity, file) == -1) {
+            if (errno) {
+                die("`getline(/* ... */)` failed on %s: %s\n",
+                    path, strerror(errno));
+            }
+            break;
+        }
+        char *comment = strchr(line, '#');
+        if (comment) { *comment = '\0'; }
+
+        char *state;
+        char *pattern = strtok_r(line, " \t\r\n", &state);
+        if (!pattern) { continue; }
+        char *next_hop = strtok_r(NULL, " \t\r\n", &state);
+        if (!next_hop || strtok_r(NULL, " \t\r\n", &state)) {
+            die("%s:%zu: expected a pattern and a next hop\n",
+                path, line_number);
+        }
+
+        struct transport_route *route = NULL;
+        if (strcmp(next_hop, "direct")) {
+            route = parse_route(next_hop);
+            if (!route) {
+                die("%s:%zu: invalid next hop\n", path, line_number);
+            }
+            route = add_route(map, route);
+        }
+        add_entry(map, pattern, route);
+    }
+
+    free(line);
+    fclose(file);
+}
+
+struct transport_route const *transport_map_find(
+    struct transport_map const *map, char const *domain, size_t domain_len)
+{
+    for (size_t i = 0; i < map->entries_size; ++i) {
+        if (domain_pattern_matches(map->entries[i].pattern, domain,
+                                   domain_len))
+        { return map->entries[i].route; }
+    }
+    return NULL;
+}
+
+void transport_map_finalize(struct transport_map *map) {
+    for (size_t i = 0; i < map->entries_size; ++i) {
+        free(map->entries[i].pattern);
+    }
+    free(map->entries);
+    for (size_t i = 0; i < map->routes_size; ++i) {
+        free_route(map->routes[i]);
+    }
+    free(map->routes);
+}
+
+
+/*! \file */
@@ -0,0 +1,224 @@
+#include <worker_pool.h>
+
+#include <logger.h>
+#include <die.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+static void lock(struct worker_pool *pool) {
+    int error = pthread_mutex_lock(&pool->mutex);
+    if (error) {
+        die("`pthread_mutex_lock(/* ... */)` failed: %s\n", strerror(error));
+    }
+}
+
+static void unlock(struct worker_pool *pool) {
+    int error = pthread_mutex_unlock(&pool->mutex);
+    if (error) {
+        die("`pthread_mutex_unlock(/* ... */)` failed: %s\n",
+            strerror(error));
+    }
+}
+
+static size_t get_load(struct worker *worker) {
+    return __atomic_load_n(&worker->load, __ATOMIC_RELAXED);
+}
+
+static struct worker_task *take_task(struct worker *worker) {
+    struct worker_pool *pool = worker->pool;
+
+    struct worker *victim = worker;
+    if (!worker->pending_size) {
+        // Steal from the longest queue so a busy loop does not sit on
+        // sessions an idle one could already be connecting.
+        for (size_t i = 0; i < pool->size; ++i) {
+            if (pool->workers[i].pending_size > victim->pending_size) {
+                victim = &pool->workers[i];
+            }
+        }
+        if (!victim->pending_size) { return NULL; }
+    }
+
+    struct worker_task *task = STAILQ_FIRST(&victim->pending);
+    STAILQ_REMOVE_HEAD(&victim->pending, link);
+    --victim->pending_size;
+    if (victim != worker) {
+        __atomic_sub_fetch(&victim->load, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&worker->load, 1, __ATOMIC_RELAXED);
+    }
+    return task;
+}
+
+static void intake_notify(struct event_handler *handler, uint32_t events) {
+    struct worker *worker =
+        container_of(handler, struct worker, intake_handler);
+    (void)events;
+
+    if (__atomic_load_n(&worker->stopping, __ATOMIC_ACQUIRE)) { return; }
+
+    lock(worker->pool);
+    struct worker_task *task = take_task(worker);
+    unlock(worker->pool);
+    if (!task) { return; }
+
+    task->start(task, worker);
+    // One task per round, the rest may still go to a less loaded worker.
+    event_loop_schedule(worker->loop, &worker->intake_handler);
+}
+
+static void *thread_body(void *arg) {
+    struct worker *worker = arg;
+
+    // Wait until `worker_pool_initialize` has published `thread`.
+    lock(worker->pool);
+    unlock(worker->pool);
+
+    while (!__atomic_load_n(&worker->stopping, __ATOMIC_ACQUIRE)) {
+        event_loop_run(worker->loop);
+    }
+    return NULL;
+}
+
+void worker_task_initialize(struct worker_task *task,
+    void (*start)(struct worker_task *task, struct worker *worker))
+{
+    task->start = start;
+}
+
+void worker_pool_initialize(struct worker_pool *pool, struct event_loop *loop,
+    size_t size, bool io_ring)
+{
+    {
+        int error = pthread_mutex_init(&pool->mutex, NULL);
+        if (error) {
+            die("`pthread_mutex_init(/* ... */)` failed: %s\n",
+                strerror(error));
+        }
+    }
+
+    pool->threaded = size > 0;
+    pool->size = pool->threaded ? size : 1;
+    pool->workers = calloc(pool->size, sizeof(*pool->workers));
+    if (!pool->workers) {
+        die("`calloc(%zu, %zu)` failed: %s\n",
+            pool->size, sizeof(*pool->workers), strerror(errno));
+    }
+
+    for (size_t i = 0; i < pool->size; ++i) {
+        struct worker *worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->stopping = false;
+        worker->load = 0;
+        worker->pending_size = 0;
+        STAILQ_INIT(&worker->pending);
+        event_handler_initialize(&worker->intake_handler, intake_notify);
+
+        if (!pool->threaded) {
+            worker->loop = loop;
+            continue;
+        }
+
+        worker->loop = &worker->own_loop;
+        event_loop_initialize(worker->loop);
+        if (io_ring) {
+            if (io_ring_initialize(&worker->ring, worker->loop, 256)) {
+                logger_printf("`io_ring_initialize(/*...*/, 256)` failed: "
+                    "%s\n  worker %zu falls back to the epoll I/O engine\n",
+                    strerror(errno), i);
+            } else {
+                worker->loop->ring = &worker->ring;
+            }
+        }
+    }
+    if (!pool->threaded) { return; }
+
+    lock(pool);
+    for (size_t i = 0; i < pool->size; ++i) {
+        struct worker *worker = &pool->workers[i];
+        int error = pthread_create(&worker->thread, NULL, thread_body, worker);
+        if (error) {
+            die("`pthread_create(/* ... */)` failed: %s\n", strerror(error));
+        }
+        worker->loop->thread = worker->thread;
+    }
+    unlock(pool);
+}
+
+void worker_pool_submit(struct worker_pool *pool, struct worker_task *task) {
+    lock(pool);
+
+    struct worker *target = &pool->workers[0];
+    for (size_t i = 1; i < pool->size; ++i) {
+        if (get_load(&pool->workers[i]) < get_load(target)) {
+            target = &pool->workers[i];
+        }
+    }
+    STAILQ_INSERT_TAIL(&target->pending, task, link);
+    ++target->pending_size;
+    __atomic_add_fetch(&target->load, 1, __ATOMIC_RELAXED);
+
+    // Idle workers get a chance to steal the task before its owner is free.
+    for (size_t i = 0; i < pool->size; ++i) {
+        struct worker *worker = &pool->workers[i];
+        if (worker == target || !get_load(worker)) {
+            event_loop_post(worker->loop, &worker->intake_handler);
+        }
+    }
+
+    unlock(pool);
+}
+
+void worker_pool_finish(struct worker *worker) {
+    __atomic_sub_fetch(&worker->load, 1, __ATOMIC_RELAXED);
+    event_loop_schedule(worker->loop, &worker->intake_handler);
+}
+
+void worker_pool_stop(struct worker_pool *pool) {
+    if (!pool->threaded) { return; }
+
+    for (size_t i = 0; i < pool->size; ++i) {
+        struct worker *worker = &pool->workers[i];
+        __atomic_store_n(&worker->stopping, true, __ATOMIC_RELEASE);
+        event_loop_post(worker->loop, &worker->intake_handler);
+    }
+
+    for (size_t i = 0; i < pool->size; ++i) {
+        int error = pthread_join(pool->workers[i].thread, NULL);
+        if (error) {
+            die("`pthread_join(/* ... */)` failed: %s\n", strerror(error));
+        }
+    }
+
+    // Whatever is left over is finalized from this thread from now on.
+    for (size_t i = 0; i < pool->size; ++i) {
+        pool->workers[i].loop->thread = pthread_self();
+    }
+}
+
+void worker_pool_finalize(struct worker_pool *pool) {
+    for (size_t i = 0; i < pool->size; ++i) {
+        struct worker *worker = &pool->workers[i];
+        event_loop_cancel(worker->loop, &worker->intake_handler);
+        if (!pool->threaded) { continue; }
+
+        event_loop_flush(worker->loop);
+        if (worker->loop->ring) { io_ring_finalize(worker->loop->ring); }
+        event_loop_finalize(worker->loop);
+    }
+
+    free(pool->workers);
+
+    {
+        int error = pthread_mutex_destroy(&pool->mutex);
+        if (error) {
+            die("`pthread_mutex_destroy(/* ... */)` failed: %s\n",
+                strerror(error));
+        }
+    }
+}
+
+
+/*! \file */
@@ -0,0 +1,169 @@
+// Reloads a queue index after appends, removals, a torn tail and a rewrite,
+// checking that exactly the intact records come back.
+#include <queue_index.h>
+#include <logger.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum { MAX_LOADED = 16 };
+
+struct loaded {
+    char name[32];
+    bool removed;
+    uint32_t attempts;
+    char domains[64];
+    size_t domains_len;
+    char deferred[64];
+    size_t deferred_len;
+};
+
+static struct loaded loaded[MAX_LOADED];
+static size_t loaded_size;
+
+static size_t torn;
+
+// The index only logs what it cuts off, which is counted instead.
+void logger_printf(char const *format, ...) {
+    if (strstr(format, "torn")) { ++torn; }
+}
+
+static void expect(bool condition, char const *what) {
+    if (condition) { return; }
+    fprintf(stderr, "queue index: %s\n", what);
+    exit(EXIT_FAILURE);
+}
+
+static void load(void *arg, struct queue_index_entry const *entry,
+    bool removed)
+{
+    (void)arg;
+    expect(loaded_size < MAX_LOADED, "more records than were written");
+    struct loaded *record = &loaded[loaded_size++];
+    snprintf(record->name, sizeof(record->name), "%s", entry->name);
+    record->removed = removed;
+    record->attempts = entry->attempts;
+    record->domains_len = entry->domains_len;
+    memcpy(record->domains, entry->domains, entry->domains_len);
+    record->deferred_len = entry->deferred_len;
+    memcpy(record->deferred, entry->deferred, entry->deferred_len);
+}
+
+static void reload(struct queue_index *index, char const *path) {
+    loaded_size = 0;
+    queue_index_initialize(index, path, load, NULL);
+}
+
+static off_t file_size(char const *path) {
+    struct stat st;
+    expect(!stat(path, &st), "the index is gone");
+    return st.st_size;
+}
+
+static void add(struct queue_index *index, char const *name,
+    uint32_t attempts)
+{
+    static char const domains[] = "example.test\0other.test";
+    static char const deferred[] = "temp@other.test";
+    queue_index_add(index, &(struct queue_index_entry){
+        .name = name,
+        .inode = 1,
+        .sender = "a@src.test",
+        .sender_len = strlen("a@src.test"),
+        .domains = domains,
+        .domains_len = sizeof(domains),
+        .attempts = attempts,
+        .deferred = attempts ? deferred : NULL,
+        .deferred_len = attempts ? sizeof(deferred) : 0,
+    });
+}
+
+static void expect_loaded(size_t i, char const *name, bool removed,
+    uint32_t attempts)
+{
+    expect(i < loaded_size, "a record is missing");
+    expect(!strcmp(loaded[i].name, name), "a record is out of order");
+    expect(loaded[i].removed == removed, "a removal is mixed up");
+    expect(loaded[i].attempts == attempts, "the attempts are lost");
+    if (removed) { return; }
+    expect(loaded[i].domains_len == sizeof("example.test\0other.test") &&
+           !memcmp(loaded[i].domains, "example.test\0other.test",
+               loaded[i].domains_len), "the domains are garbled");
+    expect(attempts ? loaded[i].deferred_len == sizeof("temp@other.test")
+                    : !loaded[i].deferred_len,
+           "the deferred recipients are garbled");
+}
+
+static void add_live(void *arg, struct queue_index *index) {
+    (void)arg;
+    add(index, "b", 2);
+    add(index, "c", 0);
+    add(index, "e", 0);
+}
+
+int main(void) {
+    char dir[] = "/tmp/queue_index.XXXXXX";
+    expect(mkdtemp(dir), "no temporary directory");
+    char path[64];
+    snprintf(path, sizeof(path), "%s/queue.index", dir);
+
+    struct queue_index index;
+    reload(&index, path);
+    expect(!loaded_size && !index.records, "a new index is not empty");
+    add(&index, "a", 0);
+    add(&index, "b", 0);
+    add(&index, "c", 0);
+    add(&index, "b", 2);
+    queue_index_remove(&index, "a");
+    queue_index_finalize(&index);
+
+    reload(&index, path);
+    expect(loaded_size == 5 && index.records == 5 && index.removals == 1,
+        "records are lost on reload");
+    expect_loaded(0, "a", false, 0);
+    expect_loaded(1, "b", false, 0);
+    expect_loaded(2, "c", false, 0);
+    expect_loaded(3, "b", false, 2);
+    expect_loaded(4, "a", true, 0);
+
+    // A crash in the middle of appending "d".
+    off_t intact = file_size(path);
+    add(&index, "d", 1);
+    queue_index_finalize(&index);
+    off_t appended = file_size(path);
+    expect(!truncate(path, intact + (appended - intact) / 2),
+        "the index cannot be truncated");
+
+    reload(&index, path);
+    expect(torn == 1, "the torn record goes unnoticed");
+    expect(loaded_size == 5 && index.records == 5,
+        "more than the torn record is dropped");
+    expect_loaded(3, "b", false, 2);
+    expect(file_size(path) == intact, "the torn record is not cut off");
+    add(&index, "e", 0);
+    queue_index_finalize(&index);
+
+    reload(&index, path);
+    expect(torn == 1 && loaded_size == 6, "appending after the cut fails");
+    expect_loaded(5, "e", false, 0);
+
+    queue_index_rewrite(&index, add_live, NULL);
+    queue_index_finalize(&index);
+
+    reload(&index, path);
+    expect(loaded_size == 3 && index.records == 3 && !index.removals,
+        "the rewrite keeps stale records");
+    expect_loaded(0, "b", false, 2);
+    expect_loaded(1, "c", false, 0);
+    expect_loaded(2, "e", false, 0);
+    queue_index_finalize(&index);
+
+    unlink(path);
+    rmdir(dir);
+    return EXIT_SUCCESS;
+}